@@ -0,0 +1,103 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Frame escaping codec benchmark
+ *
+ * Measures throughput of hostutils-common codec on random data and on data consisting of special characters only
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hostutils-common/types.h>
+#include <hostutils-common/errors.h>
+#include <hostutils-common/codec.h>
+
+
+#define BENCH_SIZE (1024 * 1024)
+#define BENCH_TIME 0.5 /* s, every case is repeated at least that long */
+
+
+/* BSP2 and legacy BSP escaping schemes */
+static const struct {
+	const char *name;
+	codec_t codec;
+} schemes[] = {
+	{ "bsp2", { 0x7e, 0x7d, 0x20 } },
+	{ "bsp", { 0xaa, 0xdd, 0 } }
+};
+
+
+static double bench_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+/* Function measures scheme on random data (special == 0) or on its mark characters only */
+static void bench_run(const char *name, const codec_t *c, int special, u8 *src, u8 *enc, u8 *dec)
+{
+	struct timespec t0, t1;
+	size_t dlen, slen, n, k;
+	double t;
+	int escfl;
+
+	srand(1);
+	for (k = 0; k < BENCH_SIZE; k++)
+		src[k] = special ? c->mark : rand();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0, t = 0; t < BENCH_TIME; k++) {
+		n = codec_encode(c, enc, src, BENCH_SIZE);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		t = bench_elapsed(&t0, &t1);
+	}
+	printf("%-4s %-8s: encode %8.1f MB/s, ", name, special ? "all mark" : "random", k * BENCH_SIZE / t / (1024 * 1024));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0, t = 0; t < BENCH_TIME; k++) {
+		dlen = BENCH_SIZE;
+		slen = n;
+		escfl = 0;
+		codec_decode(c, dec, &dlen, enc, &slen, &escfl);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		t = bench_elapsed(&t0, &t1);
+	}
+	printf("decode %8.1f MB/s%s\n", k * BENCH_SIZE / t / (1024 * 1024), ((dlen == BENCH_SIZE) && (memcmp(src, dec, BENCH_SIZE) == 0)) ? "" : " (MISMATCH)");
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	u8 *src, *enc, *dec;
+
+	src = malloc(BENCH_SIZE);
+	enc = malloc(2 * BENCH_SIZE);
+	dec = malloc(BENCH_SIZE);
+	if ((src == NULL) || (enc == NULL) || (dec == NULL)) {
+		fprintf(stderr, "codec-bench: Can't allocate buffers\n");
+		free(src);
+		free(enc);
+		free(dec);
+		return ERR_MEM;
+	}
+
+	for (i = 0; i < sizeof(schemes) / sizeof(schemes[0]); i++) {
+		bench_run(schemes[i].name, &schemes[i].codec, 0, src, enc, dec);
+		bench_run(schemes[i].name, &schemes[i].codec, 1, src, enc, dec);
+	}
+
+	free(src);
+	free(enc);
+	free(dec);
+	return 0;
+}
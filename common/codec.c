@@ -0,0 +1,281 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Frame escaping codec (byte stuffing) shared by BSP and BSP2 transports
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <string.h>
+
+#include "hostutils-common/types.h"
+#include "hostutils-common/codec.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define CODEC_X86
+#include <immintrin.h>
+#endif
+
+
+/* Function copies (if dst is not NULL) and sums clean run of src, returns its length */
+static size_t (*run)(u8 *dst, const u8 *src, size_t len, u8 a, u8 b, u32 *sum);
+static u32 (*bytesum)(const u8 *src, size_t len);
+
+
+static size_t codec_runScalar(u8 *dst, const u8 *src, size_t len, u8 a, u8 b, u32 *sum)
+{
+	size_t i;
+	u32 s = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((src[i] == a) || (src[i] == b))
+			break;
+		s += src[i];
+	}
+
+	if (dst != NULL)
+		memcpy(dst, src, i);
+
+	*sum += s;
+	return i;
+}
+
+
+static u32 codec_sumScalar(const u8 *src, size_t len)
+{
+	size_t i;
+	u32 s = 0;
+
+	for (i = 0; i < len; i++)
+		s += src[i];
+
+	return s;
+}
+
+
+#ifdef CODEC_X86
+
+static u32 codec_hsum(__m128i acc)
+{
+	return (u32)_mm_cvtsi128_si32(acc) + (u32)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+
+static size_t codec_runSSE2(u8 *dst, const u8 *src, size_t len, u8 a, u8 b, u32 *sum)
+{
+	__m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b), zero = _mm_setzero_si128(), acc = zero, v;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (m != 0) {
+			*sum += codec_hsum(acc);
+			m = __builtin_ctz(m);
+			return i + codec_runScalar((dst != NULL) ? dst + i : NULL, src + i, m, a, b, sum);
+		}
+		if (dst != NULL)
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+
+	*sum += codec_hsum(acc);
+	return i + codec_runScalar((dst != NULL) ? dst + i : NULL, src + i, len - i, a, b, sum);
+}
+
+
+static u32 codec_sumSSE2(const u8 *src, size_t len)
+{
+	__m128i zero = _mm_setzero_si128(), acc = zero;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(src + i)), zero));
+
+	return codec_hsum(acc) + codec_sumScalar(src + i, len - i);
+}
+
+
+__attribute__((target("avx2"))) static u32 codec_hsum256(__m256i acc)
+{
+	return codec_hsum(_mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+
+__attribute__((target("avx2"))) static size_t codec_runAVX2(u8 *dst, const u8 *src, size_t len, u8 a, u8 b, u32 *sum)
+{
+	__m256i va = _mm256_set1_epi8((char)a), vb = _mm256_set1_epi8((char)b), zero = _mm256_setzero_si256(), acc = zero, v;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+		if (m != 0) {
+			*sum += codec_hsum256(acc);
+			m = __builtin_ctz(m);
+			return i + codec_runSSE2((dst != NULL) ? dst + i : NULL, src + i, m, a, b, sum);
+		}
+		if (dst != NULL)
+			_mm256_storeu_si256((__m256i *)(dst + i), v);
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+
+	*sum += codec_hsum256(acc);
+	return i + codec_runSSE2((dst != NULL) ? dst + i : NULL, src + i, len - i, a, b, sum);
+}
+
+
+__attribute__((target("avx2"))) static u32 codec_sumAVX2(const u8 *src, size_t len)
+{
+	__m256i zero = _mm256_setzero_si256(), acc = zero;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(src + i)), zero));
+
+	return codec_hsum256(acc) + codec_sumSSE2(src + i, len - i);
+}
+
+#endif
+
+
+static void codec_init(void)
+{
+	run = codec_runScalar;
+	bytesum = codec_sumScalar;
+#ifdef CODEC_X86
+	if (__builtin_cpu_supports("avx2")) {
+		run = codec_runAVX2;
+		bytesum = codec_sumAVX2;
+	}
+	else {
+		run = codec_runSSE2;
+		bytesum = codec_sumSSE2;
+	}
+#endif
+}
+
+
+size_t codec_scan(const codec_t *c, const u8 *src, size_t len)
+{
+	u32 s = 0;
+
+	return codec_scansum(c, src, len, &s);
+}
+
+
+size_t codec_scansum(const codec_t *c, const u8 *src, size_t len, u32 *sum)
+{
+	if (run == NULL)
+		codec_init();
+
+	return run(NULL, src, len, c->mark, c->esc, sum);
+}
+
+
+u32 codec_sum(const u8 *src, size_t len)
+{
+	if (bytesum == NULL)
+		codec_init();
+
+	return bytesum(src, len);
+}
+
+
+size_t codec_encode(const codec_t *c, u8 *dst, const u8 *src, size_t len)
+{
+	u32 s = 0;
+
+	return codec_encodesum(c, dst, src, len, &s);
+}
+
+
+size_t codec_encodesum(const codec_t *c, u8 *dst, const u8 *src, size_t len, u32 *sum)
+{
+	u8 *d = dst;
+	size_t n;
+
+	if (run == NULL)
+		codec_init();
+
+	while (len > 0) {
+		/* Copy clean run in bulk */
+		n = run(d, src, len, c->mark, c->esc, sum);
+		d += n;
+		src += n;
+		len -= n;
+
+		/* Escape special characters */
+		while ((len > 0) && ((*src == c->mark) || (*src == c->esc))) {
+			*sum += *src;
+			*d++ = c->esc;
+			*d++ = *src++ ^ c->xor;
+			len--;
+		}
+	}
+
+	return d - dst;
+}
+
+
+int codec_decode(const codec_t *c, u8 *dst, size_t *dlen, const u8 *src, size_t *slen, int *escfl)
+{
+	u32 s = 0;
+
+	return codec_decodesum(c, dst, dlen, src, slen, escfl, &s);
+}
+
+
+int codec_decodesum(const codec_t *c, u8 *dst, size_t *dlen, const u8 *src, size_t *slen, int *escfl, u32 *sum)
+{
+	size_t si = 0, di = 0, n;
+	int res = 0, esc = *escfl;
+
+	if (run == NULL)
+		codec_init();
+
+	while ((si < *slen) && (di < *dlen)) {
+		if (esc) {
+			/* Escaped delimiter is data only if characters are escaped as is */
+			if ((c->xor != 0) && (src[si] == c->mark)) {
+				res = 1;
+				break;
+			}
+			dst[di] = src[si++] ^ c->xor;
+			*sum += dst[di++];
+			esc = 0;
+			continue;
+		}
+
+		if (src[si] == c->mark) {
+			res = 1;
+			break;
+		}
+
+		if (src[si] == c->esc) {
+			esc = 1;
+			si++;
+			continue;
+		}
+
+		/* Copy clean run in bulk */
+		n = (*slen - si < *dlen - di) ? *slen - si : *dlen - di;
+		n = run(dst + di, src + si, n, c->mark, c->esc, sum);
+		si += n;
+		di += n;
+	}
+
+	*slen = si;
+	*dlen = di;
+	*escfl = esc;
+
+	return res;
+}
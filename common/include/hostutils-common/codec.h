@@ -0,0 +1,63 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Frame escaping codec (byte stuffing) shared by BSP and BSP2 transports
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stddef.h>
+#include "types.h"
+
+
+/* Escaping scheme: mark and esc characters are sent as esc followed by (character ^ xor) */
+typedef struct _codec_t {
+	u8 mark; /* frame delimiter */
+	u8 esc;  /* escape character */
+	u8 xor;  /* 0 - escaped character is sent as is */
+} codec_t;
+
+
+/* Function escapes len bytes of src into dst (at least 2 * len bytes long), returns number of written bytes */
+extern size_t codec_encode(const codec_t *c, u8 *dst, const u8 *src, size_t len);
+
+
+/*
+ * Function unescapes *slen bytes of src into dst (*dlen bytes long) until the delimiter is found or one of
+ * buffers is exhausted. On return *slen and *dlen hold number of consumed and written bytes, *escfl keeps
+ * escape state between calls. Returns 1 if decoding stopped on (not consumed) delimiter, 0 otherwise.
+ */
+extern int codec_decode(const codec_t *c, u8 *dst, size_t *dlen, const u8 *src, size_t *slen, int *escfl);
+
+
+/* Function returns offset of the first mark or esc character in src or len if there is none */
+extern size_t codec_scan(const codec_t *c, const u8 *src, size_t len);
+
+
+/*
+ * Variants of the above adding sum of (unescaped) data bytes to *sum in the same pass,
+ * codec_scansum() sums the returned clean run only.
+ */
+extern size_t codec_encodesum(const codec_t *c, u8 *dst, const u8 *src, size_t len, u32 *sum);
+
+
+extern int codec_decodesum(const codec_t *c, u8 *dst, size_t *dlen, const u8 *src, size_t *slen, int *escfl, u32 *sum);
+
+
+extern size_t codec_scansum(const codec_t *c, const u8 *src, size_t len, u32 *sum);
+
+
+/* Function returns sum of bytes of src */
+extern u32 codec_sum(const u8 *src, size_t len);
+
+
+#endif
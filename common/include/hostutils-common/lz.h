@@ -0,0 +1,39 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * LZ4 block format compression of data sent to targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "types.h"
+
+
+/*
+ * Block is a sequence of: token (literals length << 4 | match length - 4, 15 - length continues in following
+ * bytes summed until byte != 255), literals, 16-bit little endian match offset and match length continuation.
+ * The last sequence has literals only, matches end at least 5 bytes before the end of the block.
+ */
+#define LZ_MINMATCH 4
+
+
+/* Function compresses len bytes of src, returns length of the block or 0 if it doesn't fit in dstsz bytes */
+extern size_t lz_compress(u8 *dst, size_t dstsz, const u8 *src, size_t len);
+
+
+/* Function decompresses block of len bytes, returns length of decompressed data or -1 if block is malformed */
+extern ssize_t lz_decompress(u8 *dst, size_t dstsz, const u8 *src, size_t len);
+
+
+#endif
@@ -22,7 +22,18 @@
 #include "types.h"
 
 
-extern int serial_open(char *dev, speed_t speed);
+/* Function opens raw serial port at baudrate, rates without Bxxx constant are supported on Linux only */
+extern int serial_open(char *dev, int baudrate);
+
+
+/* Function changes baudrate of opened serial port, output not transmitted yet is sent at the new rate */
+extern int serial_setbaudrate(int fd, int baudrate);
+
+
+#ifdef __linux__
+/* Function sets arbitrary baudrate using termios2, it's kept apart as <asm/termbits.h> conflicts with <termios.h> */
+extern int serial_setbother(int fd, int baudrate);
+#endif
 
 
 extern int serial_read(int fd, u8 *buff, uint len, uint timeout);
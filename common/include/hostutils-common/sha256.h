@@ -0,0 +1,46 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * SHA-256 message digest (FIPS 180-4)
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include "types.h"
+
+
+#define SHA256_LEN 32
+
+
+typedef struct _sha256_t {
+	u32 h[8];
+	unsigned long long len; /* number of hashed bytes */
+	u8 buff[64];
+} sha256_t;
+
+
+extern void sha256_init(sha256_t *c);
+
+
+extern void sha256_update(sha256_t *c, const void *src, size_t len);
+
+
+/* Function stores SHA256_LEN bytes of the digest in dst */
+extern void sha256_final(sha256_t *c, u8 *dst);
+
+
+/* Function stores digest of len bytes of src in dst */
+extern void sha256(u8 *dst, const void *src, size_t len);
+
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * LZ4 block format compression of data sent to targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <string.h>
+
+#include "hostutils-common/lz.h"
+
+
+#define LZ_HASHBITS     12
+#define LZ_MAXOFFS      65535
+#define LZ_LASTLITERALS 5
+#define LZ_MFLIMIT      12
+
+
+static u32 lz_read32(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+static u32 lz_hash(u32 v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+
+/* Function writes length continuation bytes */
+static u8 *lz_putlen(u8 *d, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*d++ = 255;
+	*d++ = (u8)len;
+
+	return d;
+}
+
+
+/* Function writes sequence of literals and match (if mlen != 0), returns NULL if it doesn't fit */
+static u8 *lz_sequence(u8 *d, const u8 *end, const u8 *lit, size_t llen, size_t offs, size_t mlen)
+{
+	u8 *token = d;
+
+	/* Worst case length of the sequence */
+	if ((size_t)(end - d) < 1 + llen / 255 + 1 + llen + 2 + mlen / 255 + 1)
+		return NULL;
+
+	d++;
+	*token = (llen < 15) ? (u8)(llen << 4) : 0xf0;
+	if (llen >= 15)
+		d = lz_putlen(d, llen - 15);
+
+	memcpy(d, lit, llen);
+	d += llen;
+
+	if (mlen == 0)
+		return d;
+
+	*d++ = offs & 0xff;
+	*d++ = offs >> 8;
+
+	mlen -= LZ_MINMATCH;
+	*token |= (mlen < 15) ? (u8)mlen : 0x0f;
+	if (mlen >= 15)
+		d = lz_putlen(d, mlen - 15);
+
+	return d;
+}
+
+
+size_t lz_compress(u8 *dst, size_t dstsz, const u8 *src, size_t len)
+{
+	u32 table[1 << LZ_HASHBITS];
+	u8 *d = dst, *end = dst + dstsz;
+	size_t ip = 0, anchor = 0, ref, mlen;
+	u32 h, v;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MFLIMIT < len) {
+		v = lz_read32(src + ip);
+		h = lz_hash(v);
+		ref = table[h];
+		table[h] = ip;
+
+		if ((ref >= ip) || (ip - ref > LZ_MAXOFFS) || (lz_read32(src + ref) != v)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = LZ_MINMATCH; (ip + mlen < len - LZ_LASTLITERALS) && (src[ref + mlen] == src[ip + mlen]); mlen++)
+			;
+
+		if ((d = lz_sequence(d, end, src + anchor, ip - anchor, ip - ref, mlen)) == NULL)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	if ((d = lz_sequence(d, end, src + anchor, len - anchor, 0, 0)) == NULL)
+		return 0;
+
+	return d - dst;
+}
+
+
+/* Function reads length continuation bytes, returns -1 if block ends */
+static int lz_getlen(const u8 **s, const u8 *end, size_t *len)
+{
+	u8 b;
+
+	do {
+		if (*s >= end)
+			return -1;
+		b = *(*s)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+
+ssize_t lz_decompress(u8 *dst, size_t dstsz, const u8 *src, size_t len)
+{
+	const u8 *s = src, *send = src + len;
+	size_t di = 0, llen, mlen, offs;
+	u8 token;
+
+	while (s < send) {
+		token = *s++;
+
+		llen = token >> 4;
+		if ((llen == 15) && (lz_getlen(&s, send, &llen) < 0))
+			return -1;
+
+		if ((llen > (size_t)(send - s)) || (llen > dstsz - di))
+			return -1;
+
+		memcpy(dst + di, s, llen);
+		s += llen;
+		di += llen;
+
+		/* The last sequence has no match */
+		if (s == send)
+			break;
+
+		if (send - s < 2)
+			return -1;
+		offs = s[0] | (s[1] << 8);
+		s += 2;
+
+		mlen = token & 0x0f;
+		if ((mlen == 15) && (lz_getlen(&s, send, &mlen) < 0))
+			return -1;
+		mlen += LZ_MINMATCH;
+
+		if ((offs == 0) || (offs > di) || (mlen > dstsz - di))
+			return -1;
+
+		/* Match may overlap copied data */
+		for (; mlen > 0; mlen--, di++)
+			dst[di] = dst[di - offs];
+	}
+
+	return di;
+}
@@ -23,11 +23,16 @@
 #include "hostutils-common/serial.h"
 
 
-int serial_open(char *dev, speed_t speed)
+int serial_open(char *dev, int baudrate)
 {
-	int fd;
+	int fd, err;
+	speed_t speed;
 	struct termios newtio;
 
+	/* Rates without Bxxx constant are set by serial_setbaudrate() once the port is configured */
+	if (serial_int2speed(baudrate, &speed) < 0)
+		speed = B9600;
+
 	if ((fd = open(dev, O_RDWR |  O_NONBLOCK | O_EXCL)) < 0)
 		return ERR_SERIAL_INIT;
 
@@ -41,16 +46,54 @@ int serial_open(char *dev, speed_t speed)
 	cfsetispeed(&newtio, speed);
 	cfsetospeed(&newtio, speed);
 
-	if (tcflush(fd, TCIOFLUSH) < 0)
+	if (tcflush(fd, TCIOFLUSH) < 0) {
+		close(fd);
 		return ERR_SERIAL_IO;
+	}
 
-	if (tcsetattr(fd, TCSAFLUSH, &newtio) < 0)
+	if (tcsetattr(fd, TCSAFLUSH, &newtio) < 0) {
+		close(fd);
 		return ERR_SERIAL_SETATTR;
+	}
+
+	if ((err = serial_setbaudrate(fd, baudrate)) < 0) {
+		close(fd);
+		return err;
+	}
 
 	return fd;
 }
 
 
+int serial_setbaudrate(int fd, int baudrate)
+{
+	speed_t speed;
+	struct termios tio;
+
+	if (baudrate <= 0)
+		return ERR_ARG;
+
+	if (serial_int2speed(baudrate, &speed) < 0) {
+#ifdef __linux__
+		return serial_setbother(fd, baudrate);
+#else
+		return ERR_ARG;
+#endif
+	}
+
+	if (tcgetattr(fd, &tio) < 0)
+		return ERR_SERIAL_IO;
+
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	if (tcsetattr(fd, TCSANOW, &tio) < 0)
+		return ERR_SERIAL_SETATTR;
+
+	return 0;
+}
+
+
 int serial_read(int fd, u8 *buff, uint len, uint timeout)
 {
 	char c;
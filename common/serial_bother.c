@@ -0,0 +1,53 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Arbitrary serial baudrates (Linux termios2)
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "hostutils-common/errors.h"
+
+
+/* Deviation of the rate set by the driver from the requested one (percent) tolerated by UARTs */
+#define SERIAL_BOTHERTOL 3
+
+
+int serial_setbother(int fd, int baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return ERR_SERIAL_IO;
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+
+	if (ioctl(fd, TCSETS2, &tio) < 0)
+		return ERR_SERIAL_SETATTR;
+
+	/* Driver rounds the rate to its clock divider */
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return ERR_SERIAL_IO;
+
+	if ((100ULL * tio.c_ospeed < (100ULL - SERIAL_BOTHERTOL) * baudrate) ||
+			(100ULL * tio.c_ospeed > (100ULL + SERIAL_BOTHERTOL) * baudrate))
+		return ERR_SERIAL_SETATTR;
+
+	return 0;
+}
+
+#endif
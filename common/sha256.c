@@ -0,0 +1,154 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * SHA-256 message digest (FIPS 180-4)
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <string.h>
+
+#include "hostutils-common/types.h"
+#include "hostutils-common/sha256.h"
+
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static void sha256_block(u32 *h, const u8 *p)
+{
+	u32 w[64], a, b, c, d, e, f, g, k, t1, t2;
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((u32)p[4 * i] << 24) | ((u32)p[4 * i + 1] << 16) | ((u32)p[4 * i + 2] << 8) | p[4 * i + 3];
+
+	for (; i < 64; i++) {
+		t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	f = h[5];
+	g = h[6];
+	k = h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += k;
+}
+
+
+void sha256_init(sha256_t *c)
+{
+	static const u32 iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(c->h, iv, sizeof(iv));
+	c->len = 0;
+}
+
+
+void sha256_update(sha256_t *c, const void *src, size_t len)
+{
+	const u8 *p = src;
+	size_t n, l = c->len % sizeof(c->buff);
+
+	c->len += len;
+
+	/* Complete partially filled block */
+	if (l != 0) {
+		n = (len < sizeof(c->buff) - l) ? len : sizeof(c->buff) - l;
+		memcpy(c->buff + l, p, n);
+		p += n;
+		len -= n;
+		if (l + n < sizeof(c->buff))
+			return;
+		sha256_block(c->h, c->buff);
+	}
+
+	for (; len >= sizeof(c->buff); p += sizeof(c->buff), len -= sizeof(c->buff))
+		sha256_block(c->h, p);
+
+	memcpy(c->buff, p, len);
+}
+
+
+void sha256_final(sha256_t *c, u8 *dst)
+{
+	unsigned long long bits = c->len * 8;
+	size_t l = c->len % sizeof(c->buff);
+	unsigned int i;
+
+	/* Padding: 0x80, zeros and 64-bit big endian length of the message in bits */
+	c->buff[l++] = 0x80;
+	if (l > sizeof(c->buff) - 8) {
+		memset(c->buff + l, 0, sizeof(c->buff) - l);
+		sha256_block(c->h, c->buff);
+		l = 0;
+	}
+	memset(c->buff + l, 0, sizeof(c->buff) - 8 - l);
+
+	for (i = 0; i < 8; i++)
+		c->buff[sizeof(c->buff) - 1 - i] = (u8)(bits >> (8 * i));
+	sha256_block(c->h, c->buff);
+
+	for (i = 0; i < 8; i++) {
+		dst[4 * i] = (u8)(c->h[i] >> 24);
+		dst[4 * i + 1] = (u8)(c->h[i] >> 16);
+		dst[4 * i + 2] = (u8)(c->h[i] >> 8);
+		dst[4 * i + 3] = (u8)c->h[i];
+	}
+}
+
+
+void sha256(u8 *dst, const void *src, size_t len)
+{
+	sha256_t c;
+
+	sha256_init(&c);
+	sha256_update(&c, src, len);
+	sha256_final(&c, dst);
+}
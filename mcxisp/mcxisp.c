@@ -22,6 +22,8 @@
 #include <termios.h>
 #include <sys/stat.h>
 
+#include <hostutils-common/serial.h>
+
 /* clang-format off */
 #define TTY_DEBUG(fmt, ...) if (0)  { printf(fmt, ##__VA_ARGS__); }
 /* clang-format on */
@@ -33,7 +35,7 @@
 #define FLASH_MEM_ID    0
 
 #define TTY_TIMEOUT  10
-#define TTY_BAUDRATE B576000
+#define TTY_BAUDRATE 576000
 
 /* Frame types */
 #define kFramingPacketType_Ack          0xa1
@@ -54,6 +56,7 @@ static struct {
 	int tty;
 	int file;
 	size_t filesz;
+	int baudrate;
 	struct termios orig;
 } common;
 
@@ -487,7 +490,6 @@ static int tty_setup(void)
 	common.orig = raw;
 
 	cfmakeraw(&raw);
-	cfsetspeed(&raw, TTY_BAUDRATE);
 	raw.c_cc[VMIN] = 0;
 	raw.c_cc[VTIME] = TTY_TIMEOUT;
 
@@ -495,6 +497,12 @@ static int tty_setup(void)
 		return -1;
 	}
 
+	/* ISP detects the rate of the first ping, any rate supported by the UART can be used */
+	if (serial_setbaudrate(common.tty, common.baudrate) < 0) {
+		tcsetattr(common.tty, TCSANOW, &common.orig);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -508,7 +516,7 @@ static void tty_restore(void)
 static void usage(const char *progname)
 {
 	printf("MCX N94x series UART ISP util\n");
-	printf("Usage: %s -f program file -t ISP tty\n", progname);
+	printf("Usage: %s -f program file -t ISP tty [-b baudrate]\n", progname);
 }
 
 
@@ -518,9 +526,10 @@ int main(int argc, char *argv[])
 
 	common.tty = -1;
 	common.file = -1;
+	common.baudrate = TTY_BAUDRATE;
 
 	for (;;) {
-		int opt = getopt(argc, argv, "hf:t:");
+		int opt = getopt(argc, argv, "hf:t:b:");
 		if (opt == -1) {
 			break;
 		}
@@ -539,6 +548,14 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			case 'b':
+				common.baudrate = atoi(optarg);
+				if (common.baudrate <= 0) {
+					fprintf(stderr, "%s: Wrong baudrate %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
 			case 't':
 				common.tty = open(optarg, O_RDWR);
 				if (common.tty < 0) {
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+#
+# Phoenix-RTOS
+#
+# phoenixd throughput benchmark over all transports
+#
+# Copyright 2026 Phoenix Systems
+#
+# %LICENSE%
+#
+
+set -e
+
+if [ $# -lt 2 ]; then
+	echo "usage: $0 phoenixd phoenixd-sim [boards] [rounds]" >&2
+	exit 1
+fi
+
+PHOENIXD=$1
+SIM=$2
+BOARDS=${3:-4}
+ROUNDS=${4:-2}
+
+SYSDIR=$(mktemp -d)
+trap 'rm -rf "$SYSDIR"' EXIT
+
+# Server without boards receives its own announcements and has to stay idle
+"$SIM" -x "$PHOENIXD" -s "$SYSDIR" -I 2
+
+# Board on loopback (QEMU user networking) probes the server and has to be answered at once
+"$SIM" -x "$PHOENIXD" -s "$SYSDIR" -D
+
+# Many small files and few large ones
+"$SIM" -s "$SYSDIR" -G 64:4096:small -G 4:4194304:large
+
+SMALL=$(cd "$SYSDIR" && ls small*)
+LARGE=$(cd "$SYSDIR" && ls large*)
+
+for t in pipe pty udp tcp; do
+	"$SIM" -x "$PHOENIXD" -T "$t" -n "$BOARDS" -r "$ROUNDS" -s "$SYSDIR" -c $SMALL
+	"$SIM" -x "$PHOENIXD" -T "$t" -n "$BOARDS" -r "$ROUNDS" -s "$SYSDIR" -c $LARGE
+done
+
+for t in udp tcp; do
+	"$SIM" -x "$PHOENIXD" -T "$t" -n "$BOARDS" -r "$ROUNDS" -s "$SYSDIR" -l 64512 -c $LARGE
+done
+
+# UDP over the path with Ethernet MTU (loopback of the new network namespace), GSO is used for small messages only
+if unshare -rn true 2>/dev/null; then
+	for l in 512 8192 64512; do
+		unshare -rn sh -c 'ip link set lo mtu 1500 up && exec "$@"' sh \
+			"$SIM" -x "$PHOENIXD" -T udp -n "$BOARDS" -r "$ROUNDS" -s "$SYSDIR" -l $l -c $LARGE
+	done
+else
+	echo "Can't create network namespace, UDP runs with 1500 bytes MTU skipped"
+fi
+
+# Requests per second of many UDP boards depending on number of datagrams received and sent by one system call
+for b in 1 8 32; do
+	echo "PHOENIXD_UDPBATCH=$b"
+	PHOENIXD_UDPBATCH=$b "$SIM" -x "$PHOENIXD" -T udp -n $((BOARDS * 8)) -r "$ROUNDS" -s "$SYSDIR" -c $SMALL
+done
+
+# Many boards tunnelled over TCP connections accepted by the single server
+"$SIM" -x "$PHOENIXD" -T tcpl -n $((BOARDS * 32)) -r "$ROUNDS" -s "$SYSDIR" -c $SMALL
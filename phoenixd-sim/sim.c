@@ -0,0 +1,1210 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server simulator
+ *
+ * Loopback BSP2/PHFS targets measuring phoenixd throughput
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <limits.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <hostutils-common/types.h>
+#include <hostutils-common/errors.h>
+#include <hostutils-common/codec.h>
+#include <hostutils-common/lz.h>
+#include <hostutils-common/sha256.h>
+#include "../phoenixd/msg.h"
+#include "../phoenixd/phfs.h"
+#include "../phoenixd/msg_udp.h"
+
+
+/* Transports */
+#define SIM_PTY   0
+#define SIM_PIPE  1
+#define SIM_UDP   2
+#define SIM_TCP   3
+#define SIM_TCPL  4 /* boards connect to the listening server */
+
+/* Board states */
+#define SIM_HELLO  0
+#define SIM_OPEN   1
+#define SIM_FSTAT  2
+#define SIM_READ   3
+#define SIM_CLOSE  4
+#define SIM_DONE   5
+#define SIM_HASH   6
+
+#define SIM_RXBUFSZ   (64 * 1024)
+#define SIM_TIMEOUT   200 /* ms, request is sent again after timeout */
+#define SIM_RETRIES   50
+#define SIM_PORT      24000
+#define SIM_IDLECPU   0.05 /* maximal share of CPU time used by the server without boards */
+
+
+typedef struct {
+	char *name;
+	u8 *data; /* expected content, only if content is verified */
+	size_t size;
+} sim_file_t;
+
+
+typedef struct {
+	int fd;
+	int ofd;   /* differs from fd only for pipes */
+	int slave; /* pty slave kept open, so the master doesn't get hung up */
+	char dev[64];
+
+	int state;
+	u16 seq;
+	unsigned int round;
+	unsigned int file;
+	u32 handle;
+	u32 pos;
+	u32 size;
+
+	/* Last request kept for retransmission */
+	u8 *tx;
+	size_t txlen;
+	struct timespec sent;
+	unsigned int retries;
+
+	/* Reply decoding */
+	u8 rx[SIM_RXBUFSZ];
+	unsigned int rd;
+	unsigned int wr;
+	int frame;
+	int escfl;
+	unsigned int l;
+
+	msg_t req;
+	msg_t *rep; /* MSG_LARGESZ bytes long */
+} sim_board_t;
+
+
+static struct {
+	int transport;
+	unsigned int nboards;
+	unsigned int rounds;
+	unsigned int maxlen;
+	unsigned int port;
+	int verify;
+	int lz;
+	u32 hashblk; /* block size of MSG_HASH comparing files instead of reading them, 0 - files are read */
+	unsigned int idle; /* seconds of the UDP server run without boards, 0 - files are fetched */
+	int discover;      /* probe is sent to the UDP server instead of fetching files */
+	char *sysdir;
+	char *server;
+	char *log;
+	char **sargs;
+	unsigned int nsargs;
+
+	sim_file_t *files;
+	unsigned int nfiles;
+
+	sim_board_t *boards;
+	pid_t pid;
+
+	unsigned long long bytes;
+	unsigned long long wire; /* file data bytes in replies */
+	unsigned long long hashed; /* file bytes compared by hashes */
+	unsigned long long nhashes;
+	unsigned long long requests;
+	unsigned long long retrans;
+	unsigned long long errors;
+	u32 *lat; /* request latencies (us) */
+	size_t nlat;
+	size_t szlat;
+} sim;
+
+
+static const codec_t sim_codec = { MSG_MARK, MSG_ESC, MSG_MARK ^ MSG_ESCMARK };
+
+
+static double sim_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+static u16 sim_csum(msg_t *msg)
+{
+	unsigned int k;
+	u16 csum = 0;
+
+	for (k = sizeof(msg->csum); k < MSG_HDRSZ + msg_getlen(msg); k++)
+		csum += *((u8 *)msg + k);
+
+	return csum + msg_getseq(msg);
+}
+
+
+/* Function sends the last request of the board again */
+static int sim_transmit(sim_board_t *b)
+{
+	ssize_t r;
+	size_t n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &b->sent);
+
+	while (n < b->txlen) {
+		if ((r = write(b->ofd, b->tx + n, b->txlen - n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == ECONNREFUSED)) {
+				/* Lost, request is repeated after timeout */
+				return 0;
+			}
+			return ERR_MSG_IO;
+		}
+		n += r;
+	}
+
+	return 0;
+}
+
+
+static int sim_request(sim_board_t *b, u16 type, size_t len)
+{
+	msg_settype(&b->req, type);
+	msg_setlen(&b->req, len);
+	msg_setseq(&b->req, ++b->seq);
+	msg_setcsum(&b->req, sim_csum(&b->req));
+
+	if (sim.transport == SIM_UDP) {
+		memcpy(b->tx, &b->req, MSG_HDRSZ + len);
+		b->txlen = MSG_HDRSZ + len;
+	}
+	else {
+		b->tx[0] = MSG_MARK;
+		b->txlen = 1 + codec_encode(&sim_codec, b->tx + 1, (u8 *)&b->req, MSG_HDRSZ + len);
+	}
+
+	b->retries = 0;
+	sim.requests++;
+
+	return sim_transmit(b);
+}
+
+
+/* Function sends request of the current board state */
+static int sim_next(sim_board_t *b)
+{
+	msg_phfsio_t *io = (msg_phfsio_t *)b->req.data;
+	msg_phfshash_t *h = (msg_phfshash_t *)b->req.data;
+	u32 hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
+	size_t len;
+
+	switch (b->state) {
+		case SIM_HELLO:
+			((u32 *)b->req.data)[0] = sim.maxlen;
+			((u32 *)b->req.data)[1] = sim.lz ? PHFS_HELLO_LZ : 0;
+			return sim_request(b, MSG_HELLO, (sim.lz ? 2 : 1) * sizeof(u32));
+
+		case SIM_OPEN:
+			*(u32 *)b->req.data = PHFS_RDONLY;
+			len = strlen(sim.files[b->file].name) + 1;
+			memcpy(&b->req.data[sizeof(u32)], sim.files[b->file].name, len);
+			return sim_request(b, MSG_OPEN, sizeof(u32) + len);
+
+		case SIM_FSTAT:
+			io->handle = b->handle;
+			io->pos = 0;
+			io->len = 0;
+			return sim_request(b, MSG_FSTAT, hdrsz);
+
+		case SIM_READ:
+			io->handle = b->handle;
+			io->pos = b->pos;
+			io->len = sim.maxlen - hdrsz;
+			return sim_request(b, MSG_READ, hdrsz);
+
+		case SIM_HASH:
+			h->handle = b->handle;
+			h->pos = b->pos;
+			h->len = b->size - b->pos;
+			h->blksz = sim.hashblk;
+			return sim_request(b, MSG_HASH, sizeof(*h));
+
+		case SIM_CLOSE:
+			*(u32 *)b->req.data = b->handle;
+			return sim_request(b, MSG_CLOSE, sizeof(u32));
+	}
+
+	return 0;
+}
+
+
+static void sim_latency(sim_board_t *b)
+{
+	struct timespec ts;
+	u32 *lat;
+
+	if (sim.nlat == sim.szlat) {
+		sim.szlat = (sim.szlat != 0) ? 2 * sim.szlat : 4096;
+		if ((lat = realloc(sim.lat, sim.szlat * sizeof(*lat))) == NULL) {
+			sim.szlat = sim.nlat;
+			return;
+		}
+		sim.lat = lat;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sim.lat[sim.nlat++] = (u32)(sim_elapsed(&b->sent, &ts) * 1e6);
+}
+
+
+/* Function handles reply to the current request and advances the board */
+static int sim_reply(sim_board_t *b)
+{
+	static u8 buff[MSG_LARGELEN];
+	msg_phfsio_t *io = (msg_phfsio_t *)b->rep->data;
+	msg_phfshash_t *h = (msg_phfshash_t *)b->rep->data;
+	u32 hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
+	sim_file_t *f = &sim.files[b->file];
+	struct pho_stat st;
+	const u8 *data;
+	u8 hash[SHA256_LEN];
+	u32 dlen, pos, l;
+	s32 k;
+
+	/* Replies to repeated requests */
+	if ((msg_getseq(b->rep) != b->seq) || (msg_gettype(b->rep) != msg_gettype(&b->req)))
+		return 0;
+
+	if (msg_getcsum(b->rep) != sim_csum(b->rep)) {
+		sim.errors++;
+		return 0;
+	}
+
+	sim_latency(b);
+
+	switch (b->state) {
+		case SIM_HELLO:
+			sim.maxlen = ((u32 *)b->rep->data)[0];
+			if ((msg_getlen(b->rep) < 2 * sizeof(u32)) || ((((u32 *)b->rep->data)[1] & PHFS_HELLO_LZ) == 0))
+				sim.lz = 0;
+			b->state = SIM_OPEN;
+			break;
+
+		case SIM_OPEN:
+			if ((b->handle = *(u32 *)b->rep->data) == 0) {
+				fprintf(stderr, "sim: Can't open '%s' on %s\n", f->name, b->dev);
+				return ERR_FILE;
+			}
+			b->state = SIM_FSTAT;
+			break;
+
+		case SIM_FSTAT:
+			memcpy(&st, io->buff, sizeof(st));
+			b->size = st.st_size;
+			b->pos = 0;
+			b->state = (sim.hashblk != 0) ? SIM_HASH : SIM_READ;
+			break;
+
+		case SIM_HASH:
+			if ((h->n < 0) || (h->pos != b->pos) || (msg_getlen(b->rep) != sizeof(*h) + h->n * SHA256_LEN)) {
+				fprintf(stderr, "sim: Hash error of '%s' at %u on %s\n", f->name, b->pos, b->dev);
+				return ERR_FILE;
+			}
+
+			/* Board holds the expected content, so every block has to match */
+			for (k = 0; k < h->n; k++) {
+				pos = b->pos + k * sim.hashblk;
+				l = (b->size - pos < sim.hashblk) ? b->size - pos : sim.hashblk;
+				if ((f->data != NULL) && (pos + l <= f->size))
+					sha256(hash, f->data + pos, l);
+				else
+					memset(hash, 0, sizeof(hash));
+
+				if (memcmp(hash, h->hash[k], SHA256_LEN) != 0) {
+					fprintf(stderr, "sim: Bad hash of '%s' at %u on %s\n", f->name, pos, b->dev);
+					return ERR_FILE;
+				}
+				sim.hashed += l;
+			}
+
+			sim.nhashes += h->n;
+			b->pos += h->len;
+			if ((h->n == 0) || (b->pos >= b->size)) {
+				if (b->pos < b->size) {
+					fprintf(stderr, "sim: '%s' is %u bytes long, hashed %u on %s\n", f->name, b->size, b->pos, b->dev);
+					return ERR_FILE;
+				}
+				b->state = SIM_CLOSE;
+			}
+			break;
+
+		case SIM_READ:
+			if (io->len < 0) {
+				fprintf(stderr, "sim: Read error of '%s' on %s\n", f->name, b->dev);
+				return ERR_FILE;
+			}
+
+			/* Data shorter than io->len are compressed */
+			data = io->buff;
+			dlen = msg_getlen(b->rep) - hdrsz;
+			if (sim.lz && (dlen < io->len)) {
+				if (lz_decompress(buff, sizeof(buff), io->buff, dlen) != io->len) {
+					fprintf(stderr, "sim: Bad compressed data of '%s' at %u on %s\n", f->name, b->pos, b->dev);
+					return ERR_FILE;
+				}
+				data = buff;
+			}
+			else if (dlen != io->len) {
+				dlen = ~0u;
+			}
+
+			if ((io->pos != b->pos + io->len) || (dlen == ~0u) ||
+					((f->data != NULL) && ((b->pos + io->len > f->size) || (memcmp(f->data + b->pos, data, io->len) != 0)))) {
+				fprintf(stderr, "sim: Bad data of '%s' at %u on %s\n", f->name, b->pos, b->dev);
+				return ERR_FILE;
+			}
+
+			b->pos += io->len;
+			sim.bytes += io->len;
+			sim.wire += dlen;
+			if (io->len == 0) {
+				if (b->pos != b->size) {
+					fprintf(stderr, "sim: '%s' is %u bytes long, read %u on %s\n", f->name, b->size, b->pos, b->dev);
+					return ERR_FILE;
+				}
+				b->state = SIM_CLOSE;
+			}
+			break;
+
+		case SIM_CLOSE:
+			b->state = SIM_OPEN;
+			if (++b->file == sim.nfiles) {
+				b->file = 0;
+				if (++b->round == sim.rounds)
+					b->state = SIM_DONE;
+			}
+			break;
+	}
+
+	return sim_next(b);
+}
+
+
+/* Function decodes received stream, returns 1 if reply is completed */
+static int sim_decode(sim_board_t *b)
+{
+	size_t dlen, slen;
+	u8 *p;
+	int mark;
+
+	while (b->rd < b->wr) {
+		if (!b->frame) {
+			if ((p = memchr(&b->rx[b->rd], MSG_MARK, b->wr - b->rd)) == NULL) {
+				b->rd = b->wr;
+				break;
+			}
+			b->rd = p - b->rx + 1;
+			b->frame = 1;
+			b->escfl = 0;
+			b->l = 0;
+			continue;
+		}
+
+		dlen = (b->l < MSG_HDRSZ) ? MSG_HDRSZ - b->l : MSG_HDRSZ + msg_getlen(b->rep) - b->l;
+		slen = b->wr - b->rd;
+		mark = codec_decode(&sim_codec, (u8 *)b->rep + b->l, &dlen, &b->rx[b->rd], &slen, &b->escfl);
+		b->rd += slen;
+		b->l += dlen;
+
+		if (mark) {
+			b->rd++;
+			b->escfl = 0;
+			b->l = 0;
+			continue;
+		}
+
+		if (b->l < MSG_HDRSZ)
+			continue;
+
+		if (msg_getlen(b->rep) > MSG_LARGELEN) {
+			b->frame = 0;
+			continue;
+		}
+
+		if (b->l == MSG_HDRSZ + msg_getlen(b->rep)) {
+			b->frame = 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int sim_receive(sim_board_t *b)
+{
+	ssize_t r;
+	int err;
+
+	if (sim.transport == SIM_UDP) {
+		if ((r = recv(b->fd, b->rep, MSG_LARGESZ, MSG_DONTWAIT)) < 0)
+			return ((errno == EAGAIN) || (errno == EINTR) || (errno == ECONNREFUSED)) ? 0 : ERR_MSG_IO;
+
+		if ((r < MSG_HDRSZ) || (r != MSG_HDRSZ + msg_getlen(b->rep)))
+			return 0;
+
+		return sim_reply(b);
+	}
+
+	if ((r = read(b->fd, b->rx, sizeof(b->rx))) < 0)
+		return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : ERR_MSG_IO;
+
+	if (r == 0)
+		return ERR_MSG_CLOSED;
+
+	b->rd = 0;
+	b->wr = r;
+
+	while (sim_decode(b)) {
+		if ((err = sim_reply(b)) < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+
+static int sim_addarg(char ***argv, unsigned int *argc, char *arg)
+{
+	char **a;
+
+	if ((a = realloc(*argv, (*argc + 2) * sizeof(char *))) == NULL)
+		return ERR_MEM;
+
+	a[(*argc)++] = arg;
+	a[*argc] = NULL;
+	*argv = a;
+
+	return 0;
+}
+
+
+/* Function creates target side of the board and adds server arguments */
+static int sim_board(sim_board_t *b, unsigned int k, char ***argv, unsigned int *argc, char *dir)
+{
+	static const char *const opts[] = { "-p", "-m", "-i", "-t", "-T" };
+	struct sockaddr_in addr;
+	struct termios tio;
+	char path[PATH_MAX], *arg;
+	int fd, yes = 1;
+
+	b->fd = -1;
+	b->ofd = -1;
+	b->slave = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(sim.port + k);
+
+	switch (sim.transport) {
+		case SIM_PTY:
+			if (((b->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) || (grantpt(b->fd) < 0) || (unlockpt(b->fd) < 0))
+				return ERR_FILE;
+			snprintf(b->dev, sizeof(b->dev), "%s", ptsname(b->fd));
+
+			/* Server sets the line up on opening, until then requests can't be echoed */
+			if ((b->slave = open(b->dev, O_RDWR | O_NOCTTY)) < 0)
+				return ERR_FILE;
+			tcgetattr(b->slave, &tio);
+			cfmakeraw(&tio);
+			tcsetattr(b->slave, TCSANOW, &tio);
+			break;
+
+		case SIM_PIPE:
+			/* Target writes to <name>.out and reads from <name>.in */
+			snprintf(b->dev, sizeof(b->dev), "%s/board%u", dir, k);
+			snprintf(path, sizeof(path), "%s.in", b->dev);
+			if ((mkfifo(path, 0600) < 0) || ((b->fd = open(path, O_RDWR | O_NONBLOCK)) < 0))
+				return ERR_FILE;
+			snprintf(path, sizeof(path), "%s.out", b->dev);
+			if ((mkfifo(path, 0600) < 0) || ((b->ofd = open(path, O_RDWR)) < 0))
+				return ERR_FILE;
+			break;
+
+		case SIM_UDP:
+			/* All boards are served on the single port */
+			addr.sin_port = htons(sim.port);
+			snprintf(b->dev, sizeof(b->dev), "127.0.0.1:%u", sim.port);
+			if (((b->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) || (connect(b->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+				return ERR_FILE;
+			b->ofd = b->fd;
+			if (k != 0)
+				return 0;
+			break;
+
+		case SIM_TCP:
+			/* Server connects to the target, listening socket is replaced by connection */
+			snprintf(b->dev, sizeof(b->dev), "127.0.0.1:%u", sim.port + k);
+			if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+				return ERR_FILE;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0)) {
+				close(fd);
+				return ERR_FILE;
+			}
+			b->slave = fd;
+			break;
+
+		case SIM_TCPL:
+			/* All boards connect to the single port once the server is started */
+			snprintf(b->dev, sizeof(b->dev), "127.0.0.1:%u", sim.port);
+			if (k != 0)
+				return 0;
+			break;
+	}
+
+	if (b->ofd < 0)
+		b->ofd = b->fd;
+
+	if ((arg = strdup(b->dev)) == NULL)
+		return ERR_MEM;
+
+	if ((sim_addarg(argv, argc, (char *)opts[sim.transport]) < 0) || (sim_addarg(argv, argc, arg) < 0))
+		return ERR_MEM;
+
+	return 0;
+}
+
+
+static int sim_accept(void)
+{
+	struct pollfd pfd;
+	unsigned int k;
+	int fd;
+
+	for (k = 0; k < sim.nboards; k++) {
+		pfd.fd = sim.boards[k].slave;
+		pfd.events = POLLIN;
+		if ((poll(&pfd, 1, 5000) <= 0) || ((fd = accept(pfd.fd, NULL, NULL)) < 0)) {
+			fprintf(stderr, "sim: Server didn't connect to %s\n", sim.boards[k].dev);
+			return ERR_MSG_IO;
+		}
+		close(sim.boards[k].slave);
+		sim.boards[k].slave = -1;
+		sim.boards[k].fd = fd;
+		sim.boards[k].ofd = fd;
+	}
+
+	return 0;
+}
+
+
+static int sim_connect(void)
+{
+	struct sockaddr_in addr;
+	unsigned int k, i;
+	int yes = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(sim.port);
+
+	for (k = 0; k < sim.nboards; k++) {
+		/* Server is listening soon after start */
+		for (i = 0; i < 500; i++) {
+			if ((sim.boards[k].fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+				return ERR_MSG_IO;
+			if (connect(sim.boards[k].fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+				break;
+			close(sim.boards[k].fd);
+			sim.boards[k].fd = -1;
+			usleep(10 * 1000);
+		}
+		if (sim.boards[k].fd < 0) {
+			fprintf(stderr, "sim: Can't connect to %s\n", sim.boards[k].dev);
+			return ERR_MSG_IO;
+		}
+		setsockopt(sim.boards[k].fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		sim.boards[k].ofd = sim.boards[k].fd;
+	}
+
+	return 0;
+}
+
+
+static pid_t sim_spawn(char **argv)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) != 0)
+		return pid;
+
+	/* Server and processes forked by it are terminated together */
+	setpgid(0, 0);
+
+	if ((fd = open((sim.log != NULL) ? sim.log : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	execv(argv[0], argv);
+	_exit(127);
+}
+
+
+static int sim_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static u32 sim_percentile(double p)
+{
+	size_t i;
+
+	if (sim.nlat == 0)
+		return 0;
+
+	i = (size_t)(p * (sim.nlat - 1) + 0.5);
+	return sim.lat[i];
+}
+
+
+static double sim_cpu(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+
+static int sim_run(void)
+{
+	static const char *const names[] = { "pty", "pipe", "udp", "tcp", "tcpl" };
+	struct timespec t0, t1, now;
+	struct rusage self, server;
+	struct pollfd *pfds;
+	char dir[] = "/tmp/phoenixd-sim.XXXXXX", path[PATH_MAX];
+	char **argv = NULL;
+	unsigned int argc = 0, k, done;
+	sim_board_t *b;
+	double t, mb;
+	int err = 0, st;
+
+	if ((sim.boards = calloc(sim.nboards, sizeof(sim_board_t))) == NULL)
+		return ERR_MEM;
+
+	if ((pfds = calloc(sim.nboards, sizeof(struct pollfd))) == NULL)
+		return ERR_MEM;
+
+	if ((sim.transport == SIM_PIPE) && (mkdtemp(dir) == NULL))
+		return ERR_FILE;
+
+	sim_addarg(&argv, &argc, sim.server);
+	sim_addarg(&argv, &argc, "-s");
+	sim_addarg(&argv, &argc, sim.sysdir);
+	for (k = 0; k < sim.nsargs; k++)
+		sim_addarg(&argv, &argc, sim.sargs[k]);
+
+	for (k = 0; k < sim.nboards; k++) {
+		b = &sim.boards[k];
+		if (((b->tx = malloc(1 + 2 * MSG_LARGESZ)) == NULL) || ((b->rep = malloc(MSG_LARGESZ)) == NULL) ||
+				(sim_board(b, k, &argv, &argc, dir) < 0)) {
+			fprintf(stderr, "sim: Can't create board %u\n", k);
+			return ERR_FILE;
+		}
+	}
+
+	if ((sim.pid = sim_spawn(argv)) < 0)
+		return ERR_ARG;
+
+	if ((sim.transport == SIM_TCP) && ((err = sim_accept()) < 0))
+		goto out;
+
+	if ((sim.transport == SIM_TCPL) && ((err = sim_connect()) < 0))
+		goto out;
+
+	if ((sim.transport != SIM_TCP) && (sim.transport != SIM_TCPL)) {
+		/* Server has to open the devices first */
+		usleep(200 * 1000);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (k = 0; k < sim.nboards; k++) {
+		b = &sim.boards[k];
+		b->state = ((((sim.transport == SIM_UDP) || (sim.transport == SIM_TCP) || (sim.transport == SIM_TCPL)) && (sim.maxlen > MSG_MAXLEN)) || sim.lz) ? SIM_HELLO : SIM_OPEN;
+		if ((err = sim_next(b)) < 0)
+			goto out;
+	}
+
+	for (;;) {
+		for (k = 0, done = 0; k < sim.nboards; k++) {
+			pfds[k].fd = sim.boards[k].fd;
+			pfds[k].events = POLLIN;
+			done += (sim.boards[k].state == SIM_DONE);
+		}
+
+		if (done == sim.nboards)
+			break;
+
+		if (poll(pfds, sim.nboards, 10) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = ERR_MSG_IO;
+			goto out;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (k = 0; k < sim.nboards; k++) {
+			b = &sim.boards[k];
+			if (b->state == SIM_DONE)
+				continue;
+
+			if ((pfds[k].revents & (POLLIN | POLLERR | POLLHUP)) && ((err = sim_receive(b)) < 0)) {
+				fprintf(stderr, "sim: Board %s failed (%d)\n", b->dev, err);
+				goto out;
+			}
+
+			if ((b->state != SIM_DONE) && (sim_elapsed(&b->sent, &now) * 1000 > SIM_TIMEOUT)) {
+				if (++b->retries > SIM_RETRIES) {
+					fprintf(stderr, "sim: Board %s doesn't get replies\n", b->dev);
+					err = ERR_MSG_IO;
+					goto out;
+				}
+				sim.retrans++;
+				sim_transmit(b);
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+out:
+	kill(-sim.pid, SIGTERM);
+	waitpid(sim.pid, &st, 0);
+
+	for (k = 0; k < sim.nboards; k++) {
+		b = &sim.boards[k];
+		if (b->fd >= 0)
+			close(b->fd);
+		if ((b->ofd >= 0) && (b->ofd != b->fd))
+			close(b->ofd);
+		if (b->slave >= 0)
+			close(b->slave);
+		if (sim.transport == SIM_PIPE) {
+			snprintf(path, sizeof(path), "%s.in", b->dev);
+			unlink(path);
+			snprintf(path, sizeof(path), "%s.out", b->dev);
+			unlink(path);
+		}
+		free(b->tx);
+		free(b->rep);
+	}
+	if (sim.transport == SIM_PIPE)
+		rmdir(dir);
+
+	free(argv);
+	free(pfds);
+	free(sim.boards);
+
+	if (err < 0)
+		return err;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &server);
+
+	t = sim_elapsed(&t0, &t1);
+	mb = sim.bytes / (1024.0 * 1024.0);
+	qsort(sim.lat, sim.nlat, sizeof(u32), sim_cmp);
+
+	printf("%s: %u boards, %u files x %u rounds, maxlen %u\n", names[sim.transport], sim.nboards, sim.nfiles, sim.rounds, sim.maxlen);
+	printf("  %.1f MB in %.3f s, %.2f MB/s, %llu requests (%.0f/s), %llu retransmitted, %llu bad replies\n",
+		mb, t, mb / t, sim.requests, sim.requests / t, sim.retrans, sim.errors);
+	if (sim.hashblk != 0)
+		printf("  hashed: %.1f MB of files compared by %llu hashes of %u byte blocks\n", sim.hashed / (1024.0 * 1024.0), sim.nhashes, sim.hashblk);
+	if (sim.lz)
+		printf("  compressed: %.1f MB of file data sent, ratio %.2f\n", sim.wire / (1024.0 * 1024.0), (sim.wire != 0) ? (double)sim.bytes / sim.wire : 0.0);
+	printf("  latency us: p50 %u, p90 %u, p99 %u, max %u\n",
+		sim_percentile(0.5), sim_percentile(0.9), sim_percentile(0.99), sim_percentile(1.0));
+	if (mb > 0)
+		printf("  cpu ms/MB: server %.2f, simulator %.2f\n", 1000 * sim_cpu(&server) / mb, 1000 * sim_cpu(&self) / mb);
+
+	return 0;
+}
+
+
+/* Function starts UDP server on addr without boards */
+static int sim_spawnudp(char *addr)
+{
+	char **argv = NULL;
+	unsigned int argc = 0, k;
+
+	sim_addarg(&argv, &argc, sim.server);
+	sim_addarg(&argv, &argc, "-s");
+	sim_addarg(&argv, &argc, sim.sysdir);
+	for (k = 0; k < sim.nsargs; k++)
+		sim_addarg(&argv, &argc, sim.sargs[k]);
+	sim_addarg(&argv, &argc, "-i");
+	if (sim_addarg(&argv, &argc, addr) < 0)
+		return ERR_MEM;
+
+	sim.pid = sim_spawn(argv);
+	free(argv);
+
+	return (sim.pid < 0) ? ERR_ARG : 0;
+}
+
+
+/*
+ * Function runs UDP server without boards on the port of announcements, so it receives its own announcements.
+ * Server has nothing to do and its CPU time has to stay below SIM_IDLECPU of the run.
+ */
+static int sim_idle(void)
+{
+	struct rusage server;
+	char addr[32];
+	double cpu;
+	int st;
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%u", sim.port);
+	if (sim_spawnudp(addr) < 0)
+		return ERR_ARG;
+
+	sleep(sim.idle);
+	kill(-sim.pid, SIGTERM);
+	waitpid(sim.pid, &st, 0);
+
+	getrusage(RUSAGE_CHILDREN, &server);
+	cpu = sim_cpu(&server);
+
+	printf("idle: udp server on %s without boards for %u s\n", addr, sim.idle);
+	printf("  cpu ms: server %.1f (%.1f%%)\n", 1000 * cpu, 100 * cpu / sim.idle);
+
+	if (cpu > SIM_IDLECPU * sim.idle) {
+		fprintf(stderr, "sim: Server is busy without boards\n");
+		return ERR_MSG_IO;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Function checks discovery of UDP server by board on loopback (e.g. QEMU user networking sends from the host
+ * address), MSG_HELLO probe broadcast by the board has to be answered at once from the server port.
+ */
+static int sim_discover(void)
+{
+	struct sockaddr_in to, from;
+	struct timespec t0, t1;
+	struct pollfd pfd;
+	socklen_t addrlen;
+	char addr[32];
+	msg_t req, rep;
+	ssize_t len;
+	int fd, st, yes = 1, err = ERR_MSG_IO;
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%u", sim.port);
+	if (sim_spawnudp(addr) < 0)
+		return ERR_ARG;
+
+	/* Server has to open the socket first */
+	usleep(200 * 1000);
+
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK | ~IN_CLASSA_NET);
+	to.sin_port = htons(sim.port);
+
+	memset(&req, 0, sizeof(req));
+	msg_settype(&req, MSG_HELLO);
+	msg_setlen(&req, sizeof(u32));
+	*(u32 *)req.data = MSG_LARGELEN;
+	msg_setseq(&req, 0x5eed);
+	msg_setcsum(&req, sim_csum(&req));
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		kill(-sim.pid, SIGTERM);
+		waitpid(sim.pid, &st, 0);
+		return ERR_FILE;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (sendto(fd, &req, MSG_HDRSZ + msg_getlen(&req), 0, (struct sockaddr *)&to, sizeof(to)) > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, SIM_TIMEOUT) > 0) {
+			addrlen = sizeof(from);
+			if ((len = recvfrom(fd, &rep, sizeof(rep), 0, (struct sockaddr *)&from, &addrlen)) < 0)
+				break;
+
+			/* Reply to the probe comes from the server socket */
+			if ((len >= MSG_HDRSZ) && (len >= MSG_HDRSZ + msg_getlen(&rep)) && (msg_getcsum(&rep) == sim_csum(&rep)) &&
+					(msg_gettype(&rep) == MSG_HELLO) && (msg_getseq(&rep) == msg_getseq(&req)) && (ntohs(from.sin_port) == sim.port)) {
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				err = 0;
+				break;
+			}
+		}
+	}
+	close(fd);
+
+	kill(-sim.pid, SIGTERM);
+	waitpid(sim.pid, &st, 0);
+
+	printf("discovery: probe broadcast by board on loopback to udp server on %s\n", addr);
+	if (err < 0) {
+		fprintf(stderr, "sim: Probe hasn't been answered\n");
+		return err;
+	}
+	printf("  answered in %.0f us\n", sim_elapsed(&t0, &t1) * 1e6);
+
+	return 0;
+}
+
+
+/* Function adds file served to boards, content is loaded only if it's verified */
+static int sim_addfile(char *name)
+{
+	char path[PATH_MAX];
+	sim_file_t *f;
+	struct stat st;
+	int fd;
+
+	if ((f = realloc(sim.files, (sim.nfiles + 1) * sizeof(*f))) == NULL)
+		return ERR_MEM;
+	sim.files = f;
+	f = &sim.files[sim.nfiles];
+
+	snprintf(path, sizeof(path), "%s/%s", sim.sysdir, name);
+	if (((fd = open(path, O_RDONLY)) < 0) || (fstat(fd, &st) < 0)) {
+		fprintf(stderr, "sim: Can't open '%s'\n", path);
+		return ERR_FILE;
+	}
+
+	f->name = name;
+	f->size = st.st_size;
+	f->data = NULL;
+	if (sim.verify && (f->size != 0) && ((f->data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+		f->data = NULL;
+	close(fd);
+
+	sim.nfiles++;
+	return 0;
+}
+
+
+/* Function creates count files of given size filled with random data, spec is count:size[:prefix] */
+static int sim_genfiles(const char *spec)
+{
+	unsigned int count, size, k, i;
+	char path[PATH_MAX], prefix[32] = "sim", *name;
+	u8 *buff;
+	FILE *f;
+
+	if ((sscanf(spec, "%u:%u:%31s", &count, &size, prefix) < 2) || (count == 0))
+		return ERR_ARG;
+
+	if ((buff = malloc(size + 1)) == NULL)
+		return ERR_MEM;
+
+	srand(count);
+	for (k = 0; k < count; k++) {
+		for (i = 0; i < size; i++)
+			buff[i] = rand();
+
+		snprintf(path, sizeof(path), "%s/%s%04u", sim.sysdir, prefix, k);
+		if (((f = fopen(path, "wb")) == NULL) || (fwrite(buff, 1, size, f) != size) || (fclose(f) != 0)) {
+			fprintf(stderr, "sim: Can't create '%s'\n", path);
+			free(buff);
+			return ERR_FILE;
+		}
+
+		if (((name = strdup(path + strlen(sim.sysdir) + 1)) == NULL) || (sim_addfile(name) < 0)) {
+			free(buff);
+			return ERR_FILE;
+		}
+	}
+
+	free(buff);
+	return 0;
+}
+
+
+static void sim_help(void)
+{
+	fprintf(stderr, "usage: phoenixd-sim -x phoenixd [-T pty|pipe|udp|tcp|tcpl] [-n boards] [-s sysdir] [-r rounds]\n"
+		"\t\t[-l maxlen] [-P port] [-c [-H blksz]] [-z] [-o server_log] [-a server_arg ...] [-G count:size[:prefix]] [file ...]\n"
+		"       phoenixd-sim -x phoenixd -I seconds | -D [-P port] [-o server_log] [-a server_arg ...]\n"
+		"\n"
+		"Simulated boards fetch all files from the server (open, fstat, read, close).\n"
+		"-x\t- phoenixd binary started with devices of all boards\n"
+		"-T\t- transport (default pipe), tcpl - boards connect to the server listening on one port\n"
+		"-n\t- number of boards (default 1)\n"
+		"-s\t- server directory with the files (default .)\n"
+		"-r\t- number of times every file is fetched (default 1)\n"
+		"-l\t- message length negotiated on udp and tcp (default %u, maximum %u)\n"
+		"-P\t- udp or tcpl port or first tcp port (default %u)\n"
+		"-c\t- verify content of the files\n"
+		"-H\t- compare block hashes of the files (MSG_HASH) with their content instead of reading them\n"
+		"-z\t- request compressed data (LZ4 blocks decoded by the simulator)\n"
+		"-o\t- server output file (default /dev/null)\n"
+		"-a\t- additional server argument\n"
+		"-G\t- generate count files of size bytes named prefix0000... (default sim) in the server directory,\n"
+		"\t  without -x files are generated only\n"
+		"-I\t- run udp server without boards (on port %u by default, announcements reach the server itself)\n"
+		"\t  and check that it stays idle\n"
+		"-D\t- broadcast MSG_HELLO probe from loopback and check that udp server answers it at once\n", MSG_MAXLEN, MSG_LARGELEN, SIM_PORT, PHFS_UDPPORT);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char **a;
+	int c;
+
+	sim.transport = SIM_PIPE;
+	sim.nboards = 1;
+	sim.rounds = 1;
+	sim.maxlen = MSG_MAXLEN;
+	sim.sysdir = ".";
+
+	while ((c = getopt(argc, argv, "x:T:n:s:r:l:P:cH:zo:a:G:I:Dh")) >= 0) {
+		switch (c) {
+			case 'x':
+				sim.server = optarg;
+				break;
+			case 'T':
+				if (strcmp(optarg, "pty") == 0)
+					sim.transport = SIM_PTY;
+				else if (strcmp(optarg, "pipe") == 0)
+					sim.transport = SIM_PIPE;
+				else if (strcmp(optarg, "udp") == 0)
+					sim.transport = SIM_UDP;
+				else if (strcmp(optarg, "tcp") == 0)
+					sim.transport = SIM_TCP;
+				else if (strcmp(optarg, "tcpl") == 0)
+					sim.transport = SIM_TCPL;
+				else {
+					sim_help();
+					return ERR_ARG;
+				}
+				break;
+			case 'n':
+				sim.nboards = atoi(optarg);
+				break;
+			case 's':
+				sim.sysdir = optarg;
+				break;
+			case 'r':
+				sim.rounds = atoi(optarg);
+				break;
+			case 'l':
+				sim.maxlen = atoi(optarg);
+				if ((sim.maxlen < MSG_MAXLEN) || (sim.maxlen > MSG_LARGELEN)) {
+					sim_help();
+					return ERR_ARG;
+				}
+				break;
+			case 'P':
+				sim.port = atoi(optarg);
+				break;
+			case 'c':
+				sim.verify = 1;
+				break;
+			case 'H':
+				sim.hashblk = atoi(optarg);
+				if ((sim.hashblk < PHFS_HASHMINBLK) || (sim.hashblk > PHFS_HASHMAXBLK)) {
+					sim_help();
+					return ERR_ARG;
+				}
+				break;
+			case 'z':
+				sim.lz = 1;
+				break;
+			case 'o':
+				sim.log = optarg;
+				break;
+			case 'a':
+				if ((a = realloc(sim.sargs, (sim.nsargs + 1) * sizeof(char *))) == NULL)
+					return ERR_MEM;
+				sim.sargs = a;
+				sim.sargs[sim.nsargs++] = optarg;
+				break;
+			case 'G':
+				if (sim_genfiles(optarg) < 0)
+					return ERR_FILE;
+				break;
+			case 'I':
+				if ((sim.idle = atoi(optarg)) == 0) {
+					sim_help();
+					return ERR_ARG;
+				}
+				break;
+			case 'D':
+				sim.discover = 1;
+				break;
+			default:
+				sim_help();
+				return ERR_ARG;
+		}
+	}
+
+	for (; optind < argc; optind++) {
+		if (sim_addfile(argv[optind]) < 0)
+			return ERR_FILE;
+	}
+
+	/* Files are only generated */
+	if ((sim.server == NULL) && (sim.nfiles != 0))
+		return 0;
+
+	if (sim.port == 0)
+		sim.port = (sim.idle != 0) ? PHFS_UDPPORT : SIM_PORT;
+
+	if ((sim.server != NULL) && (sim.idle != 0))
+		return (sim_idle() < 0) ? 1 : 0;
+
+	if ((sim.server != NULL) && sim.discover)
+		return (sim_discover() < 0) ? 1 : 0;
+
+	if ((sim.server == NULL) || (sim.nfiles == 0) || (sim.nboards == 0) || (sim.rounds == 0) || ((sim.hashblk != 0) && !sim.verify)) {
+		sim_help();
+		return ERR_ARG;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	return (sim_run() < 0) ? 1 : 0;
+}
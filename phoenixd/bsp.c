@@ -18,108 +18,225 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <hostutils-common/errors.h>
-#include <hostutils-common/serial.h>
+#include <hostutils-common/codec.h>
 #include "bsp.h"
-#include "elf.h"
+#include "elfload.h"
+#include "lzcache.h"
+#include "log.h"
 
 
 #define KERNEL_BASE  0xc0000000
 
 
+static const codec_t bsp_codec = { BSP_ENDCHAR, BSP_ESCCHAR, 0 };
+
+
+void bsp_link(bsp_link_t *l, int fd, int fd_out, int dgram)
+{
+	l->fd = fd;
+	l->fd_out = fd_out;
+	l->dgram = dgram;
+	l->peerfl = 0;
+	l->rd = 0;
+	l->wr = 0;
+}
+
+
+/* Function returns checksum of the message, escaped characters are not included */
+static s16 bsp_fcs(u8 t, const u8 *buffer, uint len)
+{
+	s16 fcs = t;
+	uint k;
+
+	for (k = 0; k < len; k++) {
+		if ((buffer[k] != BSP_ESCCHAR) && (buffer[k] != BSP_ENDCHAR))
+			fcs += (s8)buffer[k];
+	}
+
+	return fcs;
+}
+
+
+static int bsp_write(bsp_link_t *l, const u8 *buff, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	if (l->dgram) {
+		if (!l->peerfl)
+			return ERR_SERIAL_IO;
+
+		if (sendto(l->fd_out, buff, len, 0, (struct sockaddr *)&l->peer, sizeof(l->peer)) < 0)
+			return ERR_SERIAL_IO;
+
+		return ERR_NONE;
+	}
+
+	while (len > 0) {
+		if ((n = write(l->fd_out, buff, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return ERR_SERIAL_IO;
+
+			/* Nonblocking pipes and sockets */
+			pfd.fd = l->fd_out;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+
+		buff += n;
+		len -= n;
+	}
+
+	return ERR_NONE;
+}
+
+
+/* Function reads available data or the next datagram, waits for it up to timeout (ms, 0 - infinitely) */
+static int bsp_fill(bsp_link_t *l, uint timeout)
+{
+	struct pollfd pfd;
+	socklen_t plen = sizeof(l->peer);
+	ssize_t n;
+	int res;
+
+	pfd.fd = l->fd;
+	pfd.events = POLLIN;
+	if ((res = poll(&pfd, 1, (timeout != 0) ? (int)timeout : -1)) < 0)
+		return (errno == EINTR) ? ERR_NONE : ERR_SERIAL_IO;
+	if (res == 0)
+		return ERR_SERIAL_TIMEOUT;
+
+	/* Frames don't span datagrams */
+	if (l->dgram) {
+		if ((n = recvfrom(l->fd, l->buff, sizeof(l->buff), 0, (struct sockaddr *)&l->peer, &plen)) < 0)
+			return ((errno == EINTR) || (errno == EAGAIN)) ? ERR_NONE : ERR_SERIAL_IO;
+
+		l->peerfl = 1;
+		l->rd = 0;
+		l->wr = n;
+		return ERR_NONE;
+	}
+
+	if (l->rd == l->wr) {
+		l->rd = 0;
+		l->wr = 0;
+	}
+	else if (l->wr == sizeof(l->buff)) {
+		memmove(l->buff, l->buff + l->rd, l->wr - l->rd);
+		l->wr -= l->rd;
+		l->rd = 0;
+	}
+
+	if ((n = read(l->fd, l->buff + l->wr, sizeof(l->buff) - l->wr)) < 0)
+		return ((errno == EINTR) || (errno == EAGAIN)) ? ERR_NONE : ERR_SERIAL_IO;
+
+	/* Readiness with no data - connection has been closed */
+	if (n == 0)
+		return ERR_SERIAL_CLOSED;
+
+	l->wr += n;
+	return ERR_NONE;
+}
+
+
 /* Function sends BSP message */
-int bsp_send(int fd, u8 t, char *buffer, uint len)
+int bsp_send(bsp_link_t *l, u8 t, char *buffer, uint len)
 {
 	s16 fcs;
-	uint k, i;
-	int err;
+	uint i;
 	u8 frame[BSP_FRAMESZ];
 
 	if (len > BSP_MSGSZ)
 		return ERR_ARG;
 
-	/* Calculate checksum */
 	frame[0] = t;
-	fcs = t;
-	for (k = 0, i = BSP_HDRSZ; k < len; k++) {
-		if (((unsigned char)buffer[k] != BSP_ESCCHAR) && ((unsigned char)buffer[k] != BSP_ENDCHAR))
-			fcs += (char)buffer[k];
-		else
-			frame[i++] = BSP_ESCCHAR;
-		frame[i++] = buffer[k];
-	}
-	frame[i++] = BSP_ENDCHAR;
-	*(s16 *)&frame[1] = fcs;
+	fcs = bsp_fcs(t, (u8 *)buffer, len);
+	memcpy(&frame[1], &fcs, sizeof(fcs));
 
-	if ((err = serial_write(fd, frame, i)) < 0)
-		return err;
+	i = BSP_HDRSZ + codec_encode(&bsp_codec, &frame[BSP_HDRSZ], (u8 *)buffer, len);
+	frame[i++] = BSP_ENDCHAR;
 
-	return ERR_NONE;
+	return bsp_write(l, frame, i);
 }
 
 
 /* Function receives BSP message */
-int bsp_recv(int fd, u8 *t, char *buffer, uint len, uint timeout)
+int bsp_recv(bsp_link_t *l, u8 *t, char *buffer, uint len, uint timeout)
 {
-	u8 c;
-	uint i, escfl = 0;
-	s16 fcs, sfcs;
-	int err;
+	size_t slen, dlen;
+	uint i;
+	int err, escfl, end;
+	s16 sfcs;
 
 	if (len < BSP_MSGSZ)
 		return ERR_ARG;
 
-	if ((err = serial_read(fd, t, 1, timeout)) < 0)
-		return err;
-	if ((err = serial_read(fd, (u8 *)&sfcs, 2, timeout)) < 0)
-		return err;
-
-	for (fcs = *t, i = 0, escfl = 0;;) {
-		if ((err = serial_read(fd, &c, 1, timeout)) < 0)
+	/* Type and checksum aren't escaped */
+	while (l->wr - l->rd < BSP_HDRSZ) {
+		if ((err = bsp_fill(l, timeout)) < 0)
 			return err;
-		if (i == BSP_MSGSZ)
-			return ERR_SIZE;
+	}
 
-		if (escfl) {
-			buffer[i++] = c;
-			escfl = 0;
-			continue;
-		}
+	*t = l->buff[l->rd];
+	memcpy(&sfcs, &l->buff[l->rd + 1], sizeof(sfcs));
+	l->rd += BSP_HDRSZ;
+
+	for (i = 0, escfl = 0;;) {
+		slen = l->wr - l->rd;
+		dlen = BSP_MSGSZ - i;
+		end = codec_decode(&bsp_codec, (u8 *)buffer + i, &dlen, l->buff + l->rd, &slen, &escfl);
+		l->rd += slen;
+		i += dlen;
 
-		if (c == BSP_ENDCHAR) {
-			if (sfcs != fcs)
-				return ERR_BSP_FCS;
+		if (end) {
+			l->rd++;
 			break;
 		}
 
-		if (c == BSP_ESCCHAR) {
-			escfl = 1;
-			continue;
+		if (i == BSP_MSGSZ) {
+			l->rd = l->wr;
+			return ERR_SIZE;
 		}
-		buffer[i++] = c;
-		fcs += (char)c;
+
+		/* Datagram ended in the middle of the frame */
+		if (l->dgram)
+			return ERR_BSP_FCS;
+
+		if ((err = bsp_fill(l, timeout)) < 0)
+			return err;
 	}
 
+	if (bsp_fcs(*t, (u8 *)buffer, i) != sfcs)
+		return ERR_BSP_FCS;
+
 	return i;
 }
 
 
 /* Function sends BSP request (sends message and waits for answer) */
-int bsp_req(int fd, u8 st, char *sbuff, uint slen, u8 *rt, u8 *rbuff, uint rlen, u16 num, u16 *rnum)
+int bsp_req(bsp_link_t *l, u8 st, char *sbuff, uint slen, u8 *rt, u8 *rbuff, uint rlen, u16 num, u16 *rnum)
 {
 	int err;
 	uint fails;
 
 	for (fails = 0; fails < BSP_MAXREP; fails++) {
-		if ((err = bsp_send(fd, st, sbuff, slen)) < 0)
+		if ((err = bsp_send(l, st, sbuff, slen)) < 0)
 			return err;
 
-		err = bsp_recv(fd, rt, (char*)rbuff, rlen, BSP_TIMEOUT);
+		err = bsp_recv(l, rt, (char*)rbuff, rlen, BSP_TIMEOUT);
 		if (err <= 0) {
-			if (err == ERR_SERIAL_TIMEOUT)
+			if ((err == ERR_SERIAL_TIMEOUT) || (err == ERR_SERIAL_CLOSED))
 				return err;
 		}
 		else {
@@ -139,173 +256,141 @@ int bsp_req(int fd, u8 st, char *sbuff, uint slen, u8 *rt, u8 *rbuff, uint rlen,
  */
 
 
-/* Functions sends kernel to Phoenix node */
-int bsp_sendkernel(int fd, char *kernel)
+/* Function fills compressed frame with the longest block of segment data at offs fitting in it */
+static ssize_t bsp_lzframe(elf_image_t *img, const Elf32_Phdr *seg, char *sbuff, u32 offs, u32 *size)
 {
-	FILE *f;
-	char sbuff[BSP_MSGSZ], rbuff[BSP_MSGSZ];
-	Elf32_Ehdr hdr;
-	Elf32_Phdr phdr;
-	Elf32_Half k, i;
-	Elf32_Half seg, offs;
-	int size, l, err;
-	u8 t;
-	u16 num = 0;
+	const lzcache_block_t *b = NULL;
+	u32 rem = seg->p_filesz - offs;
+	ssize_t n;
+	u16 len;
 
-	/* Open kernel file and read ELF header */
-	if ((f = fopen(kernel, "r")) == NULL)
-		return ERR_FILE;
-	if (fread(&hdr, sizeof(Elf32_Ehdr), 1, f) != 1) {
-		fclose(f);
+	for (*size = (rem < BSP_LZBLOCK) ? rem : BSP_LZBLOCK; *size > BSP_MSGSZ - sizeof(len); *size /= 2) {
+		if ((b = lzcache_get(img->entry, seg->p_offset + offs, *size, BSP_MSGSZ - sizeof(len))) != NULL)
+			break;
+	}
+
+	if (b != NULL) {
+		memcpy(sbuff + sizeof(len), b->data, b->clen);
+		n = b->clen;
+	}
+	else if ((n = elf_read(img, seg, sbuff + sizeof(len), BSP_MSGSZ - sizeof(len), offs)) <= 0) {
 		return ERR_FILE;
 	}
+	else {
+		*size = n;
+	}
+
+	len = *size;
+	memcpy(sbuff, &len, sizeof(len));
+
+	return sizeof(len) + n;
+}
+
 
-	/* Read program headers and send segments */
-	for (k = 0; k < hdr.e_phnum; k++) {
-		fseek(f, hdr.e_phoff + k * sizeof(Elf32_Phdr), SEEK_SET);
-		if (fread(&phdr, sizeof(Elf32_Phdr), 1, f) != 1) {
-			fclose(f);
+/* Function sends segment data from the mapping of the image in BSP_MSGSZ pieces (compressed if lz is set) */
+static int bsp_sendsegment(bsp_link_t *l, elf_image_t *img, const Elf32_Phdr *seg, u8 type, int lz, u16 *num)
+{
+	char sbuff[BSP_MSGSZ], rbuff[BSP_MSGSZ];
+	ssize_t n;
+	u32 offs, size;
+	int err;
+	u8 t;
+
+	for (offs = 0; offs < seg->p_filesz; offs += size) {
+		if (lz)
+			n = bsp_lzframe(img, seg, sbuff, offs, &size);
+		else
+			size = n = elf_read(img, seg, sbuff, BSP_MSGSZ, offs);
+
+		if (n <= 0)
 			return ERR_FILE;
-		}
 
-		if ((phdr.p_type == PT_LOAD) && (phdr.p_vaddr != 0)) {
+		if ((err = bsp_req(l, type, sbuff, n, &t, (u8 *)rbuff, BSP_MSGSZ, *num, num)) < 0)
+			return err;
+	}
 
-			/* Calculate realmode address */
-			seg = (phdr.p_vaddr - KERNEL_BASE) / 16;
-			offs = (phdr.p_vaddr - KERNEL_BASE) % 16;
+	return ERR_NONE;
+}
 
-			*(u16 *)sbuff = seg;
-			*(u16 *)&sbuff[2] = offs;
 
-			if ((err = bsp_req(fd, BSP_TYPE_SHDR, sbuff, 4, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-				fclose(f);
-				return err;
-			}
+/* Functions sends kernel to Phoenix node */
+int bsp_sendkernel(bsp_link_t *l, char *kernel, int lz)
+{
+	char sbuff[BSP_MSGSZ], rbuff[BSP_MSGSZ];
+	elf_image_t *img;
+	const Elf32_Phdr *seg;
+	Elf32_Half seg16, offs;
+	unsigned int k;
+	int err;
+	u8 t;
+	u16 num = 0;
 
-			/* Send segment data */
-			fseek(f, phdr.p_offset, SEEK_SET);
-			for (i = 0; i < phdr.p_filesz / BSP_MSGSZ; i++) {
-				if (fread(sbuff, 1, BSP_MSGSZ, f) != BSP_MSGSZ) {
-					fclose(f);
-					return ERR_FILE;
-				}
-
-				if ((err = bsp_req(fd, BSP_TYPE_KDATA, sbuff, BSP_MSGSZ, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-					fclose(f);
-					return err;
-				}
-			}
+	if ((img = elf_get(kernel)) == NULL)
+		return ERR_FILE;
 
-			size = phdr.p_filesz % BSP_MSGSZ;
-			if (size != 0) {
-				if ((l = fread(sbuff, 1, size, f)) != size) {
-					fclose(f);
-					return ERR_FILE;
-				}
-				if ((err = bsp_req(fd, BSP_TYPE_KDATA, sbuff, size, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-					fclose(f);
-					return err;
-				}
-			}
+	for (k = 0; k < img->nsegs; k++) {
+		seg = &img->segs[k];
+
+		/* Calculate realmode address */
+		seg16 = (seg->p_vaddr - KERNEL_BASE) / 16;
+		offs = (seg->p_vaddr - KERNEL_BASE) % 16;
+
+		*(u16 *)sbuff = seg16;
+		*(u16 *)&sbuff[2] = offs;
+
+		if (((err = bsp_req(l, BSP_TYPE_SHDR, sbuff, 4, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) ||
+				((err = bsp_sendsegment(l, img, seg, BSP_TYPE_KDATA, lz, &num)) < 0)) {
+			elf_put(img);
+			return err;
 		}
 	}
+	elf_put(img);
 
 	/* Last message */
-	if ((err = bsp_send(fd, BSP_TYPE_GO, sbuff, 1)) < 0) {
-		fclose(f);
+	if ((err = bsp_send(l, BSP_TYPE_GO, sbuff, 1)) < 0)
 		return err;
-	}
-	fclose(f);
-	fprintf(stderr, "[%d] System started\n", getpid());
+
+	log_info(LOG_BSP, "System started");
 
 	return 0;
 }
 
 
 /* Function sends user program to Phoenix node */
-int bsp_sendprogram(int fd, char *name, char *sysdir)
+int bsp_sendprogram(bsp_link_t *l, char *name, char *sysdir, int lz)
 {
-	FILE *f;
 	char sbuff[BSP_MSGSZ], rbuff[BSP_MSGSZ];
-	Elf32_Ehdr hdr;
-	Elf32_Phdr phdr;
-	Elf32_Half k, i;
-	uint size, l;
+	char path[PATH_MAX];
+	elf_image_t *img;
+	unsigned int k;
 	u8 t;
 	u16 num = 0;
-	char *tname;
 	int err;
 
-	if ((tname = (char *)malloc(strlen(sysdir) + 1 + strlen(name) + 1)) == NULL)
-		return ERR_MEM;
-
-	sprintf(tname, "%s/%s", sysdir, name);
-
-	if ((f = fopen(tname, "r")) == NULL) {
-		bsp_req(fd, BSP_TYPE_ERR, sbuff, 1, &t, (u8*)rbuff, BSP_MSGSZ, num, &num);
-		free(tname);
-		return ERR_FILE;
-	}
-	free(tname);
-
-	if (fread(&hdr, sizeof(Elf32_Ehdr), 1, f) != 1) {
-		bsp_req(fd, BSP_TYPE_ERR, sbuff, 1, &t, (u8*)rbuff, BSP_MSGSZ, num, &num);
-		fclose(f);
+	if (((size_t)snprintf(path, sizeof(path), "%s/%s", sysdir, name) >= sizeof(path)) || ((img = elf_get(path)) == NULL)) {
+		bsp_req(l, BSP_TYPE_ERR, sbuff, 1, &t, (u8*)rbuff, BSP_MSGSZ, num, &num);
 		return ERR_FILE;
 	}
 
 	/* Send ELF header */
-	if ((err = bsp_req(fd, BSP_TYPE_EHDR, (char *)&hdr, sizeof(Elf32_Ehdr), &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-		fclose(f);
+	if ((err = bsp_req(l, BSP_TYPE_EHDR, (char *)&img->hdr, sizeof(Elf32_Ehdr), &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
+		elf_put(img);
 		return err;
 	}
 
 	/* Send program segments */
-	for (k = 0; k < hdr.e_phnum; k++) {
-		fseek(f, hdr.e_phoff + k * sizeof(Elf32_Phdr), SEEK_SET);
-		if (fread(&phdr, sizeof(Elf32_Phdr), 1, f) != 1) {
-			fclose(f);
-			return ERR_FILE;
-		}
-
-		if ((phdr.p_type == PT_LOAD) && (phdr.p_vaddr != 0)) {
-			if ((err = bsp_req(fd, BSP_TYPE_PHDR, (char *)&phdr, sizeof(Elf32_Phdr), &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-				fclose(f);
-				return err;
-			}
-
-			fseek(f, phdr.p_offset, SEEK_SET);
-			for (i = 0; i < phdr.p_filesz / BSP_MSGSZ; i++) {
-				if (fread(sbuff, 1, BSP_MSGSZ, f) != BSP_MSGSZ) {
-					fclose(f);
-					return ERR_FILE;
-				}
-				if ((err = bsp_req(fd, BSP_TYPE_PDATA, sbuff, BSP_MSGSZ, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-					fclose(f);
-					return err;
-				}
-			}
-
-			size = phdr.p_filesz % BSP_MSGSZ;
-			if (size != 0) {
-				if ((l = fread(sbuff, 1, size, f)) != size) {
-					fclose(f);
-					return ERR_FILE;
-				}
-				if ((err = bsp_req(fd, BSP_TYPE_PDATA, sbuff, size, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-					fclose(f);
-					return err;
-				}
-			}
+	for (k = 0; k < img->nsegs; k++) {
+		if (((err = bsp_req(l, BSP_TYPE_PHDR, (char *)&img->segs[k], sizeof(Elf32_Phdr), &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) ||
+				((err = bsp_sendsegment(l, img, &img->segs[k], BSP_TYPE_PDATA, lz, &num)) < 0)) {
+			elf_put(img);
+			return err;
 		}
 	}
+	elf_put(img);
 
 	/* Last frame, which finishes transaction */
-	if ((err = bsp_req(fd, BSP_TYPE_GO, sbuff, 1, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0) {
-		fclose(f);
+	if ((err = bsp_req(l, BSP_TYPE_GO, sbuff, 1, &t, (u8*)rbuff, BSP_MSGSZ, num, &num)) < 0)
 		return err;
-	}
 
-	fclose(f);
 	return ERR_NONE;
 }
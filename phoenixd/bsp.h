@@ -18,13 +18,16 @@
 #define _BSP_H_
 
 
+#include <stddef.h>
+#include <netinet/in.h>
 #include <hostutils-common/types.h>
 
 
 /* BSP sizes */
 #define BSP_HDRSZ        3
 #define BSP_MSGSZ        1024
-#define BSP_FRAMESZ      BSP_MSGSZ * 2 + BSP_HDRSZ
+#define BSP_FRAMESZ      (BSP_HDRSZ + BSP_MSGSZ * 2 + 1)
+#define BSP_BUFSZ        (2 * BSP_FRAMESZ)
 
 
 /* BSP characters */
@@ -43,6 +46,18 @@
 #define BSP_TYPE_EHDR      8
 #define BSP_TYPE_PHDR      9
 #define BSP_TYPE_ERR       10
+#define BSP_TYPE_LZREQ     11 /* BSP_TYPE_PDATA program request with compressed data */
+
+
+/* Kernel request (BSP_TYPE_KDATA) flags */
+#define BSP_KREQ_LZ        1
+
+
+/*
+ * Compressed KDATA and PDATA frame starts with u16 length of segment data it carries, they are stored
+ * as is if length is equal to the rest of the frame or compressed into LZ4 block otherwise
+ */
+#define BSP_LZBLOCK        8192
 
 
 /* BSP timings */
@@ -51,24 +66,45 @@
 #define BSP_MAXREP     3
 
 
+/*
+ * Link to the target - serial line, pipes, TCP or UNIX socket carry stream of frames,
+ * UDP carries one frame per datagram and replies are sent to the sender of the last one
+ */
+typedef struct {
+	int fd;
+	int fd_out;
+	int dgram;
+	struct sockaddr_in peer;
+	int peerfl;
+
+	/* Received data not consumed yet */
+	u8 buff[BSP_BUFSZ];
+	size_t rd;
+	size_t wr;
+} bsp_link_t;
+
+
+extern void bsp_link(bsp_link_t *l, int fd, int fd_out, int dgram);
+
+
 /* Function sends BSP message */
-extern int bsp_send(int fd, u8 t, char *buffer, uint len);
+extern int bsp_send(bsp_link_t *l, u8 t, char *buffer, uint len);
 
 
 /* Function receives BSP message */
-extern int bsp_recv(int fd, u8 *t, char *in_buffer, uint len, uint timeout);
+extern int bsp_recv(bsp_link_t *l, u8 *t, char *in_buffer, uint len, uint timeout);
 
 
 /* Function sends BSP request (sends message and waits for answer) */
-extern int bsp_req(int fd, u8 st, char *sbuff, uint slen, u8 *rt, u8 *rbuff, uint rlen, u16 num, u16 *rnum);
+extern int bsp_req(bsp_link_t *l, u8 st, char *sbuff, uint slen, u8 *rt, u8 *rbuff, uint rlen, u16 num, u16 *rnum);
 
 
 /* Functions sends kernel to Phoenix node */
-extern int bsp_sendkernel(int fd, char *kernel);
+extern int bsp_sendkernel(bsp_link_t *l, char *kernel, int lz);
 
 
 /* Function sends user program to Phoenix node */
-extern int bsp_sendprogram(int fd, char *name, char *sysdir);
+extern int bsp_sendprogram(bsp_link_t *l, char *name, char *sysdir, int lz);
 
 
 #endif
@@ -0,0 +1,317 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Content cache of files served to targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+
+#define CACHE_BUCKETS 1024
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+
+static struct {
+	cache_entry_t *buckets[CACHE_BUCKETS];
+	cache_entry_t *lru, *tail;
+	size_t size;
+
+	int guardfl;
+	sigjmp_buf jmp;
+	volatile sig_atomic_t guard;
+} cache;
+
+
+static unsigned int cache_hash(const char *path)
+{
+	unsigned int h = 2166136261u;
+
+	while (*path != '\0')
+		h = (h ^ (u8)*path++) * 16777619u;
+
+	return h % CACHE_BUCKETS;
+}
+
+
+/* Mapping of the file truncated on the host can't be accessed, bail out from cache_read() */
+static void cache_sigbus(int sig)
+{
+	if (cache.guard)
+		siglongjmp(cache.jmp, 1);
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+
+static void cache_free(cache_entry_t *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACHE_NPRIV; i++) {
+		if (e->privfree[i] != NULL)
+			e->privfree[i](e->priv[i]);
+	}
+
+	if (e->data != NULL)
+		munmap(e->data, e->len);
+
+	cache.size -= e->len;
+	free(e->path);
+	free(e);
+}
+
+
+/* Function removes entry from lookup structures, it's freed when not used anymore */
+static void cache_unlink(cache_entry_t *e)
+{
+	cache_entry_t **p;
+
+	if (e->stale)
+		return;
+
+	for (p = &cache.buckets[cache_hash(e->path)]; *p != NULL; p = &(*p)->hnext) {
+		if (*p == e) {
+			*p = e->hnext;
+			break;
+		}
+	}
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		cache.lru = e->next;
+
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		cache.tail = e->prev;
+
+	e->stale = 1;
+	if (e->refs == 0)
+		cache_free(e);
+}
+
+
+static void cache_touch(cache_entry_t *e)
+{
+	if (cache.lru == e)
+		return;
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else if (cache.tail == e)
+		cache.tail = e->prev;
+
+	e->prev = NULL;
+	e->next = cache.lru;
+	if (cache.lru != NULL)
+		cache.lru->prev = e;
+	cache.lru = e;
+	if (cache.tail == NULL)
+		cache.tail = e;
+}
+
+
+/* Function evicts least recently used, not opened entries exceeding the budget */
+static void cache_evict(void)
+{
+	cache_entry_t *e, *prev;
+
+	for (e = cache.tail; (e != NULL) && (cache.size > CACHE_BUDGET); e = prev) {
+		prev = e->prev;
+		if (e->refs == 0)
+			cache_unlink(e);
+	}
+}
+
+
+static int cache_valid(cache_entry_t *e, struct stat *st)
+{
+	return (e->st.st_dev == st->st_dev) && (e->st.st_ino == st->st_ino) && (e->st.st_size == st->st_size) &&
+		(e->st.st_mtim.tv_sec == st->st_mtim.tv_sec) && (e->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+
+cache_entry_t *cache_get(const char *path)
+{
+	cache_entry_t *e;
+	struct sigaction sa;
+	struct stat st;
+	int fd;
+
+	if (!cache.guardfl) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = cache_sigbus;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGBUS, &sa, NULL);
+		cache.guardfl = 1;
+	}
+
+	if ((stat(path, &st) < 0) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	for (e = cache.buckets[cache_hash(path)]; e != NULL; e = e->hnext) {
+		if (strcmp(e->path, path) == 0)
+			break;
+	}
+
+	if (e != NULL) {
+		if (cache_valid(e, &st)) {
+			cache_touch(e);
+			e->refs++;
+			return e;
+		}
+
+		/* File has been changed on the host */
+		cache_unlink(e);
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	if ((fstat(fd, &e->st) < 0) || !S_ISREG(e->st.st_mode) || ((e->path = strdup(path)) == NULL)) {
+		close(fd);
+		free(e);
+		return NULL;
+	}
+
+	e->len = e->st.st_size;
+	if ((e->len != 0) && ((e->data = mmap(NULL, e->len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+		close(fd);
+		free(e->path);
+		free(e);
+		return NULL;
+	}
+	close(fd);
+
+	e->refs = 1;
+	e->hnext = cache.buckets[cache_hash(path)];
+	cache.buckets[cache_hash(path)] = e;
+	cache_touch(e);
+	cache.size += e->len;
+
+	cache_evict();
+
+	return e;
+}
+
+
+void cache_put(cache_entry_t *e)
+{
+	if (--e->refs != 0)
+		return;
+
+	if (e->stale)
+		cache_free(e);
+	else
+		cache_evict();
+}
+
+
+void cache_ref(cache_entry_t *e)
+{
+	e->refs++;
+}
+
+
+const u8 *cache_map(cache_entry_t *e, off_t pos, size_t *len)
+{
+	if ((pos < 0) || (pos >= e->len)) {
+		*len = 0;
+		return e->data;
+	}
+
+	if (*len > e->len - pos)
+		*len = e->len - pos;
+
+	return e->data + pos;
+}
+
+
+int cache_guard(cache_entry_t *e, int (*fn)(void *arg), void *arg)
+{
+	int res;
+
+	if (sigsetjmp(cache.jmp, 1) != 0) {
+		/* File has been truncated on the host */
+		cache.guard = 0;
+		cache_unlink(e);
+		errno = EFAULT;
+		return -1;
+	}
+
+	cache.guard = 1;
+	res = fn(arg);
+	cache.guard = 0;
+
+	/* Truncated mapping accessed by the kernel */
+	if ((res < 0) && (errno == EFAULT))
+		cache_unlink(e);
+
+	return res;
+}
+
+
+typedef struct {
+	void *dst;
+	const void *src;
+	size_t len;
+} cache_copyarg_t;
+
+
+static int cache_copy(void *arg)
+{
+	cache_copyarg_t *c = arg;
+
+	memcpy(c->dst, c->src, c->len);
+	return 0;
+}
+
+
+ssize_t cache_read(cache_entry_t *e, void *buff, size_t len, off_t pos)
+{
+	cache_copyarg_t c;
+
+	if ((pos < 0) || (pos >= e->len))
+		return 0;
+
+	if (len > e->len - pos)
+		len = e->len - pos;
+
+	c.dst = buff;
+	c.src = e->data + pos;
+	c.len = len;
+
+	if (cache_guard(e, cache_copy, &c) < 0)
+		return -1;
+
+	return len;
+}
@@ -0,0 +1,77 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Content cache of files served to targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <hostutils-common/types.h>
+
+
+/* Mapped bytes kept for not opened files */
+#define CACHE_BUDGET  (256 * 1024 * 1024)
+
+/* Users of data parsed from the content */
+#define CACHE_ELF   0
+#define CACHE_LZ    1
+#define CACHE_HASH  2
+#define CACHE_NPRIV 3
+
+
+typedef struct _cache_entry_t {
+	struct _cache_entry_t *hnext;
+	struct _cache_entry_t *prev, *next; /* LRU list, most recently used first */
+
+	char *path;
+	struct stat st;
+	u8 *data;
+	size_t len;
+
+	/* Data parsed from the content by its users, freed with the entry */
+	void *priv[CACHE_NPRIV];
+	void (*privfree[CACHE_NPRIV])(void *priv);
+
+	unsigned int refs;
+	int stale;
+} cache_entry_t;
+
+
+/* Function returns up to date entry of the regular file, NULL if file can't be cached */
+extern cache_entry_t *cache_get(const char *path);
+
+
+extern void cache_put(cache_entry_t *e);
+
+
+/* Function takes another reference of the entry, released by cache_put() */
+extern void cache_ref(cache_entry_t *e);
+
+
+/* Function returns mapped file data at pos and clamps len, data can be accessed only by cache_guard() callback */
+extern const u8 *cache_map(cache_entry_t *e, off_t pos, size_t *len);
+
+
+/*
+ * Function calls fn(arg) catching access to the mapping of the file truncated on the host.
+ * Returns result of fn or -1 with errno set to EFAULT if file has been truncated.
+ */
+extern int cache_guard(cache_entry_t *e, int (*fn)(void *arg), void *arg);
+
+
+/* Function copies file data, returns number of copied bytes or -1 if file has been truncated */
+extern ssize_t cache_read(cache_entry_t *e, void *buff, size_t len, off_t pos);
+
+
+#endif
@@ -14,12 +14,23 @@
  */
 
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <hostutils-common/errors.h>
 #include <hostutils-common/serial.h>
@@ -28,9 +39,15 @@
 #include "phfs.h"
 #include "msg_udp.h"
 #include "msg_tcp.h"
+#include "poller.h"
+#include "log.h"
 
-int (*msg_send)(int fd, msg_t *msg, u16 seq);
-int (*msg_recv)(int fd, msg_t *msg, int *state);
+
+static session_t *sessions;
+static int initialized;
+static int metricsfd = -1;
+static dispatch_ctx_t metricsctx = { CTX_METRICS, NULL };
+static volatile sig_atomic_t dumpfl;
 
 
 static char *concat(char *s1, char *s2)
@@ -42,115 +59,1220 @@ static char *concat(char *s1, char *s2)
 }
 
 
+/* Pipes are opened read-write, so opening doesn't wait for QEMU and it's restarts don't hang the input up */
 static int connect_pipes(const char *dev_in, const char *dev_out, int *fd_in, int *fd_out)
 {
-	if ((*fd_in = open(dev_in, O_RDONLY)) < 0) {
-		fprintf(stderr, "[%d] dispatch: Can't open pipe '%s'\n", getpid(), dev_in);
+	if ((*fd_in = open(dev_in, O_RDWR | O_NONBLOCK)) < 0)
 		return ERR_DISPATCH_IO;
-	}
 
-	if ((*fd_out = open(dev_out, O_WRONLY)) < 0) {
-		fprintf(stderr, "[%d] dispatch: Can't open pipe '%s'\n", getpid(), dev_out);
+	if ((*fd_out = open(dev_out, O_RDWR | O_NONBLOCK)) < 0) {
+		close(*fd_in);
+		*fd_in = -1;
 		return ERR_DISPATCH_IO;
 	}
 	return 0;
 }
 
 
-/* Function reads and dispatches messages */
-int dispatch(char *dev_addr, dmode_t mode, char *sysdir, void *data)
+/* QEMU listens on the socket of -chardev socket,path=<path>,server=on,wait=off */
+static int connect_socket(const char *path, int *fd)
 {
-	int fd = -1;
-	int fd_out = -1;
-	int retries = 128;
-	int baudrate;
-	msg_t msg;
-	int state, err;
-	char *dev_in = 0;
-	char *dev_out = 0;
+	struct sockaddr_un addr;
 
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return ERR_ARG;
 
-	if (mode == SERIAL) {
-		if (serial_speed2int(*(speed_t *)data, &baudrate) < 0) {
-			fprintf(stderr, "[%d] dispatch: Wrong speed port\n", getpid());
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return ERR_DISPATCH_IO;
+
+	if (connect(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(*fd);
+		*fd = -1;
+		return ERR_DISPATCH_IO;
+	}
+
+	fcntl(*fd, F_SETFL, fcntl(*fd, F_GETFL) | O_NONBLOCK);
+
+	return 0;
+}
+
+
+static int session_pipeopen(session_t *s)
+{
+	struct stat st;
+
+	if (s->chardev) {
+		if (connect_socket(s->dev_in, &s->link.fd) < 0)
 			return ERR_DISPATCH_IO;
+		s->link.fd_out = s->link.fd;
+		return 0;
+	}
+
+	if (connect_pipes(s->dev_in, s->dev_out, &s->link.fd, &s->link.fd_out) < 0)
+		return ERR_DISPATCH_IO;
+
+	s->ino = (fstat(s->link.fd, &st) == 0) ? st.st_ino : 0;
+
+	return 0;
+}
+
+
+/* Function watches directory of the pipes or socket, so they are opened as soon as QEMU (re)creates them */
+static int session_watch(session_t *s)
+{
+#ifdef __linux__
+	char *dir, *p;
+	int err = 0;
+
+	if ((s->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return ERR_DISPATCH_IO;
+
+	if ((dir = strdup(s->dev_in)) == NULL)
+		return ERR_MEM;
+
+	if ((p = strrchr(dir, '/')) != NULL)
+		*((p == dir) ? p + 1 : p) = '\0';
+
+	if (inotify_add_watch(s->watchfd, (p != NULL) ? dir : ".", IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0)
+		err = ERR_DISPATCH_IO;
+
+	free(dir);
+	return err;
+#else
+	return ERR_DISPATCH_IO;
+#endif
+}
+
+
+static session_t *session_alloc(dmode_t mode)
+{
+	session_t *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+
+	s->mode = mode;
+	s->ctx.type = CTX_SESSION;
+	s->ctx.ptr = s;
+	s->probectx.type = CTX_PROBES;
+	s->probectx.ptr = s;
+	s->msg = &s->msgbuf;
+	s->watchfd = -1;
+
+	return s;
+}
+
+
+/* Function releases the kept reply */
+static void session_dropreply(session_reply_t *r)
+{
+	if (r->entry != NULL)
+		cache_put(r->entry);
+	r->entry = NULL;
+	r->len = 0;
+}
+
+
+static void session_close(session_t *s)
+{
+	session_t **p;
+	unsigned int i;
+
+	/* Peer sessions share socket of the server session and are closed with it */
+	if ((s->mode == UDP) && (s->server == NULL)) {
+		for (p = &sessions; *p != NULL;) {
+			if ((*p)->server == s)
+				session_close(*p);
+			else
+				p = &(*p)->next;
+		}
+	}
+
+	for (p = &sessions; *p != NULL; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
 		}
-		printf("[%d] dispatch: Starting message dispatcher on [%s] (speed=%d)\n", getpid(), dev_addr, baudrate);
-		if ((fd = serial_open(dev_addr, *(speed_t *)data)) < 0) {
-			fprintf(stderr, "[%d] dispatch: Can't open serial port '%s'\n", getpid(), dev_addr);
+	}
+
+	phfs_release(s);
+
+	/* Descriptor may be not watched yet if session is being closed on opening error */
+	if ((s->link.fd >= 0) && (s->server == NULL)) {
+		poller_del(s->link.fd);
+		close(s->link.fd);
+	}
+	if ((s->link.fd_out >= 0) && (s->link.fd_out != s->link.fd) && (s->server == NULL)) {
+		if (s->outfl)
+			poller_del(s->link.fd_out);
+		close(s->link.fd_out);
+	}
+
+	if ((s->mode == PIPE) && (s->watchfd >= 0)) {
+		poller_del(s->watchfd);
+		close(s->watchfd);
+	}
+
+	for (i = 0; i < DISPATCH_REPLIES; i++) {
+		session_dropreply(&s->replies[i]);
+		free(s->replies[i].req);
+		free(s->replies[i].data);
+	}
+
+	if (s->announce != NULL) {
+		if (s->announce->fd >= 0)
+			poller_del(s->announce->fd);
+		msg_udp_announcedone(s->announce);
+		free(s->announce);
+	}
+
+	if ((s->link.batch != NULL) && (s->server == NULL)) {
+		msg_udp_batchdone(s->link.batch);
+		free(s->link.batch);
+	}
+
+	if (s->msg != &s->msgbuf)
+		free(s->msg);
+
+	msg_linkdone(&s->link);
+	free(s->dev_in);
+	free(s->dev_out);
+	free(s);
+}
+
+
+/*
+ * Function keeps copy of reply to the handled request of UDP peer, last len bytes of message data are mapped by
+ * the cache entry, which is referenced instead of copying them. Returns 0 if reply has been kept.
+ */
+static int session_keepreply(session_t *s, msg_t *msg, const u8 *data, size_t len, cache_entry_t *entry)
+{
+	session_reply_t *r = s->reply;
+	size_t n = MSG_HDRSZ + msg_getlen(msg);
+	u8 *p;
+
+	if (r == NULL)
+		return -1;
+
+	session_dropreply(r);
+
+	if ((len > n) || ((len != 0) && (entry == NULL)))
+		return -1;
+
+	n -= len;
+	if (r->sz < n) {
+		if ((p = realloc(r->data, n)) == NULL)
+			return -1;
+		r->data = p;
+		r->sz = n;
+	}
+
+	memcpy(r->data, msg, n);
+	if (len != 0) {
+		cache_ref(entry);
+		r->entry = entry;
+	}
+	r->ext = data;
+	r->extlen = len;
+	r->len = n;
+	r->time = s->last;
+
+	return 0;
+}
+
+
+/* Session of the UDP peer link */
+#define session_peer(l) ((session_t *)((u8 *)(l) - offsetof(session_t, link)))
+
+
+/* Transport of UDP peer sessions, replies are kept for retransmitted requests */
+static int session_peersend(msg_link_t *l, msg_t *msg, u16 seq)
+{
+	session_keepreply(session_peer(l), msg, NULL, 0, NULL);
+
+	return msg_udp_ops.send(l, msg, seq);
+}
+
+
+static int session_peersendv(msg_link_t *l, msg_t *msg, u16 seq, const u8 *data, size_t len, void *ref)
+{
+	session_keepreply(session_peer(l), msg, data, len, ref);
+
+	return msg_udp_ops.sendv(l, msg, seq, data, len, ref);
+}
+
+
+static int session_peerflush(msg_link_t *l)
+{
+	return msg_udp_ops.flush(l);
+}
+
+
+static const msg_ops_t session_peerops = { session_peersend, session_peersendv, NULL, session_peerflush };
+
+
+static unsigned long long dispatch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+int session_send(session_t *s, msg_t *msg, u16 seq)
+{
+	int res;
+
+	res = s->link.ops->send(&s->link, msg, seq);
+
+	if (res > 0) {
+		s->metrics.frames_out++;
+		s->metrics.bytes_out += res;
+	}
+
+	return res;
+}
+
+
+int session_sendv(session_t *s, msg_t *msg, u16 seq, const u8 *data, size_t len, cache_entry_t *entry)
+{
+	int res;
+
+	res = s->link.ops->sendv(&s->link, msg, seq, data, len, entry);
+
+	if (res > 0) {
+		s->metrics.frames_out++;
+		s->metrics.bytes_out += res;
+	}
+
+	return res;
+}
+
+
+int session_zerocopy(session_t *s)
+{
+	return s->link.ops->sendv != NULL;
+}
+
+
+int session_setmaxlen(session_t *s, u32 maxlen)
+{
+	msg_t *msg;
+
+	/* UDP peers receive into datagram buffers of the server, other transports are limited to MSG_MAXLEN */
+	if ((maxlen > MSG_MAXLEN) && (s->mode == TCP) && (s->msg == &s->msgbuf)) {
+		if ((msg = malloc(MSG_LARGESZ)) == NULL)
+			return ERR_MEM;
+
+		if (msg_linkresize(&s->link, MSG_TCPRXBUFSZ, MSG_TCPTXBUFSZ) < 0) {
+			free(msg);
+			return ERR_MEM;
+		}
+		s->msg = msg;
+	}
+
+	s->link.rx.maxlen = maxlen;
+	return 0;
+}
+
+
+int session_setbaudrate(session_t *s, int baudrate)
+{
+	int res;
+
+	if (s->mode != SERIAL)
+		return ERR_ARG;
+
+	/* Reply negotiating the rate is sent at the current one, rate is changed once it's written */
+	if ((res = s->link.ops->flush(&s->link)) < 0)
+		return res;
+
+	if (msg_linkpending(&s->link)) {
+		s->setbaud = baudrate;
+		s->baudcheck = 0;
+		return 0;
+	}
+	s->setbaud = 0;
+
+	if (tcdrain(s->link.fd_out) < 0)
+		return ERR_SERIAL_IO;
+
+	if ((res = serial_setbaudrate(s->link.fd, baudrate)) < 0)
+		return res;
+
+	log_info(LOG_DISPATCH, "Baudrate of %s set to %d", s->name, baudrate);
+	s->baudrate = baudrate;
+	s->baudcheck = (baudrate != s->serial.baudrate) ? dispatch_now() + DISPATCH_BAUDCHECK : 0;
+
+	return 0;
+}
+
+
+static void dispatch_sigusr1(int sig)
+{
+	dumpfl = 1;
+}
+
+
+static int dispatch_init(void)
+{
+	struct sigaction sa;
+
+	if (initialized)
+		return 0;
+
+	if (poller_init() < 0) {
+		log_error(LOG_DISPATCH, "Can't initialize poller");
+		return ERR_DISPATCH_IO;
+	}
+
+	/* Remote end closing connection can't terminate other sessions */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Metrics are dumped on SIGUSR1 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dispatch_sigusr1;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	initialized = 1;
+	return 0;
+}
+
+
+int dispatch_metrics(const char *path)
+{
+	if (dispatch_init() < 0)
+		return ERR_DISPATCH_IO;
+
+	if ((metricsfd = metrics_listen(path)) < 0) {
+		log_error(LOG_DISPATCH, "Can't listen for metrics requests on '%s'", path);
+		return metricsfd;
+	}
+
+	if (poller_add(metricsfd, POLLER_IN, &metricsctx) < 0) {
+		close(metricsfd);
+		metricsfd = -1;
+		return ERR_DISPATCH_IO;
+	}
+
+	log_info(LOG_DISPATCH, "Serving metrics on '%s'", path);
+	return 0;
+}
+
+
+/* Function watches output of the session for writability while frames are pending, so they are written then */
+static int session_watchout(session_t *s)
+{
+	int outfl = msg_linkpending(&s->link), err;
+
+	if (outfl == s->outfl)
+		return 0;
+
+	if (s->link.fd_out == s->link.fd)
+		err = poller_mod(s->link.fd, outfl ? (POLLER_IN | POLLER_OUT) : POLLER_IN, &s->ctx);
+	else
+		err = outfl ? poller_add(s->link.fd_out, POLLER_OUT, &s->ctx) : poller_del(s->link.fd_out);
+
+	if (err < 0)
+		return ERR_DISPATCH_IO;
+	s->outfl = outfl;
+
+	if (!outfl && (s->setbaud != 0) && (session_setbaudrate(s, s->setbaud) < 0))
+		log_error(LOG_DISPATCH, "Can't set baudrate %d on %s", s->setbaud, s->name);
+
+	return 0;
+}
+
+
+/* Session descriptors never block the dispatcher, frames not written at once are written by session_watchout() */
+static void session_nonblock(session_t *s)
+{
+	fcntl(s->link.fd, F_SETFL, fcntl(s->link.fd, F_GETFL) | O_NONBLOCK);
+	if (s->link.fd_out != s->link.fd)
+		fcntl(s->link.fd_out, F_SETFL, fcntl(s->link.fd_out, F_GETFL) | O_NONBLOCK);
+}
+
+
+int dispatch_add(char *dev_addr, dmode_t mode, void *data)
+{
+	session_t *s;
+	int err;
+
+	if (dispatch_init() < 0)
+		return ERR_DISPATCH_IO;
+
+	if ((s = session_alloc(mode)) == NULL)
+		return ERR_MEM;
+
+	s->dev_addr = dev_addr;
+	if ((mode == UDP) || (mode == TCP) || (mode == TCP_LISTEN))
+		snprintf(s->name, sizeof(s->name), "%s:%u", dev_addr, *(uint *)data);
+	else
+		snprintf(s->name, sizeof(s->name), "%s", dev_addr);
+	s->next = sessions;
+	sessions = s;
+
+	/* Listening session only accepts connections, UDP server session queues datagrams of its peers */
+	if (mode == TCP)
+		err = msg_linkinit(&s->link, &msg_tcp_ops, MSG_RXBUFSZ, MSG_TXBUFSZ);
+	else if (mode == UDP)
+		err = msg_linkinit(&s->link, &msg_udp_ops, 0, 0);
+	else if (mode == TCP_LISTEN)
+		err = msg_linkinit(&s->link, NULL, 0, 0);
+	else
+		err = msg_linkinit(&s->link, &msg_serial_ops, MSG_RXBUFSZ, MSG_TXBUFSZ);
+
+	if (err < 0) {
+		session_close(s);
+		return ERR_MEM;
+	}
+
+	if (mode == SERIAL) {
+		s->serial = *(dispatch_serial_t *)data;
+		s->baudrate = s->serial.baudrate;
+		log_info(LOG_DISPATCH, "Starting message dispatcher on [%s] (speed=%d, max=%d)", dev_addr, s->baudrate, s->serial.maxbaud);
+		if ((s->link.fd = serial_open(dev_addr, s->baudrate)) < 0) {
+			log_error(LOG_DISPATCH, "Can't open serial port '%s' at %d [%d]", dev_addr, s->baudrate, s->link.fd);
+			session_close(s);
 			return ERR_DISPATCH_IO;
 		}
-		msg_send = msg_serial_send;
-		msg_recv = msg_serial_recv;
 	}
 	else if (mode == UDP) {
-		if ((fd = udp_open(dev_addr, *(uint *)data)) < 0) {
-			fprintf(stderr, "[%d] dispatch: Can't open connection at '%s:%u'\n", getpid(), dev_addr, *(uint *)data);
+		if ((s->link.fd = udp_open(dev_addr, *(uint *)data)) < 0) {
+			log_error(LOG_DISPATCH, "Can't open connection at '%s:%u'", dev_addr, *(uint *)data);
+			session_close(s);
 			return ERR_DISPATCH_IO;
 		}
-		msg_send = msg_udp_send;
-		msg_recv = msg_udp_recv;
+		/* Server session only receives datagrams, length is checked against limit negotiated by the peer */
+		s->link.rx.maxlen = MSG_LARGELEN;
+		if (((s->link.batch = malloc(sizeof(*s->link.batch))) == NULL) || (msg_udp_batchinit(s->link.batch) < 0)) {
+			log_error(LOG_DISPATCH, "Can't allocate datagram buffers");
+			session_close(s);
+			return ERR_MEM;
+		}
+		if ((s->announce = malloc(sizeof(*s->announce))) == NULL) {
+			session_close(s);
+			return ERR_MEM;
+		}
+		/* Targets configured with the server address don't need discovery */
+		if (msg_udp_announceinit(s->announce, s->link.fd) < 0)
+			log_warn(LOG_DISPATCH, "Server on %s can't be discovered by probes", s->name);
 	}
 	else if (mode == TCP) {
-		fd = tcp_open(dev_addr, *(uint *)data);
-		if (fd < 0) {
-			fprintf(stderr, "[%d] dispatch: Can't open connection at '%s:%u'\n",
-				getpid(), dev_addr, *(uint *)data);
+		s->link.fd = tcp_open(dev_addr, *(uint *)data);
+		if (s->link.fd < 0) {
+			log_error(LOG_DISPATCH, "Can't open connection at '%s:%u'", dev_addr, *(uint *)data);
+			session_close(s);
+			return ERR_DISPATCH_IO;
+		}
+		s->port = *(uint *)data;
+		s->backoff = DISPATCH_BACKOFFMIN;
+	}
+	else if (mode == TCP_LISTEN) {
+		if ((s->link.fd = tcp_listen(dev_addr, *(uint *)data)) < 0) {
+			log_error(LOG_DISPATCH, "Can't listen at '%s:%u'", dev_addr, *(uint *)data);
+			session_close(s);
 			return ERR_DISPATCH_IO;
 		}
-		msg_send = msg_tcp_send;
-		msg_recv = msg_tcp_recv;
+		log_info(LOG_DISPATCH, "Listening for targets on %s", s->name);
 	}
 	else if (mode == PIPE) {
-		dev_in = concat(dev_addr, ".out"); // because output from quemu is our input
-		dev_out = concat(dev_addr, ".in"); // same logic
+		if (strncmp(dev_addr, "unix:", 5) == 0) {
+			s->chardev = 1;
+			s->dev_in = strdup(dev_addr + 5);
+		}
+		else {
+			s->dev_in = concat(dev_addr, ".out"); // because output from quemu is our input
+			s->dev_out = concat(dev_addr, ".in"); // same logic
+		}
+		s->backoff = DISPATCH_BACKOFFMIN;
 
-		if (connect_pipes(dev_in, dev_out, &fd, &fd_out)) {
-			free(dev_in);
-			free(dev_out);
-			return ERR_DISPATCH_IO;
+		if ((s->dev_in == NULL) || (session_watch(s) < 0))
+			log_warn(LOG_DISPATCH, "Can't watch for (re)created '%s', reconnecting by polling", dev_addr);
+
+		if ((s->watchfd >= 0) && (poller_add(s->watchfd, POLLER_IN, &s->ctx) < 0)) {
+			close(s->watchfd);
+			s->watchfd = -1;
+		}
+
+		if ((s->dev_in == NULL) || (session_pipeopen(s) < 0)) {
+			if (s->watchfd < 0) {
+				log_error(LOG_DISPATCH, "Can't open '%s'", dev_addr);
+				session_close(s);
+				return ERR_DISPATCH_IO;
+			}
+
+			/* Emulator may be started after the server */
+			log_info(LOG_DISPATCH, "Waiting for %s", dev_addr);
+			return 0;
+		}
+	}
+	else {
+		session_close(s);
+		return ERR_ARG;
+	}
+
+	if (s->link.fd_out < 0)
+		s->link.fd_out = s->link.fd;
+
+	session_nonblock(s);
+
+	if (poller_add(s->link.fd, POLLER_IN, &s->ctx) < 0) {
+		log_error(LOG_DISPATCH, "Can't watch '%s'", dev_addr);
+		session_close(s);
+		return ERR_DISPATCH_IO;
+	}
+
+	if ((s->announce != NULL) && (s->announce->fd >= 0) && (poller_add(s->announce->fd, POLLER_IN, &s->probectx) < 0)) {
+		log_error(LOG_DISPATCH, "Can't watch probes of '%s'", dev_addr);
+		session_close(s);
+		return ERR_DISPATCH_IO;
+	}
+
+	return 0;
+}
+
+
+/* Function handles message of len bytes received by the session */
+static void dispatch_msg(session_t *s, msg_t *msg, int len, char *sysdir)
+{
+	struct timespec ts;
+	unsigned int type;
+	u16 seq;
+
+	log_trace(LOG_DISPATCH, "Message received");
+	s->baudcheck = 0; /* the current rate works */
+	s->metrics.frames_in++;
+	s->metrics.bytes_in += len;
+
+	seq = msg_getseq(msg);
+	type = msg_gettype(msg);
+
+	metrics_start(&ts);
+	len = phfs_handlemsg(s, msg, sysdir);
+	metrics_request(&s->metrics, type, &ts);
+	if (len)
+		return;
+
+	switch (msg_gettype(msg)) {
+	case MSG_ERR:
+		msg_settype(msg, MSG_ERR);
+		msg_setlen(msg, MSG_MAXLEN);
+		session_send(s, msg, seq);
+		s->metrics.err_replies++;
+		break;
+	}
+}
+
+
+/* Function returns session of the UDP peer, session is created for a new peer */
+static session_t *dispatch_peer(session_t *srv, const struct sockaddr_in *peer)
+{
+	char addr[INET_ADDRSTRLEN];
+	time_t now = time(NULL);
+	session_t *s;
+
+	for (s = sessions; s != NULL; s = s->next) {
+		if ((s->server == srv) && (s->link.peer.sin_addr.s_addr == peer->sin_addr.s_addr) && (s->link.peer.sin_port == peer->sin_port)) {
+			s->last = now;
+			return s;
+		}
+	}
+
+	if ((s = session_alloc(UDP)) == NULL)
+		return NULL;
+
+	if (msg_linkinit(&s->link, &session_peerops, 0, 0) < 0) {
+		free(s);
+		return NULL;
+	}
+
+	s->dev_addr = srv->dev_addr;
+	s->link.fd = srv->link.fd;
+	s->link.fd_out = srv->link.fd_out;
+	s->link.batch = srv->link.batch;
+	s->link.peer = *peer;
+	s->server = srv;
+	s->last = now;
+	inet_ntop(AF_INET, &peer->sin_addr, addr, sizeof(addr));
+	snprintf(s->name, sizeof(s->name), "%s:%u", addr, ntohs(peer->sin_port));
+	s->next = sessions;
+	sessions = s;
+
+	log_info(LOG_DISPATCH, "New session %s on %s", s->name, srv->name);
+	return s;
+}
+
+
+typedef struct {
+	session_t *s;
+	session_reply_t *r;
+	u16 seq;
+} dispatch_resendarg_t;
+
+
+static int dispatch_resendmapped(void *arg)
+{
+	dispatch_resendarg_t *a = arg;
+
+	return msg_udp_ops.sendv(&a->s->link, (msg_t *)a->r->data, a->seq, a->r->ext, a->r->extlen, a->r->entry);
+}
+
+
+/* Function sends the kept reply again, its mapped data may be gone if the file has been truncated on the host */
+static int dispatch_resend(session_t *s, session_reply_t *r, u16 seq)
+{
+	dispatch_resendarg_t a = { s, r, seq };
+
+	/* Kept reply isn't kept again */
+	if (r->entry == NULL)
+		return msg_udp_ops.send(&s->link, (msg_t *)r->data, seq);
+
+	return cache_guard(r->entry, dispatch_resendmapped, &a);
+}
+
+
+/*
+ * Function answers request retransmitted by UDP peer (e.g. after lost reply) with the kept reply, so it isn't
+ * handled again. Otherwise reply slot is prepared for the request, returns nonzero if request has been answered.
+ * Replies expire soon, so the same requests of rebooted target are handled again.
+ */
+static int dispatch_replied(session_t *s, msg_t *msg)
+{
+	size_t n = MSG_HDRSZ + msg_getlen(msg);
+	session_reply_t *r;
+	unsigned int i;
+	int res;
+	u8 *p;
+
+	for (i = 0; i < DISPATCH_REPLIES; i++) {
+		r = &s->replies[i];
+		if ((r->len == 0) || (r->seq != msg_getseq(msg)) || (s->last - r->time > DISPATCH_REPLYTTL))
+			continue;
+
+		/* New request may reuse sequence number of the kept one */
+		if ((r->reqlen != n) || (memcmp(r->req, msg, n) != 0))
+			continue;
+
+		s->metrics.dup_requests++;
+		if ((res = dispatch_resend(s, r, msg_getseq(msg))) > 0) {
+			s->metrics.frames_out++;
+			s->metrics.bytes_out += res;
+		}
+		else if ((res < 0) && (errno == EFAULT)) {
+			/* Request is handled again with the current file content */
+			session_dropreply(r);
+			break;
+		}
+		return 1;
+	}
+
+	/* Streams are retransmitted on acknowledgments */
+	if ((msg_gettype(msg) == MSG_STREAM) || (msg_gettype(msg) == MSG_SACK))
+		return 0;
+
+	r = &s->replies[s->nextreply];
+	session_dropreply(r);
+
+	/* Reply isn't kept if request can't be copied */
+	if (r->reqsz < n) {
+		if ((p = realloc(r->req, n)) == NULL)
+			return 0;
+		r->req = p;
+		r->reqsz = n;
+	}
+
+	memcpy(r->req, msg, n);
+	r->reqlen = n;
+	r->seq = msg_getseq(msg);
+
+	s->reply = r;
+	s->nextreply = (s->nextreply + 1) % DISPATCH_REPLIES;
+
+	return 0;
+}
+
+
+/* Function demultiplexes datagrams received by the UDP server session into peer sessions */
+static int dispatch_udp(session_t *srv, char *sysdir)
+{
+	struct sockaddr_in peer;
+	session_t *s;
+	msg_t *msg;
+	int err;
+
+	/* Replies are queued and sent in batches before receiving the next batch of requests */
+	while ((err = msg_udp_recv(&srv->link, &msg, &peer)) > 0) {
+		/* Own announcements (e.g. of server bound to any address) and replies to them would be answered forever */
+		if ((srv->announce != NULL) && msg_udp_own(srv->announce, &peer))
+			continue;
+
+		if ((s = dispatch_peer(srv, &peer)) == NULL) {
+			srv->link.rx.errors++;
+			continue;
+		}
+
+		/* Message longer than negotiated by the peer */
+		if (msg_getlen(msg) > s->link.rx.maxlen) {
+			s->link.rx.errors++;
+			continue;
+		}
+
+		if (dispatch_replied(s, msg)) {
+			s->metrics.frames_in++;
+			s->metrics.bytes_in += err;
+			continue;
+		}
+
+		dispatch_msg(s, msg, err, sysdir);
+		s->reply = NULL;
+	}
+
+	return err;
+}
+
+
+/* Function adds sessions of connections accepted from targets */
+static int dispatch_accept(session_t *srv)
+{
+	struct sockaddr_in peer;
+	char addr[INET_ADDRSTRLEN];
+	session_t *s;
+	int fd;
+
+	for (;;) {
+		if ((fd = tcp_accept(srv->link.fd, &peer, 1)) < 0) {
+			/* Listener is kept if connection can't be accepted (e.g. descriptors are exhausted) */
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) && (errno != ECONNABORTED))
+				log_error(LOG_DISPATCH, "Can't accept connection on %s", srv->name);
+			return 0;
+		}
+
+		if ((s = session_alloc(TCP)) == NULL) {
+			close(fd);
+			continue;
+		}
+
+		if (msg_linkinit(&s->link, &msg_tcp_ops, MSG_RXBUFSZ, MSG_TXBUFSZ) < 0) {
+			free(s);
+			close(fd);
+			continue;
+		}
+
+		s->dev_addr = srv->dev_addr;
+		s->link.fd = fd;
+		s->link.fd_out = fd;
+		inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr));
+		snprintf(s->name, sizeof(s->name), "%s:%u", addr, ntohs(peer.sin_port));
+		s->next = sessions;
+		sessions = s;
+
+		if (poller_add(fd, POLLER_IN, &s->ctx) < 0) {
+			session_close(s);
+			continue;
 		}
-		msg_send = msg_serial_send;
-		msg_recv = msg_serial_recv;
+
+		log_info(LOG_DISPATCH, "New session %s on %s", s->name, srv->name);
 	}
+}
+
 
-	for (state = MSGRECV_DESYN;;) {
-		err = msg_recv(fd, &msg, &state);
-		if (err < 0) {
-			if (err == ERR_MSG_CLOSED) {
-				fprintf(stderr, "[%d] dispatch: Connection closed by the remote end (%s:%u)\n",
-					getpid(), dev_addr, *(uint *)data);
+/* Function closes dropped TCP tunnel or QEMU connection, files opened by the target are closed as it's likely restarted */
+static void dispatch_drop(session_t *s)
+{
+	if (s->link.fd >= 0) {
+		poller_del(s->link.fd);
+		close(s->link.fd);
+	}
+	if ((s->link.fd_out >= 0) && (s->link.fd_out != s->link.fd)) {
+		if (s->outfl)
+			poller_del(s->link.fd_out);
+		close(s->link.fd_out);
+	}
+	s->link.fd = -1;
+	s->link.fd_out = -1;
+	s->outfl = 0;
+
+	phfs_release(s);
+	s->lz = 0;
+	s->link.rx.state = MSGRECV_DESYN;
+	s->link.rx.rd = 0;
+	s->link.rx.wr = 0;
+	s->link.rx.maxlen = MSG_MAXLEN;
+	msg_txdrop(&s->link.tx);
+
+	/* Target negotiates large messages again after reconnection */
+	if (s->msg != &s->msgbuf) {
+		free(s->msg);
+		s->msg = &s->msgbuf;
+		msg_linkresize(&s->link, MSG_RXBUFSZ, MSG_TXBUFSZ);
+	}
+}
+
+
+/* Function schedules the next reconnection with exponential backoff */
+static void dispatch_retry(session_t *s, unsigned long long now)
+{
+	if (s->link.fd >= 0) {
+		poller_del(s->link.fd);
+		close(s->link.fd);
+	}
+	if ((s->link.fd_out >= 0) && (s->link.fd_out != s->link.fd))
+		close(s->link.fd_out);
+	s->link.fd = -1;
+	s->link.fd_out = -1;
+	s->connecting = 0;
+
+	log_info(LOG_DISPATCH, "Reconnecting to %s in %u ms", s->name, s->backoff);
+	s->reconnect = now + s->backoff;
+	s->backoff = (2 * s->backoff < DISPATCH_BACKOFFMAX) ? 2 * s->backoff : DISPATCH_BACKOFFMAX;
+}
+
+
+static void dispatch_reconnect(session_t *s, unsigned long long now)
+{
+	s->reconnect = 0;
+
+	if (s->mode == PIPE) {
+		if (session_pipeopen(s) == 0) {
+			if (poller_add(s->link.fd, POLLER_IN, &s->ctx) == 0) {
+				log_info(LOG_DISPATCH, "Connected to %s", s->dev_addr);
+				s->backoff = DISPATCH_BACKOFFMIN;
+				return;
 			}
-			else {
-				fprintf(stderr, "[%d] dispatch: Message receiving error on %s, state=%d!\n",
-					getpid(), dev_addr, state);
+		}
+		dispatch_retry(s, now);
+		return;
+	}
+
+	if ((s->link.fd = tcp_reconnect(s->dev_addr, s->port)) >= 0) {
+		s->link.fd_out = s->link.fd;
+		if (poller_add(s->link.fd, POLLER_OUT, &s->ctx) == 0) {
+			s->connecting = 1;
+			return;
+		}
+	}
+
+	dispatch_retry(s, now);
+}
+
+
+static void dispatch_connected(session_t *s)
+{
+	if ((tcp_connected(s->link.fd) < 0) || (poller_mod(s->link.fd, POLLER_IN, &s->ctx) < 0)) {
+		dispatch_retry(s, dispatch_now());
+		return;
+	}
+
+	log_info(LOG_DISPATCH, "Reconnected to %s", s->name);
+	s->connecting = 0;
+	s->backoff = DISPATCH_BACKOFFMIN;
+}
+
+
+#ifdef __linux__
+
+/* Function returns nonzero if file of the PIPE session has been (re)created */
+static int dispatch_watched(session_t *s, const char *name)
+{
+	const char *p;
+
+	if (((p = strrchr(s->dev_in, '/')) != NULL) ? (strcmp(p + 1, name) == 0) : (strcmp(s->dev_in, name) == 0))
+		return 1;
+
+	return (s->dev_out != NULL) && (((p = strrchr(s->dev_out, '/')) != NULL) ? (strcmp(p + 1, name) == 0) : (strcmp(s->dev_out, name) == 0));
+}
+
+
+/* Function opens pipes or socket (re)created by QEMU without waiting for the reconnection timer */
+static void dispatch_watch(session_t *s)
+{
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct stat st;
+	ssize_t len;
+	char *p;
+	int found = 0;
+
+	while ((len = read(s->watchfd, buff, sizeof(buff))) > 0) {
+		for (p = buff; p < buff + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if ((ev->len != 0) && dispatch_watched(s, ev->name))
+				found = 1;
+		}
+	}
+
+	if (!found)
+		return;
+
+	/* Replaced pipes aren't noticed otherwise, ends opened read-write never hang up */
+	if ((s->link.fd >= 0) && !s->chardev && (stat(s->dev_in, &st) == 0) && (st.st_ino != s->ino)) {
+		log_info(LOG_DISPATCH, "Pipes of %s have been replaced", s->dev_addr);
+		dispatch_drop(s);
+	}
+
+	if (s->link.fd < 0) {
+		s->backoff = DISPATCH_BACKOFFMIN;
+		dispatch_reconnect(s, dispatch_now());
+	}
+}
+
+#endif
+
+
+/* Function dispatches all messages available in the session, returns error if session should be closed */
+static int dispatch_session(session_t *s, char *sysdir)
+{
+	int err;
+
+	if (s->mode == TCP_LISTEN) {
+		return dispatch_accept(s);
+	}
+	else if (s->connecting) {
+		dispatch_connected(s);
+		return 0;
+	}
+
+#ifdef __linux__
+	if ((s->mode == PIPE) && (s->watchfd >= 0))
+		dispatch_watch(s);
+#endif
+
+	/* PIPE session waiting for QEMU */
+	if (s->link.fd < 0)
+		return 0;
+
+	if (s->mode == UDP) {
+		err = dispatch_udp(s, sysdir);
+	}
+	else {
+		/* Buffer of large messages is switched to by MSG_HELLO between received messages */
+		while ((err = s->link.ops->recv(&s->link, s->msg)) > 0)
+			dispatch_msg(s, s->msg, err, sysdir);
+
+		/* Replies to all requests received so far are written together, target not reading them is dropped */
+		if (((s->link.ops->flush(&s->link) < 0) || (session_watchout(s) < 0)) && (err == 0))
+			err = ERR_MSG_IO;
+	}
+
+	if (err == 0)
+		return 0;
+
+	if (err == ERR_MSG_CLOSED) {
+		log_info(LOG_DISPATCH, "Connection closed by the remote end (%s)", s->name);
+	}
+	else {
+		log_error(LOG_DISPATCH, "Message receiving error on %s, state=%d!", s->name, s->link.rx.state);
+	}
+
+	/* Restarted QEMU is connected again at once, dropped tunnel after backoff */
+	if (s->mode == PIPE) {
+		dispatch_drop(s);
+		dispatch_reconnect(s, dispatch_now());
+		return 0;
+	}
+
+	if ((s->mode == TCP) && (s->backoff != 0)) {
+		dispatch_drop(s);
+		dispatch_retry(s, dispatch_now());
+		return 0;
+	}
+
+	return err;
+}
+
+
+/*
+ * Function sends due announcements of UDP server sessions, reconnects dropped TCP tunnels, restores
+ * rate of serial lines not confirmed by the target, closes idle UDP peer sessions and serves metrics clients,
+ * returns time to the next timer (ms) or -1 if there is none
+ */
+static int dispatch_timers(void)
+{
+	unsigned long long now = dispatch_now();
+	time_t sec = time(NULL);
+	session_t *s, *next;
+	unsigned int t;
+	int timeout;
+
+	timeout = metrics_timers(sessions, now);
+
+	for (s = sessions; s != NULL; s = next) {
+		next = s->next;
+
+		if (s->server != NULL) {
+			/* Peers gone (e.g. rebooted and using another port) keep their files opened until now */
+			if (sec - s->last >= DISPATCH_PEERIDLE) {
+				log_info(LOG_DISPATCH, "Closing idle session %s", s->name);
+				session_close(s);
+				continue;
 			}
-			// if this is pipe - try to reconnect - it's because qemu closes pipe
-			if (mode == PIPE && --retries) {
-				usleep(100000);
-				(void) connect_pipes(dev_in, dev_out, &fd, &fd_out);
+			t = (s->last + DISPATCH_PEERIDLE - sec) * 1000;
+		}
+		else if (s->announce != NULL) {
+			t = msg_udp_announce(s->announce, s->link.fd, now);
+		}
+		else if (s->reconnect != 0) {
+			if (s->reconnect <= now)
+				dispatch_reconnect(s, now);
+			if (s->reconnect == 0)
+				continue;
+			t = s->reconnect - now;
+		}
+		else if (s->baudcheck != 0) {
+			if (s->baudcheck <= now) {
+				log_warn(LOG_DISPATCH, "No response from %s at %d, restoring %d", s->name, s->baudrate, s->serial.baudrate);
+				if (session_setbaudrate(s, s->serial.baudrate) < 0) {
+					log_error(LOG_DISPATCH, "Can't restore baudrate of %s", s->name);
+					s->baudcheck = 0;
+				}
+				continue;
 			}
-			break;
+			t = s->baudcheck - now;
 		}
-		fprintf(stderr, "[%d] dispatch: Message received\n", getpid());
-
-		u16 seq = msg_getseq(&msg);
-		if ((err = phfs_handlemsg((mode == PIPE ? fd_out : fd), &msg, sysdir)))
+		else {
 			continue;
+		}
+
+		if ((timeout < 0) || (t < timeout))
+			timeout = t;
+	}
+
+	return timeout;
+}
+
+
+int dispatch_open(char *dev_addr, dmode_t mode, void *data, int *fd, int *fd_out)
+{
+	struct sockaddr_in peer;
+	struct pollfd pfd;
+	char *dev_in, *dev_out;
+	int lfd;
+
+	*fd = -1;
+	*fd_out = -1;
 
-		switch (msg_gettype(&msg)) {
-		case MSG_ERR:
-			msg_settype(&msg, MSG_ERR);
-			msg_setlen(&msg, MSG_MAXLEN);
-			msg_send((mode == PIPE ? fd_out : fd), &msg, seq);
+	switch (mode) {
+		case SERIAL:
+			*fd = serial_open(dev_addr, ((dispatch_serial_t *)data)->baudrate);
+			break;
+
+		case PIPE:
+			if (strncmp(dev_addr, "unix:", 5) == 0) {
+				connect_socket(dev_addr + 5, fd);
+				break;
+			}
+
+			dev_in = concat(dev_addr, ".out");
+			dev_out = concat(dev_addr, ".in");
+			if ((dev_in != NULL) && (dev_out != NULL))
+				connect_pipes(dev_in, dev_out, fd, fd_out);
+			free(dev_in);
+			free(dev_out);
 			break;
-		}
 
+		case UDP:
+			*fd = udp_open(dev_addr, *(uint *)data);
+			break;
+
+		case TCP:
+			*fd = tcp_open(dev_addr, *(uint *)data);
+			break;
+
+		case TCP_LISTEN:
+			if ((lfd = tcp_listen(dev_addr, *(uint *)data)) < 0)
+				break;
+
+			log_info(LOG_DISPATCH, "Waiting for target on %s:%u", dev_addr, *(uint *)data);
+			pfd.fd = lfd;
+			pfd.events = POLLIN;
+			while ((*fd = tcp_accept(lfd, &peer, 0)) < 0) {
+				if ((errno != EAGAIN) && (errno != EINTR))
+					break;
+				poll(&pfd, 1, -1);
+			}
+			close(lfd);
+			break;
+
+		default:
+			return ERR_ARG;
+	}
+
+	if (*fd < 0)
+		return ERR_DISPATCH_IO;
+
+	if (*fd_out < 0)
+		*fd_out = *fd;
+
+	return 0;
+}
+
+
+/* Function closes session, remaining n events of the batch pointing to its contexts are dropped */
+static void dispatch_close(session_t *s, poller_event_t *ev, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((ev[i].data == &s->ctx) || (ev[i].data == &s->probectx))
+			ev[i].data = NULL;
 	}
 
-	if (mode == PIPE) {
-		free(dev_in);
-		free(dev_out);
+	session_close(s);
+}
+
+
+/* Function reads and dispatches messages */
+int dispatch(char *sysdir)
+{
+	poller_event_t ev[32];
+	dispatch_ctx_t *ctx;
+	session_t *s;
+	int i, n;
+
+	while (sessions != NULL) {
+		if ((n = poller_wait(ev, sizeof(ev) / sizeof(ev[0]), dispatch_timers())) < 0) {
+			log_error(LOG_DISPATCH, "Waiting for events failed");
+			return n;
+		}
+
+		if (dumpfl) {
+			dumpfl = 0;
+			metrics_dump(sessions);
+		}
+
+		for (i = 0; i < n; i++) {
+			/* Event of the session closed by previous event */
+			if ((ctx = ev[i].data) == NULL)
+				continue;
+
+			switch (ctx->type) {
+				case CTX_METRICS:
+					metrics_accept(metricsfd, dispatch_now());
+					break;
+
+				case CTX_SCRAPER:
+					metrics_client(ctx->ptr, sessions, dispatch_now());
+					break;
+
+				case CTX_SESSION:
+					if (dispatch_session(ctx->ptr, sysdir) < 0)
+						dispatch_close(ctx->ptr, ev + i + 1, n - i - 1);
+					break;
+
+				case CTX_PROBES:
+					/* Probes of targets looking for the server are answered at once */
+					s = ctx->ptr;
+					msg_udp_probe(s->announce, s->link.fd);
+					break;
+			}
+		}
 	}
 
 	return 0;
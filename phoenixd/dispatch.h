@@ -15,7 +15,14 @@
 
 #ifndef _DISPATCH_H_
 #define _DISPATCH_H_
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
 #include "msg.h"
+#include "msg_udp.h"
+#include "phfs.h"
+#include "cache.h"
+#include "metrics.h"
 
 
 typedef enum {
@@ -24,14 +31,149 @@ typedef enum {
 	UDP,
 	TCP,
 	USB_VYBRID,
-	USB_IMX
+	USB_IMX,
+	TCP_LISTEN
 } dmode_t;
 
 
-/* Function reads and dispatches messages */
-extern int dispatch(char *dev_addr, dmode_t mode, char *sysdir, void *data);
-extern int (*msg_send)(int fd, msg_t *msg, u16 seq);
-extern int (*msg_recv)(int fd, msg_t *msg, int *state);
+/* Kinds of descriptors watched by the dispatcher */
+typedef enum {
+	CTX_SESSION,
+	CTX_PROBES,
+	CTX_METRICS,
+	CTX_SCRAPER
+} ctxtype_t;
+
+
+/* Context of watched descriptor, events point to it */
+typedef struct {
+	ctxtype_t type;
+	void *ptr;
+} dispatch_ctx_t;
+
+
+/* UDP peer sessions not receiving datagrams for that long (seconds) are closed */
+#define DISPATCH_PEERIDLE 600
+
+/* Number of last replies kept by UDP peer session for retransmitted requests and their lifetime (seconds) */
+#define DISPATCH_REPLIES  4
+#define DISPATCH_REPLYTTL 5
+
+/* Delay of the first reconnection of dropped TCP tunnel, doubled up to the maximum (ms) */
+#define DISPATCH_BACKOFFMIN 100
+#define DISPATCH_BACKOFFMAX 10000
+
+/* Serial line returns to the initial rate if no frame is received that long after MSG_BAUD step-up (ms) */
+#define DISPATCH_BAUDCHECK 1000
+
+
+/* Serial line rates of SERIAL session */
+typedef struct {
+	int baudrate; /* initial rate */
+	int maxbaud;  /* highest rate allowed by MSG_BAUD step-up */
+} dispatch_serial_t;
+
+
+/* Reply sent by UDP peer session, retransmitted request is recognized by the same sequence number and bytes */
+typedef struct {
+	u16 seq;
+	u8 *req;  /* copy of the request */
+	size_t reqlen;
+	size_t reqsz;
+	u8 *data; /* reply datagram without the data sent from the content cache */
+	size_t len;
+	size_t sz;
+	cache_entry_t *entry; /* referenced entry mapping the rest of the reply */
+	const u8 *ext;
+	size_t extlen;
+	time_t time;
+} session_reply_t;
+
+
+/* BSP2 session, one per served device */
+typedef struct _session_t {
+	struct _session_t *next;
+
+	dmode_t mode;
+	dispatch_ctx_t ctx;
+	dispatch_ctx_t probectx; /* socket receiving probes of UDP server */
+	char name[64]; /* device or address:port */
+	char *dev_addr;
+	char *dev_in;
+	char *dev_out;
+	int chardev; /* PIPE session connected to QEMU chardev UNIX socket dev_in instead of pipes */
+	int watchfd; /* notifies about (re)created pipes or socket of PIPE session, -1 if none */
+	ino_t ino;   /* input pipe, it's reopened when replaced */
+
+	/* Transport to the target, descriptors are -1 while disconnected */
+	msg_link_t link;
+	int outfl; /* output is watched for writability while frames are pending */
+
+	/* Serial line rate, changed by MSG_BAUD step-up */
+	int baudrate;
+	dispatch_serial_t serial;
+	unsigned long long baudcheck; /* time the initial rate is restored unless a frame is received (ms), 0 if not checked */
+	int setbaud;                  /* rate set once pending frames are written, 0 if none */
+
+	/*
+	 * UDP socket is served by the server session demultiplexing datagrams by source address into
+	 * peer sessions, links of peer sessions share socket and datagram batch of the server
+	 */
+	struct _session_t *server;
+	msg_udpannounce_t *announce; /* discovery of the server session by targets */
+	time_t last;
+
+	/* TCP client and PIPE sessions reconnect dropped tunnel, connections accepted from targets have no backoff */
+	unsigned int port;
+	unsigned int backoff;
+	unsigned long long reconnect; /* time of the next attempt (ms), 0 if not waiting */
+	int connecting;
+
+	session_reply_t replies[DISPATCH_REPLIES];
+	unsigned int nextreply;
+	session_reply_t *reply; /* slot for reply to the handled request */
+
+	/* Files opened by the target, indexed by handle - 1 */
+	phfs_handle_t *handles;
+	unsigned int nhandles;
+
+	phfs_stream_t stream;
+	int lz; /* target accepts compressed MSG_READ and MSG_STREAM data */
+
+	/* Message received by the session, buffer of large messages is allocated once MSG_HELLO negotiates them */
+	msg_t *msg;
+	msg_t msgbuf;
+
+	metrics_t metrics;
+} session_t;
+
+
+/* Function adds device to the dispatcher, data points to dispatch_serial_t (SERIAL) or port number (UDP, TCP, TCP_LISTEN) */
+extern int dispatch_add(char *dev_addr, dmode_t mode, void *data);
+
+/* Function opens device for blocking legacy BSP session (single target), data as in dispatch_add() */
+extern int dispatch_open(char *dev_addr, dmode_t mode, void *data, int *fd, int *fd_out);
+
+/* Function serves metrics of all sessions on UNIX socket */
+extern int dispatch_metrics(const char *path);
+
+/* Function reads and dispatches messages of all added devices */
+extern int dispatch(char *sysdir);
+
+/* Function sends message to the target served by the session */
+extern int session_send(session_t *s, msg_t *msg, u16 seq);
+
+/* Function sends message with last len bytes of data mapped by the cache entry, if session_zerocopy() allows it */
+extern int session_sendv(session_t *s, msg_t *msg, u16 seq, const u8 *data, size_t len, cache_entry_t *entry);
+
+/* Function returns nonzero if transport of the session can send data without copying */
+extern int session_zerocopy(session_t *s);
+
+/* Function sets maximal length of messages exchanged by the session, allocates buffers of large messages */
+extern int session_setmaxlen(session_t *s, u32 maxlen);
+
+/* Function switches serial line of the session to baudrate once queued replies are transmitted */
+extern int session_setbaudrate(session_t *s, int baudrate);
 
 extern int boot_image(char *kernel, char *initrd, char *console, char *append, char *output, int plugin);
 
@@ -0,0 +1,112 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * ELF images loaded by BSP targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "elfload.h"
+
+
+typedef struct {
+	cache_entry_t *e;
+	elf_image_t *img;
+} elf_parsearg_t;
+
+
+/* Function parses mapping of the file, it's called by cache_guard() */
+static int elf_parse(void *arg)
+{
+	elf_parsearg_t *a = arg;
+	const Elf32_Ehdr *hdr;
+	const Elf32_Phdr *phdr;
+	elf_image_t *img;
+	unsigned int k;
+
+	if (a->e->len < sizeof(Elf32_Ehdr))
+		return -1;
+
+	hdr = (const Elf32_Ehdr *)a->e->data;
+	if ((memcmp(hdr->e_ident, "\177ELF", 4) != 0) || (hdr->e_ident[4] != 1))
+		return -1;
+
+	if ((hdr->e_phnum != 0) && ((hdr->e_phentsize != sizeof(Elf32_Phdr)) ||
+			((unsigned long long)hdr->e_phoff + (unsigned long long)hdr->e_phnum * sizeof(Elf32_Phdr) > a->e->len)))
+		return -1;
+
+	if ((img = malloc(sizeof(*img) + hdr->e_phnum * sizeof(Elf32_Phdr))) == NULL)
+		return -1;
+
+	img->entry = a->e;
+	img->hdr = *hdr;
+	img->nsegs = 0;
+
+	for (k = 0; k < hdr->e_phnum; k++) {
+		phdr = (const Elf32_Phdr *)(a->e->data + hdr->e_phoff) + k;
+		if ((phdr->p_type != PT_LOAD) || (phdr->p_vaddr == 0))
+			continue;
+
+		if ((unsigned long long)phdr->p_offset + phdr->p_filesz > a->e->len) {
+			free(img);
+			return -1;
+		}
+
+		img->segs[img->nsegs++] = *phdr;
+	}
+
+	a->img = img;
+	return 0;
+}
+
+
+elf_image_t *elf_get(const char *path)
+{
+	cache_entry_t *e;
+	elf_parsearg_t a;
+
+	if ((e = cache_get(path)) == NULL)
+		return NULL;
+
+	/* Image is parsed once per version of the file */
+	if (e->priv[CACHE_ELF] == NULL) {
+		a.e = e;
+		a.img = NULL;
+		if (cache_guard(e, elf_parse, &a) < 0) {
+			cache_put(e);
+			return NULL;
+		}
+		e->priv[CACHE_ELF] = a.img;
+		e->privfree[CACHE_ELF] = free;
+	}
+
+	return e->priv[CACHE_ELF];
+}
+
+
+void elf_put(elf_image_t *img)
+{
+	cache_put(img->entry);
+}
+
+
+ssize_t elf_read(elf_image_t *img, const Elf32_Phdr *seg, void *buff, size_t len, u32 offs)
+{
+	if (offs >= seg->p_filesz)
+		return 0;
+
+	if (len > seg->p_filesz - offs)
+		len = seg->p_filesz - offs;
+
+	return cache_read(img->entry, buff, len, (off_t)seg->p_offset + offs);
+}
@@ -0,0 +1,42 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * ELF images loaded by BSP targets
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _ELFLOAD_H_
+#define _ELFLOAD_H_
+
+#include "elf.h"
+#include "cache.h"
+
+
+/* Parsed image kept with the content cache entry of the file, replaced file is parsed again */
+typedef struct {
+	cache_entry_t *entry;
+	Elf32_Ehdr hdr;
+	unsigned int nsegs;
+	Elf32_Phdr segs[]; /* PT_LOAD segments with nonzero address, within the file */
+} elf_image_t;
+
+
+/* Function returns validated image of the ELF file, NULL if it can't be loaded */
+extern elf_image_t *elf_get(const char *path);
+
+
+extern void elf_put(elf_image_t *img);
+
+
+/* Function copies segment data at offs, returns number of copied bytes or -1 if file has been truncated */
+extern ssize_t elf_read(elf_image_t *img, const Elf32_Phdr *seg, void *buff, size_t len, u32 offs);
+
+
+#endif
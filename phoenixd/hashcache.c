@@ -0,0 +1,157 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Block hashes of files kept in the content cache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashcache.h"
+
+
+/* Hashes of the file split into blocks of one size, computed on demand */
+typedef struct _hashcache_table_t {
+	struct _hashcache_table_t *next;
+	size_t blksz;
+	size_t nblocks;
+	u8 *valid; /* bitmap of computed hashes, follows hashes */
+	u8 hash[][SHA256_LEN];
+} hashcache_table_t;
+
+
+/* Tables of the file, kept with its content cache entry */
+typedef struct {
+	hashcache_table_t *tables;
+	size_t size;
+} hashcache_t;
+
+
+static struct {
+	size_t size;
+} hashcache;
+
+
+typedef struct {
+	cache_entry_t *e;
+	hashcache_table_t *t; /* NULL - hashes are not kept */
+	size_t blksz;
+	size_t first;
+	size_t n;
+	u8 (*dst)[SHA256_LEN];
+} hashcache_hasharg_t;
+
+
+static void hashcache_free(void *priv)
+{
+	hashcache_t *c = priv;
+	hashcache_table_t *t, *next;
+
+	for (t = c->tables; t != NULL; t = next) {
+		next = t->next;
+		free(t);
+	}
+
+	hashcache.size -= c->size;
+	free(c);
+}
+
+
+/* Function hashes mapping of the file, it's called by cache_guard() */
+static int hashcache_hash(void *arg)
+{
+	hashcache_hasharg_t *a = arg;
+	size_t k, pos, l;
+
+	for (k = a->first; k < a->first + a->n; k++) {
+		if ((a->t != NULL) && (a->t->valid[k / 8] & (1u << (k % 8)))) {
+			memcpy(a->dst[k - a->first], a->t->hash[k], SHA256_LEN);
+			continue;
+		}
+
+		pos = k * a->blksz;
+		l = (a->e->len - pos < a->blksz) ? a->e->len - pos : a->blksz;
+		sha256(a->dst[k - a->first], a->e->data + pos, l);
+
+		if (a->t != NULL) {
+			memcpy(a->t->hash[k], a->dst[k - a->first], SHA256_LEN);
+			a->t->valid[k / 8] |= 1u << (k % 8);
+		}
+	}
+
+	return 0;
+}
+
+
+/* Function returns table of hashes of blksz blocks of the file, NULL if it can't be kept */
+static hashcache_table_t *hashcache_table(cache_entry_t *e, size_t blksz)
+{
+	hashcache_table_t *t;
+	hashcache_t *c;
+	size_t nblocks, sz;
+
+	if ((c = e->priv[CACHE_HASH]) == NULL) {
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			return NULL;
+		e->priv[CACHE_HASH] = c;
+		e->privfree[CACHE_HASH] = hashcache_free;
+	}
+
+	for (t = c->tables; t != NULL; t = t->next) {
+		if (t->blksz == blksz)
+			return t;
+	}
+
+	nblocks = (e->len + blksz - 1) / blksz;
+	sz = sizeof(*t) + nblocks * SHA256_LEN + (nblocks + 7) / 8;
+	if ((hashcache.size + sz > HASHCACHE_BUDGET) || ((t = malloc(sz)) == NULL))
+		return NULL;
+
+	t->blksz = blksz;
+	t->nblocks = nblocks;
+	t->valid = (u8 *)t->hash[nblocks];
+	memset(t->valid, 0, (nblocks + 7) / 8);
+
+	t->next = c->tables;
+	c->tables = t;
+	c->size += sz;
+	hashcache.size += sz;
+
+	return t;
+}
+
+
+int hashcache_get(cache_entry_t *e, size_t blksz, size_t first, size_t n, u8 (*dst)[SHA256_LEN])
+{
+	hashcache_hasharg_t a;
+	size_t nblocks;
+
+	if (blksz == 0)
+		return -1;
+
+	nblocks = (e->len + blksz - 1) / blksz;
+	if (first >= nblocks)
+		return 0;
+	if (n > nblocks - first)
+		n = nblocks - first;
+
+	a.e = e;
+	a.t = hashcache_table(e, blksz);
+	a.blksz = blksz;
+	a.first = first;
+	a.n = n;
+	a.dst = dst;
+
+	if (cache_guard(e, hashcache_hash, &a) < 0)
+		return -1;
+
+	return n;
+}
@@ -0,0 +1,35 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Block hashes of files kept in the content cache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HASHCACHE_H_
+#define _HASHCACHE_H_
+
+#include <sys/types.h>
+#include <hostutils-common/types.h>
+#include <hostutils-common/sha256.h>
+#include "cache.h"
+
+
+/* Hash bytes kept for all files, hashes exceeding it are computed on every request */
+#define HASHCACHE_BUDGET  (16 * 1024 * 1024)
+
+
+/*
+ * Function stores SHA-256 hashes of up to n blocks of blksz bytes starting with block first in dst, the last
+ * block of the file is shorter. Returns number of stored hashes or -1 if file has been truncated.
+ */
+extern int hashcache_get(cache_entry_t *e, size_t blksz, size_t first, size_t n, u8 (*dst)[SHA256_LEN]);
+
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Asynchronous leveled logging
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <hostutils-common/errors.h>
+#include "log.h"
+
+
+#define LOG_SLOTS   1024 /* power of 2 */
+#define LOG_LINESZ  240
+
+
+/* Slot is free for producer when seq == pos and ready for writer when seq == pos + 1 */
+typedef struct {
+	unsigned int seq;
+	unsigned int len;
+	char line[LOG_LINESZ];
+} log_slot_t;
+
+
+int log_level[LOG_NCAT] = { LOGLVL_DEFAULT, LOGLVL_DEFAULT, LOGLVL_DEFAULT, LOGLVL_DEFAULT };
+
+
+static const char *const log_cats[LOG_NCAT] = { "phoenixd", "dispatch", "phfs", "bsp" };
+static const char *const log_lvls[] = { "error", "warn", "info", "debug", "trace" };
+
+
+static struct {
+	log_slot_t slots[LOG_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+
+	/* Rate limiting of debug records, single producer per process is assumed */
+	struct {
+		time_t sec;
+		unsigned int n;
+		unsigned int suppressed;
+	} rate[LOG_NCAT];
+
+	int started;
+	int stop;
+	int waiting; /* writer blocks on evfd until producer wakes it */
+	int evfd;
+	volatile sig_atomic_t sig;
+	pid_t pid;
+	pthread_t writer;
+} log_common;
+
+
+static void log_reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_SLOTS; i++)
+		log_common.slots[i].seq = i;
+
+	log_common.head = 0;
+	log_common.tail = 0;
+	log_common.dropped = 0;
+	log_common.started = 0;
+	log_common.stop = 0;
+	log_common.waiting = 0;
+	log_common.evfd = -1;
+	log_common.sig = 0;
+	log_common.pid = getpid();
+}
+
+
+/* Function wakes the writer, it's async-signal-safe */
+static void log_wake(void)
+{
+	int err = errno;
+
+	/* Counter can't overflow before writer reads it */
+	eventfd_write(log_common.evfd, 1);
+	errno = err;
+}
+
+
+/* Function returns 1 if record at the tail of the ring is ready for writer */
+static int log_ready(void)
+{
+	log_slot_t *slot = &log_common.slots[log_common.tail & (LOG_SLOTS - 1)];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == log_common.tail + 1;
+}
+
+
+/* Function returns number of bytes moved from the ring to buff */
+static size_t log_drain(char *buff, size_t sz)
+{
+	log_slot_t *slot;
+	size_t n = 0;
+
+	while (log_ready()) {
+		slot = &log_common.slots[log_common.tail & (LOG_SLOTS - 1)];
+		if (n + slot->len > sz)
+			break;
+
+		memcpy(buff + n, slot->line, slot->len);
+		n += slot->len;
+
+		__atomic_store_n(&slot->seq, log_common.tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		log_common.tail++;
+	}
+
+	return n;
+}
+
+
+static void log_write(const char *buff, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(STDERR_FILENO, buff, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buff += r;
+		n -= r;
+	}
+}
+
+
+static void *log_writer(void *arg)
+{
+	char buff[16 * LOG_LINESZ];
+	char note[64];
+	unsigned int dropped;
+	eventfd_t v;
+	size_t n;
+
+	for (;;) {
+		if ((n = log_drain(buff, sizeof(buff))) != 0) {
+			log_write(buff, n);
+			continue;
+		}
+
+		if ((dropped = __atomic_exchange_n(&log_common.dropped, 0, __ATOMIC_RELAXED)) != 0) {
+			n = snprintf(note, sizeof(note), "[%d] log: %u records dropped\n", log_common.pid, dropped);
+			log_write(note, n);
+		}
+
+		if (__atomic_load_n(&log_common.stop, __ATOMIC_ACQUIRE))
+			break;
+
+		/* Ring is empty, producer publishing the next record sees waiting flag after the check below */
+		__atomic_store_n(&log_common.waiting, 1, __ATOMIC_SEQ_CST);
+		if (!log_ready() && !__atomic_load_n(&log_common.stop, __ATOMIC_ACQUIRE)) {
+			while ((eventfd_read(log_common.evfd, &v) < 0) && (errno == EINTR))
+				;
+		}
+		__atomic_store_n(&log_common.waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	/* Signals are blocked in the writer thread, deliver it to the process */
+	if (log_common.sig != 0) {
+		signal(log_common.sig, SIG_DFL);
+		kill(getpid(), log_common.sig);
+	}
+
+	return NULL;
+}
+
+
+/* Termination signals are handled by the writer thread after writing queued records */
+static void log_signal(int sig)
+{
+	if (!log_common.started) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+
+	log_common.sig = sig;
+	__atomic_store_n(&log_common.stop, 1, __ATOMIC_RELEASE);
+	log_wake();
+}
+
+
+static void log_done(void)
+{
+	if (!log_common.started || (log_common.pid != getpid()))
+		return;
+
+	__atomic_store_n(&log_common.stop, 1, __ATOMIC_RELEASE);
+	log_wake();
+	pthread_join(log_common.writer, NULL);
+	close(log_common.evfd);
+	log_common.evfd = -1;
+	log_common.started = 0;
+	log_common.stop = 0;
+}
+
+
+static void log_atfork(void)
+{
+	/* Writer thread isn't inherited and eventfd is shared with the parent, child writes only its own records */
+	if (log_common.evfd >= 0)
+		close(log_common.evfd);
+	log_reset();
+}
+
+
+static int log_start(void)
+{
+	static const int sigs[] = { SIGINT, SIGTERM };
+	static int registered;
+	struct sigaction sa;
+	sigset_t set, old;
+	unsigned int i;
+	int res;
+
+	if (!registered) {
+		log_reset();
+		pthread_atfork(NULL, NULL, log_atfork);
+		atexit(log_done);
+
+		for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+			if ((sigaction(sigs[i], NULL, &sa) == 0) && (sa.sa_handler == SIG_DFL)) {
+				memset(&sa, 0, sizeof(sa));
+				sa.sa_handler = log_signal;
+				sigemptyset(&sa.sa_mask);
+				sigaction(sigs[i], &sa, NULL);
+			}
+		}
+		registered = 1;
+	}
+
+	if ((log_common.evfd = eventfd(0, EFD_CLOEXEC)) < 0)
+		return ERR_MEM;
+
+	/* Signals are handled by the main thread, writer inherits blocked mask */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	res = pthread_create(&log_common.writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (res != 0) {
+		close(log_common.evfd);
+		log_common.evfd = -1;
+		return ERR_MEM;
+	}
+
+	log_common.started = 1;
+	return 0;
+}
+
+
+/* Function returns 0 if record exceeds the rate limit of the category */
+static int log_ratelimit(int cat, char *note, size_t sz)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (ts.tv_sec != log_common.rate[cat].sec) {
+		if (log_common.rate[cat].suppressed != 0)
+			snprintf(note, sz, " (%u records suppressed)", log_common.rate[cat].suppressed);
+		log_common.rate[cat].sec = ts.tv_sec;
+		log_common.rate[cat].n = 0;
+		log_common.rate[cat].suppressed = 0;
+	}
+
+	if (log_common.rate[cat].n++ < LOG_RATE)
+		return 1;
+
+	log_common.rate[cat].suppressed++;
+	return 0;
+}
+
+
+void log_printf(int cat, int lvl, const char *fmt, ...)
+{
+	log_slot_t *slot;
+	unsigned int pos, seq;
+	char note[48] = "";
+	va_list ap;
+	int n, l;
+
+	if ((lvl >= LOGLVL_DEBUG) && !log_ratelimit(cat, note, sizeof(note)))
+		return;
+
+	if (!log_common.started && (log_start() < 0))
+		return;
+
+	/* Reserve slot */
+	pos = __atomic_load_n(&log_common.head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &log_common.slots[pos & (LOG_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_common.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int)(seq - pos) < 0) {
+			/* Ring is full, writer can't keep up */
+			__atomic_fetch_add(&log_common.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else {
+			pos = __atomic_load_n(&log_common.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	n = snprintf(slot->line, LOG_LINESZ, "[%d] %s: ", log_common.pid, log_cats[cat]);
+
+	va_start(ap, fmt);
+	l = vsnprintf(slot->line + n, LOG_LINESZ - n, fmt, ap);
+	va_end(ap);
+	n = (l < 0) ? n : (n + l >= LOG_LINESZ) ? LOG_LINESZ - 1 : n + l;
+
+	/* Keep single line per record */
+	if ((n > 0) && (slot->line[n - 1] == '\n'))
+		n--;
+	l = snprintf(slot->line + n, LOG_LINESZ - n, "%s\n", note);
+	n = (n + l >= LOG_LINESZ) ? LOG_LINESZ : n + l;
+	slot->line[n - 1] = '\n';
+
+	slot->len = n;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	/* Only producer filling the empty ring wakes the writer waiting for it */
+	if (__atomic_load_n(&log_common.waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&log_common.waiting, 0, __ATOMIC_RELAXED))
+		log_wake();
+}
+
+
+void log_setlevel(int cat, int lvl)
+{
+	int i;
+
+	if (lvl > LOGLVL_TRACE)
+		lvl = LOGLVL_TRACE;
+
+	for (i = 0; i < LOG_NCAT; i++) {
+		if ((cat < 0) || (cat == i))
+			log_level[i] = lvl;
+	}
+}
+
+
+int log_parse(const char *spec)
+{
+	const char *lvl = spec, *eq;
+	char *end;
+	int cat = -1, i, l = -1;
+
+	if ((eq = strchr(spec, '=')) != NULL) {
+		for (i = 0; i < LOG_NCAT; i++) {
+			if ((strlen(log_cats[i]) == eq - spec) && (strncmp(log_cats[i], spec, eq - spec) == 0))
+				cat = i;
+		}
+		if (cat < 0)
+			return ERR_ARG;
+		lvl = eq + 1;
+	}
+
+	for (i = 0; i < sizeof(log_lvls) / sizeof(log_lvls[0]); i++) {
+		if (strcmp(log_lvls[i], lvl) == 0)
+			l = i;
+	}
+
+	if (l < 0) {
+		l = strtol(lvl, &end, 10);
+		if ((*lvl == '\0') || (*end != '\0') || (l < 0))
+			return ERR_ARG;
+	}
+
+	log_setlevel(cat, l);
+	return 0;
+}
+
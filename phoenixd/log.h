@@ -0,0 +1,69 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Asynchronous leveled logging
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+
+/* Categories */
+#define LOG_MAIN      0
+#define LOG_DISPATCH  1
+#define LOG_PHFS      2
+#define LOG_BSP       3
+#define LOG_NCAT      4
+
+/* Levels */
+#define LOGLVL_ERROR  0
+#define LOGLVL_WARN   1
+#define LOGLVL_INFO   2
+#define LOGLVL_DEBUG  3 /* per request records, rate limited */
+#define LOGLVL_TRACE  4 /* per frame records, rate limited */
+
+#define LOGLVL_DEFAULT  LOGLVL_INFO
+
+/* Maximal number of rate limited records per second and category */
+#define LOG_RATE  200
+
+
+extern int log_level[LOG_NCAT];
+
+
+#define log_enabled(cat, lvl) ((lvl) <= log_level[cat])
+
+#define log_msg(cat, lvl, ...) \
+	do { \
+		if (log_enabled(cat, lvl)) \
+			log_printf(cat, lvl, __VA_ARGS__); \
+	} while (0)
+
+#define log_error(cat, ...) log_msg(cat, LOGLVL_ERROR, __VA_ARGS__)
+#define log_warn(cat, ...)  log_msg(cat, LOGLVL_WARN, __VA_ARGS__)
+#define log_info(cat, ...)  log_msg(cat, LOGLVL_INFO, __VA_ARGS__)
+#define log_debug(cat, ...) log_msg(cat, LOGLVL_DEBUG, __VA_ARGS__)
+#define log_trace(cat, ...) log_msg(cat, LOGLVL_TRACE, __VA_ARGS__)
+
+
+/* Function queues record prefixed with process id and category name, records are written by the background thread */
+extern void log_printf(int cat, int lvl, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+
+/* Function sets level of the category (-1 - all categories) */
+extern void log_setlevel(int cat, int lvl);
+
+
+/* Function parses [category=]level specification, level is a name or number, returns 0 on success */
+extern int log_parse(const char *spec);
+
+
+#endif
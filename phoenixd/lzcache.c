@@ -0,0 +1,126 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Compressed blocks of files kept in the content cache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+
+#include <hostutils-common/lz.h>
+#include "lzcache.h"
+
+
+#define LZCACHE_BUCKETS 256
+
+
+/* Blocks of the file, kept with its content cache entry */
+typedef struct {
+	lzcache_block_t *buckets[LZCACHE_BUCKETS];
+	size_t size;
+} lzcache_t;
+
+
+static struct {
+	size_t size;
+} lzcache;
+
+
+typedef struct {
+	lzcache_block_t *b;
+	const u8 *src;
+} lzcache_compressarg_t;
+
+
+static unsigned int lzcache_hash(off_t pos, size_t len)
+{
+	return ((unsigned long long)pos * 2654435761u + len) % LZCACHE_BUCKETS;
+}
+
+
+static void lzcache_free(void *priv)
+{
+	lzcache_t *c = priv;
+	lzcache_block_t *b, *next;
+	unsigned int i;
+
+	for (i = 0; i < LZCACHE_BUCKETS; i++) {
+		for (b = c->buckets[i]; b != NULL; b = next) {
+			next = b->next;
+			free(b);
+		}
+	}
+
+	lzcache.size -= c->size;
+	free(c);
+}
+
+
+/* Function compresses mapping of the file, it's called by cache_guard() */
+static int lzcache_compress(void *arg)
+{
+	lzcache_compressarg_t *a = arg;
+
+	a->b->clen = lz_compress(a->b->data, a->b->maxclen, a->src, a->b->len);
+	return 0;
+}
+
+
+const lzcache_block_t *lzcache_get(cache_entry_t *e, off_t pos, size_t len, size_t maxclen)
+{
+	lzcache_compressarg_t a;
+	lzcache_block_t *b, *nb;
+	lzcache_t *c;
+	unsigned int h;
+
+	if ((pos < 0) || (pos >= e->len) || (len > e->len - pos) || (maxclen == 0))
+		return NULL;
+
+	if ((c = e->priv[CACHE_LZ]) == NULL) {
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			return NULL;
+		e->priv[CACHE_LZ] = c;
+		e->privfree[CACHE_LZ] = lzcache_free;
+	}
+
+	h = lzcache_hash(pos, len);
+	for (b = c->buckets[h]; b != NULL; b = b->next) {
+		if ((b->pos == pos) && (b->len == len) && (b->maxclen == maxclen))
+			return (b->clen != 0) ? b : NULL;
+	}
+
+	if (lzcache.size + sizeof(*b) + maxclen > LZCACHE_BUDGET)
+		return NULL;
+
+	if ((b = malloc(sizeof(*b) + maxclen)) == NULL)
+		return NULL;
+
+	b->pos = pos;
+	b->len = len;
+	b->maxclen = maxclen;
+
+	a.b = b;
+	a.src = e->data + pos;
+	if (cache_guard(e, lzcache_compress, &a) < 0) {
+		free(b);
+		return NULL;
+	}
+
+	/* Incompressible data are remembered too */
+	if ((b->clen < maxclen) && ((nb = realloc(b, sizeof(*b) + b->clen)) != NULL))
+		b = nb;
+
+	b->next = c->buckets[h];
+	c->buckets[h] = b;
+	c->size += sizeof(*b) + b->clen;
+	lzcache.size += sizeof(*b) + b->clen;
+
+	return (b->clen != 0) ? b : NULL;
+}
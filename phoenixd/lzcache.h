@@ -0,0 +1,44 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Compressed blocks of files kept in the content cache
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LZCACHE_H_
+#define _LZCACHE_H_
+
+#include <sys/types.h>
+#include <hostutils-common/types.h>
+#include "cache.h"
+
+
+/* Compressed bytes kept for all files, blocks exceeding it are sent uncompressed */
+#define LZCACHE_BUDGET  (64 * 1024 * 1024)
+
+
+typedef struct _lzcache_block_t {
+	struct _lzcache_block_t *next;
+	off_t pos;
+	size_t len;
+	size_t maxclen;
+	size_t clen; /* 0 - data don't compress to maxclen bytes */
+	u8 data[];
+} lzcache_block_t;
+
+
+/*
+ * Function returns block of len bytes of the file at pos compressed to at most maxclen bytes,
+ * NULL if data don't compress that well or file has been truncated. Block is valid until entry is freed.
+ */
+extern const lzcache_block_t *lzcache_get(cache_entry_t *e, off_t pos, size_t len, size_t maxclen);
+
+
+#endif
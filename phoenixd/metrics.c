@@ -0,0 +1,427 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Session metrics in Prometheus text exposition format
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <hostutils-common/errors.h>
+#include "dispatch.h"
+#include "metrics.h"
+#include "poller.h"
+#include "log.h"
+
+
+/* Time for the client to send request and to receive the response (ms) */
+#define METRICS_REQTIMEO 100
+#define METRICS_RESPTIMEO 5000
+
+
+typedef struct {
+	char *p;
+	size_t n;
+	size_t sz;
+	int err;
+} metrics_buf_t;
+
+
+/* Connection of the scraper served by the dispatcher without blocking */
+typedef struct _metrics_client_t {
+	struct _metrics_client_t *next;
+	dispatch_ctx_t ctx;
+	int fd;
+	char *resp; /* NULL until request is consumed */
+	size_t len;
+	size_t sent;
+	unsigned long long deadline; /* ms */
+} metrics_client_t;
+
+
+static metrics_client_t *metrics_clients;
+
+
+static const char *const metrics_types[METRICS_NTYPES] = {
+	"err", "open", "read", "write", "close", "reset", "fstat", "hello", "stream", "sack", "baud", "hash"
+};
+
+
+static const char *const metrics_modes[] = { "serial", "pipe", "udp", "tcp", "usb_vybrid", "usb_imx", "tcp_listen" };
+
+
+void metrics_request(metrics_t *m, unsigned int type, const struct timespec *start)
+{
+	struct timespec ts;
+	unsigned long long ns, us;
+	unsigned int k;
+
+	if (type >= METRICS_NTYPES)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (ts.tv_sec - start->tv_sec) * 1000000000ULL + ts.tv_nsec - start->tv_nsec;
+	us = (ns + 999) / 1000;
+
+	k = (us <= 1) ? 0 : 64 - __builtin_clzll(us - 1);
+	if (k >= METRICS_NBUCKETS)
+		k = METRICS_NBUCKETS - 1;
+
+	m->requests[type]++;
+	m->latency[type][k]++;
+	m->latency_sum[type] += ns;
+}
+
+
+static void metrics_printf(metrics_buf_t *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+
+static void metrics_printf(metrics_buf_t *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int n;
+
+	while (!b->err) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->p + b->n, b->sz - b->n, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+
+		if (b->n + n < b->sz) {
+			b->n += n;
+			return;
+		}
+
+		/* Keep what fits if buffer can't grow */
+		if ((p = realloc(b->p, 2 * b->sz + n)) == NULL) {
+			b->err = 1;
+			return;
+		}
+		b->p = p;
+		b->sz = 2 * b->sz + n;
+	}
+}
+
+
+static void metrics_family(metrics_buf_t *b, const char *name, const char *type, const char *help)
+{
+	metrics_printf(b, "# HELP phoenixd_%s %s\n# TYPE phoenixd_%s %s\n", name, help, name, type);
+}
+
+
+static void metrics_labels(metrics_buf_t *b, session_t *s)
+{
+	const char *c;
+
+	metrics_printf(b, "{session=\"");
+	for (c = s->name; *c != '\0'; c++)
+		metrics_printf(b, ((*c == '"') || (*c == '\\')) ? "\\%c" : "%c", *c);
+	metrics_printf(b, "\",mode=\"%s\"", metrics_modes[s->mode]);
+}
+
+
+static void metrics_counter(metrics_buf_t *b, session_t *sessions, const char *name, const char *type, const char *help, size_t offs)
+{
+	session_t *s;
+
+	metrics_family(b, name, type, help);
+	for (s = sessions; s != NULL; s = s->next) {
+		metrics_printf(b, "phoenixd_%s", name);
+		metrics_labels(b, s);
+		metrics_printf(b, "} %llu\n", *(unsigned long long *)((u8 *)&s->metrics + offs));
+	}
+}
+
+
+/* Function returns metrics text following prefix, it has to be freed by the caller */
+static char *metrics_format(session_t *sessions, const char *prefix, size_t *len)
+{
+	metrics_buf_t b;
+	session_t *s;
+	unsigned long long n;
+	unsigned int t, k, h;
+
+	b.n = 0;
+	b.sz = 4096;
+	b.err = 0;
+	if ((b.p = malloc(b.sz)) == NULL)
+		return NULL;
+
+	metrics_printf(&b, "%s", prefix);
+
+	metrics_counter(&b, sessions, "frames_received_total", "counter", "Frames received from the target", offsetof(metrics_t, frames_in));
+	metrics_counter(&b, sessions, "frames_sent_total", "counter", "Frames sent to the target", offsetof(metrics_t, frames_out));
+	metrics_counter(&b, sessions, "received_bytes_total", "counter", "Message bytes received from the target", offsetof(metrics_t, bytes_in));
+	metrics_counter(&b, sessions, "sent_bytes_total", "counter", "Message bytes sent to the target", offsetof(metrics_t, bytes_out));
+	metrics_counter(&b, sessions, "error_replies_total", "counter", "MSG_ERR replies sent to the target", offsetof(metrics_t, err_replies));
+	metrics_counter(&b, sessions, "duplicate_requests_total", "counter", "Retransmitted requests answered from the reply cache", offsetof(metrics_t, dup_requests));
+
+	metrics_family(&b, "decode_errors_total", "counter", "Dropped malformed frames");
+	for (s = sessions; s != NULL; s = s->next) {
+		metrics_printf(&b, "phoenixd_decode_errors_total");
+		metrics_labels(&b, s);
+		metrics_printf(&b, "} %u\n", s->link.rx.errors);
+	}
+
+	metrics_family(&b, "open_handles", "gauge", "Files opened by the target");
+	for (s = sessions; s != NULL; s = s->next) {
+		for (h = 0, n = 0; h < s->nhandles; h++) {
+			if ((s->handles[h].fd >= 0) || (s->handles[h].entry != NULL))
+				n++;
+		}
+		metrics_printf(&b, "phoenixd_open_handles");
+		metrics_labels(&b, s);
+		metrics_printf(&b, "} %llu\n", n);
+	}
+
+	metrics_family(&b, "requests_total", "counter", "Handled requests by message type");
+	for (s = sessions; s != NULL; s = s->next) {
+		for (t = 0; t < METRICS_NTYPES; t++) {
+			if (s->metrics.requests[t] == 0)
+				continue;
+			metrics_printf(&b, "phoenixd_requests_total");
+			metrics_labels(&b, s);
+			metrics_printf(&b, ",type=\"%s\"} %llu\n", metrics_types[t], s->metrics.requests[t]);
+		}
+	}
+
+	metrics_family(&b, "request_duration_seconds", "histogram", "Request handling time by message type");
+	for (s = sessions; s != NULL; s = s->next) {
+		for (t = 0; t < METRICS_NTYPES; t++) {
+			if (s->metrics.requests[t] == 0)
+				continue;
+
+			for (k = 0, n = 0; k < METRICS_NBUCKETS; k++) {
+				n += s->metrics.latency[t][k];
+				metrics_printf(&b, "phoenixd_request_duration_seconds_bucket");
+				metrics_labels(&b, s);
+				if (k < METRICS_NBUCKETS - 1)
+					metrics_printf(&b, ",type=\"%s\",le=\"%.6f\"} %llu\n", metrics_types[t], (double)(1u << k) / 1e6, n);
+				else
+					metrics_printf(&b, ",type=\"%s\",le=\"+Inf\"} %llu\n", metrics_types[t], n);
+			}
+
+			metrics_printf(&b, "phoenixd_request_duration_seconds_sum");
+			metrics_labels(&b, s);
+			metrics_printf(&b, ",type=\"%s\"} %.9f\n", metrics_types[t], s->metrics.latency_sum[t] / 1e9);
+
+			metrics_printf(&b, "phoenixd_request_duration_seconds_count");
+			metrics_labels(&b, s);
+			metrics_printf(&b, ",type=\"%s\"} %llu\n", metrics_types[t], s->metrics.requests[t]);
+		}
+	}
+
+	*len = b.n;
+	return b.p;
+}
+
+
+static void metrics_write(int fd, const char *buff, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = write(fd, buff, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buff += r;
+		len -= r;
+	}
+}
+
+
+int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return ERR_ARG;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return ERR_DISPATCH_IO;
+
+	/* Socket left by the previous instance */
+	unlink(path);
+
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 8) < 0) || (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)) {
+		close(fd);
+		return ERR_DISPATCH_IO;
+	}
+
+	return fd;
+}
+
+
+static void metrics_close(metrics_client_t *c)
+{
+	metrics_client_t **p;
+
+	for (p = &metrics_clients; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+
+	poller_del(c->fd);
+	close(c->fd);
+	free(c->resp);
+	free(c);
+}
+
+
+/* Function writes response without blocking, client is closed once it's written or on error */
+static void metrics_send(metrics_client_t *c)
+{
+	ssize_t r;
+
+	while (c->sent < c->len) {
+		if ((r = write(c->fd, c->resp + c->sent, c->len - c->sent)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			break;
+		}
+		c->sent += r;
+	}
+
+	shutdown(c->fd, SHUT_WR);
+	metrics_close(c);
+}
+
+
+/* Function formats response from the current metrics and starts writing it */
+static void metrics_respond(metrics_client_t *c, session_t *sessions, unsigned long long now)
+{
+	static const char hdr[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+
+	if (((c->resp = metrics_format(sessions, hdr, &c->len)) == NULL) || (poller_mod(c->fd, POLLER_OUT, &c->ctx) < 0)) {
+		metrics_close(c);
+		return;
+	}
+
+	c->deadline = now + METRICS_RESPTIMEO;
+	metrics_send(c);
+}
+
+
+void metrics_accept(int fd, unsigned long long now)
+{
+	metrics_client_t *c;
+	int cfd;
+
+	while ((cfd = accept(fd, NULL, NULL)) >= 0) {
+		if ((fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) < 0) || ((c = calloc(1, sizeof(*c))) == NULL)) {
+			close(cfd);
+			continue;
+		}
+
+		c->ctx.type = CTX_SCRAPER;
+		c->ctx.ptr = c;
+		c->fd = cfd;
+		c->deadline = now + METRICS_REQTIMEO;
+
+		if (poller_add(cfd, POLLER_IN, &c->ctx) < 0) {
+			close(cfd);
+			free(c);
+			continue;
+		}
+
+		c->next = metrics_clients;
+		metrics_clients = c;
+	}
+}
+
+
+void metrics_client(metrics_client_t *c, session_t *sessions, unsigned long long now)
+{
+	char req[1024];
+	ssize_t r;
+
+	if (c->resp != NULL) {
+		metrics_send(c);
+		return;
+	}
+
+	/*
+	 * Request isn't parsed, every client gets HTTP response for scrapers. Request is consumed,
+	 * so closing the socket doesn't reset the connection.
+	 */
+	while ((r = recv(c->fd, req, sizeof(req), MSG_DONTWAIT)) > 0)
+		;
+
+	if ((r < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+		metrics_close(c);
+		return;
+	}
+
+	metrics_respond(c, sessions, now);
+}
+
+
+int metrics_timers(session_t *sessions, unsigned long long now)
+{
+	metrics_client_t *c, *next;
+	int timeout = -1;
+
+	/* Clients not sending request are served after a while, clients not reading the response are dropped */
+	for (c = metrics_clients; c != NULL; c = next) {
+		next = c->next;
+		if (c->deadline > now)
+			continue;
+
+		if (c->resp == NULL)
+			metrics_respond(c, sessions, now);
+		else
+			metrics_close(c);
+	}
+
+	for (c = metrics_clients; c != NULL; c = c->next) {
+		if ((timeout < 0) || (c->deadline - now < timeout))
+			timeout = c->deadline - now;
+	}
+
+	return timeout;
+}
+
+
+void metrics_dump(session_t *sessions)
+{
+	char *text;
+	size_t len;
+
+	if ((text = metrics_format(sessions, "", &len)) == NULL) {
+		log_error(LOG_DISPATCH, "Can't format metrics");
+		return;
+	}
+
+	metrics_write(STDERR_FILENO, text, len);
+	free(text);
+}
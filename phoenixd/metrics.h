@@ -0,0 +1,75 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Session metrics
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <time.h>
+
+
+/* Number of tracked message types */
+#define METRICS_NTYPES  16
+
+/* Request latency buckets, bucket k counts requests handled in up to 2^k us, the last one is +Inf */
+#define METRICS_NBUCKETS  22
+
+
+typedef struct _metrics_t {
+	unsigned long long frames_in;
+	unsigned long long frames_out;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long err_replies;
+	unsigned long long dup_requests; /* retransmitted requests answered from the reply cache */
+
+	unsigned long long requests[METRICS_NTYPES];
+	unsigned long long latency[METRICS_NTYPES][METRICS_NBUCKETS];
+	unsigned long long latency_sum[METRICS_NTYPES]; /* ns */
+} metrics_t;
+
+
+struct _session_t;
+
+
+#define metrics_start(ts) clock_gettime(CLOCK_MONOTONIC, (ts))
+
+
+/* Function accounts request of the type handled since start */
+extern void metrics_request(metrics_t *m, unsigned int type, const struct timespec *start);
+
+
+/* Function creates UNIX socket serving metrics, returns listening descriptor */
+extern int metrics_listen(const char *path);
+
+
+struct _metrics_client_t;
+
+
+/* Function accepts clients waiting on the listening socket, they are watched by the dispatcher */
+extern void metrics_accept(int fd, unsigned long long now);
+
+
+/* Function consumes request of the client and writes metrics of all sessions to it without blocking */
+extern void metrics_client(struct _metrics_client_t *c, struct _session_t *sessions, unsigned long long now);
+
+
+/* Function serves clients not sending request in time and drops not reading ones, returns time to the next deadline (ms) or -1 */
+extern int metrics_timers(struct _session_t *sessions, unsigned long long now);
+
+
+/* Function writes metrics of all sessions to stderr */
+extern void metrics_dump(struct _session_t *sessions);
+
+
+#endif
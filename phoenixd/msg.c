@@ -13,123 +13,473 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include <hostutils-common/errors.h>
-#include <hostutils-common/serial.h>
 #include "msg.h"
 
 
+const codec_t msg_codec = { MSG_MARK, MSG_ESC, MSG_MARK ^ MSG_ESCMARK };
+
+
 u32 msg_csum(msg_t *msg)
 {
-	unsigned int k;
+	return msg_csumv(msg, NULL, 0);
+}
+
+
+u32 msg_csumv(msg_t *msg, const u8 *data, size_t len)
+{
 	u16 csum;
 
-	csum = 0;
-	for (k = 0; k < MSG_HDRSZ + msg_getlen(msg); k++) {
-		if (k >= sizeof(msg->csum)) {
-			csum += *((u8 *)msg + k);
-		}
-	}
+	csum = codec_sum((u8 *)&msg->type, sizeof(msg->type) + msg_getlen(msg) - len);
+	csum += codec_sum(data, len);
 	csum += msg_getseq(msg);
+
 	return csum;
 }
 
 
-int msg_serial_send(int fd, msg_t *msg, u16 seq)
+u8 *msg_encodecsum(msg_t *msg, u16 seq, u32 sum, u8 *body)
 {
-	u8 *p = (u8 *)msg;
-	u8 cs[2];
-	unsigned int k;
-	u8 buff[MSG_MAXLEN * 2 + MSG_HDRSZ * 2];
-	unsigned int i = 0;
+	u8 csum[2 * sizeof(msg->csum)];
+	size_t n;
 
 	msg_setseq(msg, seq);
-	msg_setcsum(msg, msg_csum(msg));
-	cs[0] = MSG_MARK;
+	msg_setcsum(msg, sum + seq);
 
-	if (msg_getlen(msg) > MSG_MAXLEN)
-		return ERR_MSG_ARG;
+	n = codec_encode(&msg_codec, csum, (u8 *)&msg->csum, sizeof(msg->csum));
+	memcpy(body - n, csum, n);
+	*(body - n - 1) = MSG_MARK;
 
-	buff[i++] = cs[0];
+	return body - n - 1;
+}
 
-	for (k = 0; k < MSG_HDRSZ + msg_getlen(msg); k++) {
 
-		if ((p[k] == MSG_MARK) || (p[k] == MSG_ESC)) {
-			cs[0] = MSG_ESC;
-			if (p[k] == MSG_MARK)
-				cs[1] = MSG_ESCMARK;
-			else
-				cs[1] = MSG_ESCESC;
-			memcpy(&buff[i], cs, 2);
-			i += 2;
+u8 *msg_encode(msg_t *msg, u16 seq, u8 *buff, size_t *len)
+{
+	u32 sum = 0;
+	size_t n;
+	u8 *frame;
+
+	n = codec_encodesum(&msg_codec, buff + MSG_CSUMOFFS, (u8 *)&msg->type, sizeof(msg->type) + msg_getlen(msg), &sum);
+	frame = msg_encodecsum(msg, seq, sum, buff + MSG_CSUMOFFS);
+	*len = buff + MSG_CSUMOFFS + n - frame;
+
+	return frame;
+}
+
+
+int msg_txinit(msg_tx_t *tx, unsigned int sz)
+{
+	tx->len = 0;
+	tx->sz = sz;
+	tx->n = 0;
+	tx->buff = NULL;
+	tx->pend = NULL;
+	tx->pendoff = 0;
+	tx->pendlen = 0;
+	tx->pendsz = 0;
+
+	if ((sz != 0) && ((tx->buff = malloc(sz)) == NULL))
+		return ERR_MEM;
+
+	return 0;
+}
+
+
+void msg_txdone(msg_tx_t *tx)
+{
+	free(tx->buff);
+	free(tx->pend);
+	tx->buff = NULL;
+	tx->pend = NULL;
+	tx->sz = 0;
+	tx->pendsz = 0;
+}
+
+
+/* Function writes iovecs until fd doesn't accept more, returns number of iovecs left adjusted to not written part */
+static int msg_writev(int fd, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = writev(fd, iov, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return n;
+
+			return ERR_MSG_IO;
+		}
+
+		/* Skip written part */
+		for (; (n > 0) && (r >= (ssize_t)iov->iov_len); n--, iov++)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (u8 *)iov->iov_base + r;
+			iov->iov_len -= r;
 		}
-		else
-			buff[i++] = p[k];
 	}
-	if (serial_write(fd, buff, i) < 0)
+
+	return 0;
+}
+
+
+/* Function appends n iovecs to the pending frames */
+static int msg_txkeep(msg_tx_t *tx, const struct iovec *iov, int n)
+{
+	size_t len = 0, sz;
+	int i;
+	u8 *p;
+
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+
+	if (tx->pendlen - tx->pendoff + len > MSG_TXPENDMAX)
 		return ERR_MSG_IO;
 
-	return k;
+	if (tx->pendlen + len > tx->pendsz) {
+		memmove(tx->pend, tx->pend + tx->pendoff, tx->pendlen - tx->pendoff);
+		tx->pendlen -= tx->pendoff;
+		tx->pendoff = 0;
+	}
+
+	if (tx->pendlen + len > tx->pendsz) {
+		for (sz = (tx->pendsz != 0) ? tx->pendsz : MSG_TXBUFSZ; sz < tx->pendlen + len; sz *= 2)
+			;
+		if ((p = realloc(tx->pend, sz)) == NULL)
+			return ERR_MEM;
+		tx->pend = p;
+		tx->pendsz = sz;
+	}
+
+	for (i = 0; i < n; i++) {
+		memcpy(tx->pend + tx->pendlen, iov[i].iov_base, iov[i].iov_len);
+		tx->pendlen += iov[i].iov_len;
+	}
+
+	return 0;
 }
 
 
-int msg_serial_recv(int fd, msg_t *msg, int *state)
+int msg_txwritev(int fd, msg_tx_t *tx, struct iovec *iov, int n)
 {
-	int escfl = 0;
-	unsigned int l = 0;
-	u8 c;
+	struct iovec v[1 + 2 * MSG_TXIOVMAX];
+	int i, k = 0, pendfl, m;
 
-	for (;;) {
-		if (serial_read(fd, &c, 1, 0) < 0) {
-			*state = MSGRECV_DESYN;
-			return ERR_MSG_IO;
+	if (n > MSG_TXIOVMAX)
+		return ERR_MSG_ARG;
+
+	/* Pending frames go first, then gathered ones */
+	if ((pendfl = (tx->pendlen != tx->pendoff))) {
+		v[k].iov_base = tx->pend + tx->pendoff;
+		v[k++].iov_len = tx->pendlen - tx->pendoff;
+	}
+
+	for (i = 0; i < tx->n; i++)
+		v[k++] = tx->iov[i];
+
+	for (i = 0; i < n; i++)
+		v[k++] = iov[i];
+
+	tx->n = 0;
+	tx->len = 0;
+
+	if ((m = msg_writev(fd, v, k)) < 0)
+		return m;
+
+	/* Not written part of the pending frames stays in place, the rest is appended */
+	if (pendfl && (m == k)) {
+		tx->pendoff = (u8 *)v[0].iov_base - tx->pend;
+		m--;
+	}
+	else {
+		tx->pendoff = 0;
+		tx->pendlen = 0;
+	}
+
+	return msg_txkeep(tx, v + k - m, m);
+}
+
+
+int msg_txflush(int fd, msg_tx_t *tx)
+{
+	if ((tx->n == 0) && (tx->pendlen == tx->pendoff))
+		return 0;
+
+	return msg_txwritev(fd, tx, NULL, 0);
+}
+
+
+void msg_txdrop(msg_tx_t *tx)
+{
+	tx->n = 0;
+	tx->len = 0;
+	tx->pendoff = 0;
+	tx->pendlen = 0;
+}
+
+
+u8 *msg_txbuff(int fd, msg_tx_t *tx, size_t len)
+{
+	if (len > tx->sz)
+		return NULL;
+
+	if (((tx->len + len > tx->sz) || (tx->n == MSG_TXIOVMAX)) && (msg_txflush(fd, tx) < 0))
+		return NULL;
+
+	return tx->buff + tx->len;
+}
+
+
+int msg_txadd(int fd, msg_tx_t *tx, u8 *frame, size_t len)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (tx->n == 0)
+		tx->first = ts;
+
+	tx->iov[tx->n].iov_base = frame;
+	tx->iov[tx->n++].iov_len = len;
+	tx->len = frame + len - tx->buff;
+
+	/* Replies aren't delayed longer than the latency budget while next requests are handled */
+	if ((ts.tv_sec - tx->first.tv_sec) * 1000000LL + (ts.tv_nsec - tx->first.tv_nsec) / 1000 >= MSG_TXDELAY)
+		return msg_txflush(fd, tx);
+
+	return 0;
+}
+
+
+int msg_linkinit(msg_link_t *l, const msg_ops_t *ops, unsigned int rxsz, unsigned int txsz)
+{
+	l->ops = ops;
+	l->fd = -1;
+	l->fd_out = -1;
+	l->batch = NULL;
+	memset(&l->peer, 0, sizeof(l->peer));
+
+	if (msg_rxinit(&l->rx, rxsz) < 0)
+		return ERR_MEM;
+
+	if (msg_txinit(&l->tx, txsz) < 0) {
+		msg_rxdone(&l->rx);
+		return ERR_MEM;
+	}
+
+	return 0;
+}
+
+
+void msg_linkdone(msg_link_t *l)
+{
+	msg_rxdone(&l->rx);
+	msg_txdone(&l->tx);
+}
+
+
+int msg_linkresize(msg_link_t *l, unsigned int rxsz, unsigned int txsz)
+{
+	msg_rx_t *rx = &l->rx;
+	u8 *p;
+
+	if (rx->sz != rxsz) {
+		if (rx->rd != 0) {
+			memmove(rx->buff, rx->buff + rx->rd, rx->wr - rx->rd);
+			rx->wr -= rx->rd;
+			rx->rd = 0;
 		}
 
-		if (*state == MSGRECV_FRAME) {
+		if ((rx->wr > rxsz) || ((p = realloc(rx->buff, rxsz)) == NULL))
+			return ERR_MEM;
+		rx->buff = p;
+		rx->sz = rxsz;
+	}
 
-			/* Return error if frame is to long */
-			if (l == MSG_HDRSZ + MSG_MAXLEN) {
-				*state = MSGRECV_DESYN;
-				return ERR_MSG_IO;
-			}
+	if (l->tx.sz != txsz) {
+		if (msg_txflush(l->fd_out, &l->tx) < 0)
+			return ERR_MSG_IO;
 
-			/* Return error if terminator discovered */
-			if (c == MSG_MARK) {
-				return ERR_MSG_IO;
-			}
+		if ((p = realloc(l->tx.buff, txsz)) == NULL)
+			return ERR_MEM;
+		l->tx.buff = p;
+		l->tx.sz = txsz;
+	}
 
-			if (!escfl && (c == MSG_ESC)) {
-				escfl = 1;
-				continue;
-			}
-			if (escfl) {
-				if (c == MSG_ESCMARK)
-					c = MSG_MARK;
-				if (c == MSG_ESCESC)
-					c = MSG_ESC;
-				escfl = 0;
-			}
-			*((u8 *)msg + l++) = c;
+	return 0;
+}
+
+
+int msg_linkflush(msg_link_t *l)
+{
+	return msg_txflush(l->fd_out, &l->tx);
+}
+
+
+int msg_linkpending(msg_link_t *l)
+{
+	return l->tx.pendlen != l->tx.pendoff;
+}
+
+
+int msg_serial_send(msg_link_t *l, msg_t *msg, u16 seq)
+{
+	u8 *buff, *frame;
+	size_t n;
+
+	if (msg_getlen(msg) > MSG_MAXLEN)
+		return ERR_MSG_ARG;
+
+	if ((buff = msg_txbuff(l->fd_out, &l->tx, MSG_FRAMESZ)) == NULL)
+		return ERR_MSG_IO;
+
+	frame = msg_encode(msg, seq, buff, &n);
+
+	if (msg_txadd(l->fd_out, &l->tx, frame, n) < 0)
+		return ERR_MSG_IO;
+
+	return MSG_HDRSZ + msg_getlen(msg);
+}
+
+
+int msg_rxinit(msg_rx_t *rx, unsigned int sz)
+{
+	rx->state = MSGRECV_DESYN;
+	rx->escfl = 0;
+	rx->l = 0;
+	rx->maxlen = MSG_MAXLEN;
+	rx->rd = 0;
+	rx->wr = 0;
+	rx->sz = sz;
+	rx->buff = NULL;
+	rx->errors = 0;
+	rx->sum = 0;
+
+	if ((sz != 0) && ((rx->buff = malloc(sz)) == NULL))
+		return ERR_MEM;
+
+	return 0;
+}
+
+
+void msg_rxdone(msg_rx_t *rx)
+{
+	free(rx->buff);
+	rx->buff = NULL;
+	rx->sz = 0;
+}
 
-			/* Frame received */
-			if ((l >= MSG_HDRSZ) && (l == msg_getlen(msg) + MSG_HDRSZ)) {
-				*state = MSGRECV_DESYN;
+
+int msg_rxdecode(msg_t *msg, msg_rx_t *rx)
+{
+	size_t dlen, slen;
+	u8 *b;
+	int mark;
+
+	while (rx->rd < rx->wr) {
+		if (rx->state != MSGRECV_FRAME) {
+			/* Synchronize */
+			if ((b = memchr(&rx->buff[rx->rd], MSG_MARK, rx->wr - rx->rd)) == NULL) {
+				rx->rd = rx->wr;
 				break;
 			}
+			rx->rd = b - rx->buff + 1;
+			rx->state = MSGRECV_FRAME;
+			rx->escfl = 0;
+			rx->l = 0;
+			rx->sum = 0;
+			continue;
 		}
-		else {
-			/* Synchronize */
-			if (c == MSG_MARK)
-				*state = MSGRECV_FRAME;
+
+		/* Decode header first, then exactly the rest of the frame */
+		if (rx->l < MSG_HDRSZ)
+			dlen = MSG_HDRSZ - rx->l;
+		else
+			dlen = MSG_HDRSZ + msg_getlen(msg) - rx->l;
+		slen = rx->wr - rx->rd;
+
+		mark = codec_decodesum(&msg_codec, (u8 *)msg + rx->l, &dlen, &rx->buff[rx->rd], &slen, &rx->escfl, &rx->sum);
+		rx->rd += slen;
+		rx->l += dlen;
+
+		/* Drop frame if terminator discovered and start the next one */
+		if (mark) {
+			if (rx->l != 0)
+				rx->errors++;
+			rx->rd++;
+			rx->escfl = 0;
+			rx->l = 0;
+			rx->sum = 0;
+			continue;
+		}
+
+		if (rx->l < MSG_HDRSZ)
+			continue;
+
+		/* Drop frame if it is too long */
+		if (msg_getlen(msg) > rx->maxlen) {
+			rx->errors++;
+			rx->state = MSGRECV_DESYN;
+			continue;
+		}
+
+		/* Frame received, checksum doesn't cover checksum field but sequence number */
+		if (rx->l == MSG_HDRSZ + msg_getlen(msg)) {
+			rx->state = MSGRECV_DESYN;
+			dlen = rx->l;
+			rx->l = 0;
+
+			rx->sum -= codec_sum((u8 *)&msg->csum, sizeof(msg->csum));
+			if ((u16)(rx->sum + msg_getseq(msg)) != msg_getcsum(msg)) {
+				rx->errors++;
+				continue;
+			}
+
+			return dlen;
 		}
 	}
 
-	/* Verify received message */
-	//if (msg->csum != msg_csum(msg)) {
-	//	return ERR_MSG_IO;
-	//}
+	return 0;
+}
+
+
+int msg_serial_recv(msg_link_t *link, msg_t *msg)
+{
+	msg_rx_t *rx = &link->rx;
+	ssize_t res;
+	int l;
+
+	for (;;) {
+		/* Buffered data may contain several frames, decode them before reading more */
+		if ((l = msg_rxdecode(msg, rx)) > 0)
+			break;
+
+		if ((res = read(link->fd, rx->buff, rx->sz)) < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return 0;
+
+			rx->state = MSGRECV_DESYN;
+			return ERR_MSG_IO;
+		}
+		else if (res == 0) {
+			rx->state = MSGRECV_DESYN;
+			return ERR_MSG_CLOSED;
+		}
+
+		rx->rd = 0;
+		rx->wr = res;
+	}
 
 	return l;
 }
+
+
+const msg_ops_t msg_serial_ops = { msg_serial_send, NULL, msg_serial_recv, msg_linkflush };
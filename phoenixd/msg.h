@@ -15,7 +15,11 @@
 #ifndef _MSG_H_
 #define _MSG_H_
 
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <hostutils-common/types.h>
+#include <hostutils-common/codec.h>
 
 
 /* Special characters */
@@ -36,6 +40,27 @@
 
 #define MSG_HDRSZ   2 * sizeof(u32)
 #define MSG_MAXLEN  512
+#define MSG_RXBUFSZ 4096
+
+/* Maximal length negotiated by MSG_HELLO on UDP and TCP, fits 16-bit length field and UDP datagram */
+#define MSG_LARGELEN (63 * 1024)
+
+/* Size of buffer holding message of negotiated length, used as msg_t */
+#define MSG_LARGESZ (MSG_HDRSZ + MSG_LARGELEN)
+
+/* Frame mark followed by message with all bytes escaped */
+#define MSG_FRAMESZ (1 + 2 * (MSG_HDRSZ + MSG_MAXLEN))
+
+/* Room for frame mark and escaped checksum left in front of the escaped rest of the message */
+#define MSG_CSUMOFFS (1 + 2 * sizeof(u32))
+
+/* Frames of replies are gathered up to the buffer size and number of frames, but not longer than MSG_TXDELAY us */
+#define MSG_TXBUFSZ  (8 * 1024)
+#define MSG_TXIOVMAX 64
+#define MSG_TXDELAY  1000
+
+/* Frames not accepted by the output are kept until it becomes writable, target not reading them is dropped */
+#define MSG_TXPENDMAX (8 * 1024 * 1024)
 
 
 typedef struct _msg_t {
@@ -45,22 +70,169 @@ typedef struct _msg_t {
 } msg_t;
 
 
+/* Receive context, keeps partially received frame and not decoded data between calls */
+typedef struct _msg_rx_t {
+	int state;
+	int escfl;
+	unsigned int l;
+	unsigned int maxlen;
+	unsigned int rd;
+	unsigned int wr;
+	unsigned int sz;
+	u8 *buff;
+	unsigned int errors; /* number of dropped frames */
+	u32 sum;             /* sum of decoded bytes of the frame */
+} msg_rx_t;
+
+
+/*
+ * Transmit context, frames of replies handled in the same loop iteration are written together.
+ * Output is never waited for, part of frames it doesn't accept is copied to pend and written first next time.
+ */
+typedef struct _msg_tx_t {
+	u8 *buff;
+	size_t len;
+	size_t sz;
+	struct iovec iov[MSG_TXIOVMAX]; /* gathered frames within buff */
+	int n;
+	struct timespec first;          /* time of gathering the first frame */
+	u8 *pend;
+	size_t pendoff;                 /* not written bytes are pend[pendoff, pendlen) */
+	size_t pendlen;
+	size_t pendsz;
+} msg_tx_t;
+
+
+struct _msg_link_t;
+struct _msg_udpbatch_t;
+
+
+/* Transport operations of the link */
+typedef struct _msg_ops_t {
+	/* Function sends message, returns number of sent bytes of the message */
+	int (*send)(struct _msg_link_t *l, msg_t *msg, u16 seq);
+
+	/*
+	 * Optional, sends message with last len bytes of data taken from data without copying. Data are valid
+	 * during the call, ref (content cache entry) may be referenced by the transport using them later.
+	 */
+	int (*sendv)(struct _msg_link_t *l, msg_t *msg, u16 seq, const u8 *data, size_t len, void *ref);
+
+	/*
+	 * Function receives message without blocking, returns its length or 0 if it's not completed yet.
+	 * NULL for UDP peers, their datagrams are received by the server session.
+	 */
+	int (*recv)(struct _msg_link_t *l, msg_t *msg);
+
+	/* Function writes messages gathered by the link */
+	int (*flush)(struct _msg_link_t *l);
+} msg_ops_t;
+
+
+/* Connection to the target, state of the transport is kept by the link only */
+typedef struct _msg_link_t {
+	const msg_ops_t *ops;
+	int fd;
+	int fd_out; /* differs from fd for pipes */
+	msg_rx_t rx;
+	msg_tx_t tx;
+
+	/* UDP peers share socket and datagram batch of the server and reply to the peer address */
+	struct _msg_udpbatch_t *batch;
+	struct sockaddr_in peer;
+} msg_link_t;
+
+
 /* Macros for modifying message headers */
 #define msg_settype(m, t)  ((m)->type = ((m)->type & ~0xffff) | ((t) & 0xffff))
 #define msg_gettype(m)     ((m)->type & 0xffff)
 
-#define msg_setlen(m, l)   ((m)->type = ((m)->type & 0xffff) | ((l) << 16))
+#define msg_setlen(m, l)   ((m)->type = ((m)->type & 0xffff) | ((u32)(l) << 16))
 #define msg_getlen(m)      ((m)->type >> 16)
 
 #define msg_setcsum(m, c)  ((m)->csum = ((m)->csum & ~0xffff) | ((c) & 0xffff))
 #define msg_getcsum(m)     ((m)->csum & 0xffff)
 
-#define msg_setseq(m, s)   ((m)->csum = ((m)->csum & 0xffff) | ((s) << 16))
+#define msg_setseq(m, s)   ((m)->csum = ((m)->csum & 0xffff) | ((u32)(s) << 16))
 #define msg_getseq(m)      ((m)->csum >> 16)
 
-extern int msg_serial_send(int fd, msg_t *msg, u16 seq);
+extern const codec_t msg_codec;
+
+/* Transport of serial lines and pipes */
+extern const msg_ops_t msg_serial_ops;
+
+
+extern u32 msg_csum(msg_t *msg);
+
+/* Function computes checksum of message with last len bytes of data kept outside of msg */
+extern u32 msg_csumv(msg_t *msg, const u8 *data, size_t len);
+
+/*
+ * Function escapes message into buff (MSG_FRAMESZ long for MSG_MAXLEN) computing checksum on the way,
+ * returns start of the frame within buff and its length in *len
+ */
+extern u8 *msg_encode(msg_t *msg, u16 seq, u8 *buff, size_t *len);
+
+/*
+ * Function sets sequence number and checksum from sum of escaped part of the message following
+ * checksum field and escapes checksum field right before it, returns start of the frame
+ */
+extern u8 *msg_encodecsum(msg_t *msg, u16 seq, u32 sum, u8 *body);
+
+/* Function initializes receive context with sz bytes long buffer, longer than MSG_MAXLEN messages are dropped */
+extern int msg_rxinit(msg_rx_t *rx, unsigned int sz);
+
+extern void msg_rxdone(msg_rx_t *rx);
+
+/*
+ * Function decodes buffered data until frame is completed, returns frame length or 0 if buffer is exhausted.
+ * Checksum is verified while decoding, frames with bad checksum are dropped.
+ */
+extern int msg_rxdecode(msg_t *msg, msg_rx_t *rx);
+
+/* Function initializes transmit context with sz bytes long buffer */
+extern int msg_txinit(msg_tx_t *tx, unsigned int sz);
+
+extern void msg_txdone(msg_tx_t *tx);
+
+/*
+ * Function returns buffer for frame of at most len bytes at the end of gathered frames, gathered frames are
+ * written first if there is no space left. Returns NULL if frame doesn't fit into the empty buffer.
+ */
+extern u8 *msg_txbuff(int fd, msg_tx_t *tx, size_t len);
+
+/* Function gathers frame of len bytes placed in the buffer returned by msg_txbuff() */
+extern int msg_txadd(int fd, msg_tx_t *tx, u8 *frame, size_t len);
+
+/*
+ * Function writes pending and gathered frames followed by n (up to MSG_TXIOVMAX) iovecs without blocking,
+ * part not accepted by fd is kept pending. Returns error if it can't be kept.
+ */
+extern int msg_txwritev(int fd, msg_tx_t *tx, struct iovec *iov, int n);
+
+extern int msg_txflush(int fd, msg_tx_t *tx);
+
+/* Function discards gathered and pending frames (e.g. of dropped connection) */
+extern void msg_txdrop(msg_tx_t *tx);
+
+/* Function initializes link of the transport with receive and transmit buffers of rxsz and txsz bytes */
+extern int msg_linkinit(msg_link_t *l, const msg_ops_t *ops, unsigned int rxsz, unsigned int txsz);
+
+extern void msg_linkdone(msg_link_t *l);
+
+/* Function changes sizes of link buffers, gathered frames are written first and not decoded data are kept */
+extern int msg_linkresize(msg_link_t *l, unsigned int rxsz, unsigned int txsz);
+
+/* Function writes frames gathered by the link */
+extern int msg_linkflush(msg_link_t *l);
+
+/* Function returns nonzero if frames wait for the output of the link to become writable */
+extern int msg_linkpending(msg_link_t *l);
+
+extern int msg_serial_send(msg_link_t *l, msg_t *msg, u16 seq);
 
-extern int msg_serial_recv(int fd, msg_t *msg, int *state);
+/* Function receives message without blocking, returns 0 if message is not completed yet */
+extern int msg_serial_recv(msg_link_t *l, msg_t *msg);
 
 
 #endif
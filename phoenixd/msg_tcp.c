@@ -13,32 +13,66 @@
  * %LICENSE%
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <hostutils-common/errors.h>
 #include "msg_tcp.h"
 
 
-extern u32 msg_csum(msg_t *msg);
-
-
-int tcp_open(char *addrstr, unsigned int port)
+/* Function sends optional tunnel configuration string */
+static int tcp_configure(int sock)
 {
-	struct sockaddr_in server;
-	int sock;
-
-	size_t cfgLen = 0;
 	const char *cfgString = getenv("PHOENIXD_TCP");
+	size_t cfgLen = 0;
 
 	if (cfgString != NULL) {
 		cfgLen = strlen(cfgString);
 	}
 
+	if ((cfgLen > 0) && (send(sock, cfgString, cfgLen, 0) <= 0)) {
+		perror("Failed to send configuration");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Requests are short, so they aren't delayed by Nagle algorithm. Dead connections are detected by keepalive */
+static void tcp_setopts(int sock)
+{
+	int yes = 1;
+#ifdef TCP_KEEPIDLE
+	int idle = MSG_TCPKEEPIDLE, intvl = MSG_TCPKEEPINTVL, cnt = MSG_TCPKEEPCNT;
+#endif
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+#ifdef TCP_KEEPIDLE
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+}
+
+
+int tcp_open(char *addrstr, unsigned int port)
+{
+	struct sockaddr_in server;
+	int sock;
+
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
 		perror("Could not create socket");
@@ -51,119 +85,241 @@ int tcp_open(char *addrstr, unsigned int port)
 
 	if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
 		perror("Connect failed");
+		close(sock);
 		return -1;
 	}
 
-	/* Send optional tunnel configuration string */
-	if ((cfgLen > 0) && (send(sock, cfgString, cfgLen, 0) <= 0)) {
-		perror("Failed to send configuration");
+	if (tcp_configure(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	tcp_setopts(sock);
+
+	return sock;
+}
+
+
+int tcp_reconnect(char *addrstr, unsigned int port)
+{
+	struct sockaddr_in server;
+	int sock;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	server.sin_addr.s_addr = inet_addr(addrstr);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+
+	/* Socket stays non-blocking, written frames not accepted at once are kept by the link */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	if ((connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) && (errno != EINPROGRESS)) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+int tcp_connected(int sock)
+{
+	socklen_t len = sizeof(int);
+	int err;
+
+	if ((getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0)) {
+		return -1;
+	}
+
+	if (tcp_configure(sock) < 0) {
+		return -1;
+	}
+
+	tcp_setopts(sock);
+
+	return 0;
+}
+
+
+int tcp_listen(char *addrstr, unsigned int port)
+{
+	struct sockaddr_in server;
+	int sock, yes = 1;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("Could not create socket");
+		return -1;
+	}
+
+	server.sin_addr.s_addr = inet_addr(addrstr);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	if ((bind(sock, (struct sockaddr *)&server, sizeof(server)) < 0) || (listen(sock, SOMAXCONN) < 0)) {
+		perror("Listen failed");
 		close(sock);
 		return -1;
 	}
 
+	/* Pending connections are accepted until there are none */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
 	return sock;
 }
 
 
-int msg_tcp_send(int fd, msg_t *msg, u16 seq)
+int tcp_accept(int sock, struct sockaddr_in *peer, int nonblock)
 {
-	unsigned char buf[MSG_MAXLEN * 2 + MSG_HDRSZ * 2];
-	unsigned char *end = (unsigned char *)msg;
-	unsigned char *p = (unsigned char *)msg;
-	size_t i = 0;
+	socklen_t len = sizeof(*peer);
+	int fd;
 
-	msg_setseq(msg, seq);
-	msg_setcsum(msg, msg_csum(msg));
-	end += MSG_HDRSZ;
+#ifdef __linux__
+	if ((fd = accept4(sock, (struct sockaddr *)peer, &len, nonblock ? SOCK_NONBLOCK : 0)) < 0) {
+		return -1;
+	}
+#else
+	if ((fd = accept(sock, (struct sockaddr *)peer, &len)) < 0) {
+		return -1;
+	}
 
-	if (msg_getlen(msg) >= MSG_MAXLEN) {
+	if (nonblock) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+#endif
+
+	tcp_setopts(fd);
+
+	return fd;
+}
+
+
+/* Large messages don't fit on the stack, dispatcher is single threaded */
+static unsigned char buf[1 + 2 * (MSG_HDRSZ + MSG_LARGELEN)];
+
+
+int msg_tcp_send(msg_link_t *l, msg_t *msg, u16 seq)
+{
+	size_t i;
+	u8 *buff, *frame;
+
+	if (msg_getlen(msg) > MSG_LARGELEN) {
 		return ERR_MSG_ARG;
 	}
 
-	buf[i++] = MSG_MARK;
+	/* Frame is escaped in place among frames gathered for writing */
+	if ((buff = msg_txbuff(l->fd_out, &l->tx, 1 + 2 * (MSG_HDRSZ + msg_getlen(msg)))) == NULL) {
+		return ERR_MSG_IO;
+	}
 
-	end += msg_getlen(msg);
-	for (; p < end; p++) {
-		if ((*p == MSG_MARK) || (*p == MSG_ESC)) {
-			buf[i++] = MSG_ESC;
-			if (*p == MSG_MARK) {
-				buf[i++] = MSG_ESCMARK;
-			}
-			else {
-				buf[i++] = MSG_ESCESC;
-			}
+	frame = msg_encode(msg, seq, buff, &i);
+
+	if (msg_txadd(l->fd_out, &l->tx, frame, i) < 0) {
+		return ERR_MSG_IO;
+	}
+
+	return (int)(MSG_HDRSZ + msg_getlen(msg));
+}
+
+
+/*
+ * Function sends message with last len bytes of data taken from data. Frame is gathered from
+ * long runs of payload not requiring escaping sent in place and escaped rest kept in the frame buffer.
+ * Checksum is summed up during scanning and escaping, its field is escaped last in front of the frame.
+ */
+int msg_tcp_sendv(msg_link_t *l, msg_t *msg, u16 seq, const u8 *data, size_t len, void *ref)
+{
+	struct iovec iov[MSG_TCPIOVMAX];
+	size_t i, n, c, w, e;
+	u32 sum = 0;
+	u8 *frame;
+	int k;
+
+	if ((msg_getlen(msg) > MSG_LARGELEN) || (len > msg_getlen(msg))) {
+		return ERR_MSG_ARG;
+	}
+
+	w = MSG_CSUMOFFS + codec_encodesum(&msg_codec, buf + MSG_CSUMOFFS, (u8 *)&msg->type, sizeof(msg->type) + msg_getlen(msg) - len, &sum);
+	iov[0].iov_len = w - MSG_CSUMOFFS;
+	k = 1;
+
+	for (i = 0; i < len; i += n) {
+		n = c = codec_scansum(&msg_codec, data + i, len - i, &sum);
+
+		if ((n >= MSG_TCPZCMIN) && (k + 2 <= MSG_TCPIOVMAX)) {
+			iov[k].iov_base = (void *)(data + i);
+			iov[k++].iov_len = n;
+			iov[k].iov_base = buf + w;
+			iov[k++].iov_len = 0;
+			continue;
+		}
+
+		/* Escape short run with following special characters or the rest if iovec is full */
+		if (k + 2 > MSG_TCPIOVMAX) {
+			n = len - i;
 		}
 		else {
-			buf[i++] = *p;
+			while ((i + n < len) && ((data[i + n] == msg_codec.mark) || (data[i + n] == msg_codec.esc))) {
+				n++;
+			}
 		}
+
+		/* Clean run has been summed up already */
+		memcpy(buf + w, data + i, c);
+		e = c + codec_encodesum(&msg_codec, buf + w + c, data + i + c, n - c, &sum);
+		iov[k - 1].iov_len += e;
+		w += e;
 	}
 
-	if (send(fd, buf, i, 0) < 0) {
+	frame = msg_encodecsum(msg, seq, sum, buf + MSG_CSUMOFFS);
+	iov[0].iov_base = frame;
+	iov[0].iov_len += buf + MSG_CSUMOFFS - frame;
+
+	/* Data can't outlive the call, part not written at once with the gathered frames is copied to pending ones */
+	if (msg_txwritev(l->fd_out, &l->tx, iov, k) < 0) {
 		return ERR_MSG_IO;
 	}
 
-	return (int)(end - (unsigned char *)msg);
+	return (int)(MSG_HDRSZ + msg_getlen(msg));
 }
 
 
-int msg_tcp_recv(int fd, msg_t *msg, int *state)
+int msg_tcp_recv(msg_link_t *link, msg_t *msg)
 {
+	msg_rx_t *rx = &link->rx;
 	ssize_t r;
-	unsigned char c;
-	unsigned char *buf = (unsigned char *)msg;
-	int l = 0;
-	int escfl = 0;
+	int l;
 
 	for (;;) {
-		r = recv(fd, &c, 1, 0);
+		/* Segment may carry several frames, decode all of them before receiving more */
+		l = msg_rxdecode(msg, rx);
+		if (l > 0) {
+			break;
+		}
+
+		r = recv(link->fd, rx->buff, rx->sz, MSG_DONTWAIT);
 		if (r == 0) {
-			*state = MSGRECV_DESYN;
+			rx->state = MSGRECV_DESYN;
 			return ERR_MSG_CLOSED;
 		}
-		else if (r <= 0) {
-			*state = MSGRECV_DESYN;
+		else if (r < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+				return 0;
+			}
+			rx->state = MSGRECV_DESYN;
 			return ERR_MSG_IO;
 		}
-		else if (*state == MSGRECV_FRAME) {
-			/* Return error if frame is to long */
-			if (l == MSG_HDRSZ + MSG_MAXLEN) {
-				*state = MSGRECV_DESYN;
-				return ERR_MSG_IO;
-			}
 
-			/* Return error if terminator discovered */
-			if (c == MSG_MARK) {
-				return ERR_MSG_IO;
-			}
-
-			if ((escfl == 0) && (c == MSG_ESC)) {
-				escfl = 1;
-				continue;
-			}
-
-			if (escfl != 0) {
-				escfl = 0;
-				switch (c) {
-					case MSG_ESCMARK: c = MSG_MARK; break;
-					case MSG_ESCESC: c = MSG_ESC; break;
-					default: break;
-				}
-			}
-			buf[l++] = c;
-
-			/* Frame received */
-			if ((l >= MSG_HDRSZ) && (l == msg_getlen(msg) + MSG_HDRSZ)) {
-				*state = MSGRECV_DESYN;
-				break;
-			}
-		}
-		else {
-			/* Synchronize */
-			if (c == MSG_MARK) {
-				*state = MSGRECV_FRAME;
-			}
-		}
+		rx->rd = 0;
+		rx->wr = (unsigned int)r;
 	}
 
 	return l;
 }
+
+
+const msg_ops_t msg_tcp_ops = { msg_tcp_send, msg_tcp_sendv, msg_tcp_recv, msg_linkflush };
@@ -16,13 +16,42 @@
 #ifndef _MSG_TCP_H_
 #define _MSG_TCP_H_
 
+#include <netinet/in.h>
 #include <hostutils-common/types.h>
 #include "msg.h"
 
 #define PHFS_TCPPORT 18022
+/* Buffers of connections negotiating large messages */
+#define MSG_TCPRXBUFSZ (64 * 1024)
+#define MSG_TCPTXBUFSZ (1 + 2 * (MSG_HDRSZ + MSG_LARGELEN))
+
+/* Shorter clean runs of payload are escaped into the frame buffer instead of being sent in place */
+#define MSG_TCPZCMIN 512
+#define MSG_TCPIOVMAX 64
+
+/* Keepalive probes of idle connection (seconds) */
+#define MSG_TCPKEEPIDLE  10
+#define MSG_TCPKEEPINTVL 5
+#define MSG_TCPKEEPCNT   3
 
 extern int tcp_open(char *node, uint port);
-extern int msg_tcp_send(int fd, msg_t *msg, u16 seq);
-extern int msg_tcp_recv(int fd, msg_t *msg, int *state);
+
+/* Function starts connecting without blocking, connection is completed by tcp_connected() once fd is writable */
+extern int tcp_reconnect(char *node, uint port);
+
+extern int tcp_connected(int fd);
+
+/* Function opens socket accepting connections of targets without blocking */
+extern int tcp_listen(char *node, uint port);
+
+/* Function accepts connection, its socket is non-blocking if nonblock is set */
+extern int tcp_accept(int fd, struct sockaddr_in *peer, int nonblock);
+
+extern int msg_tcp_send(msg_link_t *l, msg_t *msg, u16 seq);
+extern int msg_tcp_sendv(msg_link_t *l, msg_t *msg, u16 seq, const u8 *data, size_t len, void *ref);
+extern int msg_tcp_recv(msg_link_t *l, msg_t *msg);
+
+/* Transport of TCP connections */
+extern const msg_ops_t msg_tcp_ops;
 
 #endif
@@ -13,16 +13,22 @@
  * %LICENSE%
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <netdb.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <hostutils-common/errors.h>
@@ -31,12 +37,6 @@
 
 #undef HEXDUMP
 
-static struct sockaddr_in addr;
-static socklen_t addrlen;
-
-
-extern u32 msg_csum(msg_t *msg);
-
 
 in_addr_t bcast_addr(in_addr_t in_addr)
 {
@@ -73,13 +73,14 @@ int udp_open(char *node, uint port)
 {
 	int fd, result, so_enable = 1;
 	struct addrinfo *servAddr;
-	struct sockaddr_in addr_in, bcast_in;
+	struct sockaddr_in addr_in;
 
 	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
 		return ERR_SERIAL_INIT;
 
 	if ((result = getaddrinfo(node, NULL, NULL, &servAddr)) != 0) {
 		fprintf(stderr, "Error opening %s:%d: %s\n", node, port, gai_strerror(result));
+		close(fd);
 		return result;
 	}
 
@@ -93,67 +94,186 @@ int udp_open(char *node, uint port)
 	result = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &so_enable, sizeof(so_enable));
 	result = bind(fd, (struct sockaddr *)&addr_in, sizeof(addr_in));
 
-	bcast_in.sin_addr.s_addr = bcast_addr(addr_in.sin_addr.s_addr);
-	bcast_in.sin_port = htons(PHFS_UDPPORT);
-	bcast_in.sin_family = addr_in.sin_family;
-
-	if (result < 0)
+	if (result < 0) {
+		close(fd);
 		return ERR_SERIAL_INIT;
-
-	if (!fork())
-	{
-		int bcastfd;
-		ssize_t len;
-		msg_t bcast_msg;
-		u8 buff[MSG_MAXLEN * 2 + MSG_HDRSZ * 2];
-		unsigned int i = 0;
-
-		memset(&bcast_msg, 0, sizeof(bcast_msg));
-		msg_settype(&bcast_msg, MSG_HELLO);
-		msg_setlen(&bcast_msg, sizeof(bcast_in));
-		memcpy(bcast_msg.data, &addr_in, sizeof(addr_in));
-		bcast_msg.csum = msg_csum(&bcast_msg);
-
-#ifdef PHFS_UDPENCODE
-		{
-			u8 *p = (u8 *)&bcast_msg, cs[2];
-			unsigned k;
-
-			cs[0] = MSG_MARK;
-
-			buff[i++] = cs[0];
-
-			for (k = 0; k < MSG_HDRSZ + msg_getlen(&bcast_msg); k++) {
-
-				if ((p[k] == MSG_MARK) || (p[k] == MSG_ESC)) {
-					cs[0] = MSG_ESC;
-					if (p[k] == MSG_MARK)
-						cs[1] = MSG_ESCMARK;
-					else
-						cs[1] = MSG_ESCESC;
-					memcpy(&buff[i], cs, 2);
-					i += 2;
-				}
-				else
-					buff[i++] = p[k];
-			}
-		}
-#else
-		i = MSG_HDRSZ + msg_getlen(&bcast_msg);
-		memcpy(buff, &bcast_msg, i);
-#endif
-		bcastfd = dup(fd);
-		setsockopt(bcastfd, SOL_SOCKET, SO_BROADCAST, &so_enable, sizeof(so_enable));
-		for (;;) {
-			if ((len = sendto(bcastfd, buff, i, MSG_DONTROUTE, (struct sockaddr *)&bcast_in, sizeof(bcast_in))) < 0)
-				return ERR_MSG_IO;
-			sleep(3);
-		}
 	}
+
 	return fd;
 }
 
 
+/* Function collects addresses of host interfaces, server receives its own broadcasts from them */
+static void msg_udp_locals(msg_udpannounce_t *a)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	a->nlocal = 0;
+	if (getifaddrs(&ifaddr) < 0)
+		return;
+
+	for (ifa = ifaddr; (ifa != NULL) && (a->nlocal < MSG_UDPLOCALMAX); ifa = ifa->ifa_next) {
+		if ((ifa->ifa_addr != NULL) && (ifa->ifa_addr->sa_family == AF_INET))
+			a->local[a->nlocal++] = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+	}
+	freeifaddrs(ifaddr);
+}
+
+
+static int msg_udp_islocal(const msg_udpannounce_t *a, in_addr_t addr)
+{
+	unsigned int i;
+
+	if ((ntohl(addr) >> 24) == IN_LOOPBACKNET)
+		return 1;
+
+	for (i = 0; i < a->nlocal; i++) {
+		if (a->local[i] == addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+int msg_udp_own(const msg_udpannounce_t *a, const struct sockaddr_in *from)
+{
+	if (from->sin_port != a->addr.sin_port)
+		return 0;
+
+	return (from->sin_addr.s_addr == a->addr.sin_addr.s_addr) || msg_udp_islocal(a, from->sin_addr.s_addr);
+}
+
+
+int msg_udp_announceinit(msg_udpannounce_t *a, int fd)
+{
+	socklen_t addrlen = sizeof(a->addr);
+	int so_enable = 1;
+
+	memset(a, 0, sizeof(*a));
+	a->fd = -1;
+
+	if (getsockname(fd, (struct sockaddr *)&a->addr, &addrlen) < 0)
+		return ERR_MSG_IO;
+
+	msg_udp_locals(a);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &so_enable, sizeof(so_enable)) < 0)
+		return ERR_MSG_IO;
+
+	a->bcast.sin_family = AF_INET;
+	a->bcast.sin_port = htons(PHFS_UDPPORT);
+	a->bcast.sin_addr.s_addr = bcast_addr(a->addr.sin_addr.s_addr);
+
+	/* Probes broadcast by targets aren't received by socket bound to the unicast address */
+	if ((a->bcast.sin_addr.s_addr == 0) || (a->bcast.sin_addr.s_addr == INADDR_BROADCAST)) {
+		a->bcast.sin_addr.s_addr = INADDR_BROADCAST;
+		return 0;
+	}
+
+	if ((a->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return ERR_MSG_IO;
+
+	a->probe = a->addr;
+	a->probe.sin_addr = a->bcast.sin_addr;
+
+	if ((setsockopt(a->fd, SOL_SOCKET, SO_REUSEADDR, &so_enable, sizeof(so_enable)) < 0) ||
+			(bind(a->fd, (struct sockaddr *)&a->probe, sizeof(a->probe)) < 0)) {
+		close(a->fd);
+		a->fd = -1;
+		return ERR_MSG_IO;
+	}
+
+	return 0;
+}
+
+
+void msg_udp_announcedone(msg_udpannounce_t *a)
+{
+	if (a->fd >= 0)
+		close(a->fd);
+	a->fd = -1;
+}
+
+
+/* Function sends server address and maximal message length to the target (or broadcast address) */
+static int msg_udp_hello(msg_udpannounce_t *a, int fd, const struct sockaddr_in *to, u16 seq)
+{
+	msg_t msg;
+	size_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg_settype(&msg, MSG_HELLO);
+	msg_setlen(&msg, sizeof(a->addr) + sizeof(u32));
+	memcpy(msg.data, &a->addr, sizeof(a->addr));
+	*(u32 *)&msg.data[sizeof(a->addr)] = MSG_LARGELEN;
+	msg_setseq(&msg, seq);
+	msg_setcsum(&msg, msg_csum(&msg));
+
+	len = MSG_HDRSZ + msg_getlen(&msg);
+	if (sendto(fd, &msg, len, MSG_DONTROUTE, (const struct sockaddr *)to, sizeof(*to)) < 0)
+		return ERR_MSG_IO;
+
+	return len;
+}
+
+
+unsigned int msg_udp_announce(msg_udpannounce_t *a, int fd, unsigned long long now)
+{
+	unsigned int period;
+
+	if (now >= a->next) {
+		msg_udp_hello(a, fd, &a->bcast, 0);
+
+		/* Burst while targets are booting together with the server, then back off */
+		period = MSG_UDPANNFAST;
+		if (a->n >= MSG_UDPANNBURST)
+			period <<= (a->n - MSG_UDPANNBURST + 1 < 8) ? a->n - MSG_UDPANNBURST + 1 : 8;
+		if (period > MSG_UDPANNMAX)
+			period = MSG_UDPANNMAX;
+
+		a->n++;
+		a->next = now + period;
+	}
+
+	return a->next - now;
+}
+
+
+int msg_udp_probe(msg_udpannounce_t *a, int fd)
+{
+	struct sockaddr_in peer;
+	socklen_t addrlen;
+	msg_t msg;
+	ssize_t len;
+	int n = 0;
+
+	if (a->fd < 0)
+		return 0;
+
+	for (;;) {
+		addrlen = sizeof(peer);
+		if ((len = recvfrom(a->fd, &msg, sizeof(msg), MSG_DONTWAIT, (struct sockaddr *)&peer, &addrlen)) < 0)
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? n : ERR_MSG_IO;
+
+		if ((len < MSG_HDRSZ) || (len < MSG_HDRSZ + msg_getlen(&msg)) || (msg_getcsum(&msg) != (u16)msg_csum(&msg)) ||
+				(msg_gettype(&msg) != MSG_HELLO))
+			continue;
+
+		/*
+		 * Probe carries requested message length and flags at most, longer MSG_HELLO is an announcement.
+		 * Targets on the host (e.g. QEMU user networking) probe from its addresses, but not from the server port.
+		 */
+		if ((msg_getlen(&msg) > 2 * sizeof(u32)) || msg_udp_own(a, &peer))
+			continue;
+
+		/* Reply comes from the server socket, so target learns address of the server from the source too */
+		if (msg_udp_hello(a, fd, &peer, msg_getseq(&msg)) > 0)
+			n++;
+	}
+}
+
+
 #ifdef HEXDUMP
 static void hex_dump(void *data, int size)
 {
@@ -209,48 +329,285 @@ static void hex_dump(void *data, int size)
 #endif
 
 
-int msg_udp_send(int fd, msg_t *msg, u16 seq)
+int msg_udp_batchinit(msg_udpbatch_t *b)
 {
-	unsigned int k;
-	u8 buff[MSG_MAXLEN * 2 + MSG_HDRSZ * 2];
-	ssize_t len;
-	unsigned int i = 0;
+	const char *env = getenv("PHOENIXD_UDPBATCH");
+
+	memset(b, 0, sizeof(*b));
+
+	b->size = MSG_UDPBATCH;
+	if ((env != NULL) && (atoi(env) > 0) && (atoi(env) <= MSG_UDPBATCH))
+		b->size = atoi(env);
+
+#ifdef UDP_SEGMENT
+	b->gso = 1;
+#endif
+
+	if (((b->rxbuf = malloc(b->size * MSG_LARGESZ)) == NULL) || ((b->txbuf = malloc(MSG_UDPTXBUFSZ)) == NULL)) {
+		msg_udp_batchdone(b);
+		return ERR_MEM;
+	}
+
+	return 0;
+}
 
-	msg_setseq(msg, seq);
-	msg_setcsum(msg, msg_csum(msg));
 
-	if (msg_getlen(msg) > MSG_MAXLEN)
+void msg_udp_batchdone(msg_udpbatch_t *b)
+{
+	free(b->rxbuf);
+	free(b->txbuf);
+	b->rxbuf = NULL;
+	b->txbuf = NULL;
+}
+
+
+/* Function sends single datagram, segments of the failed GSO datagram are sent this way */
+static void msg_udp_sendone(int fd, const u8 *buff, size_t len, const struct sockaddr_in *peer)
+{
+	while ((sendto(fd, buff, len, 0, (const struct sockaddr *)peer, sizeof(*peer)) < 0) && (errno == EINTR))
+		;
+}
+
+
+#ifdef __linux__
+
+/* Messages sent by one sendmmsg() call */
+typedef struct {
+	struct mmsghdr hdr[MSG_UDPBATCH];
+	struct iovec iov[MSG_UDPBATCH];
+	unsigned int cnt[MSG_UDPBATCH];
+	u8 cmsg[MSG_UDPBATCH][CMSG_SPACE(sizeof(u16))];
+} msg_udptx_t;
+
+
+/*
+ * Function prepares k-th message sending queued datagrams starting from i-th one. Datagrams of equal length
+ * sent to the same peer are sent as one GSO buffer, returns number of datagrams in the message. Longer datagrams
+ * (e.g. large messages) are sent one by one, kernel rejects GSO segments exceeding MTU of the path.
+ */
+static unsigned int msg_udp_group(msg_udpbatch_t *b, msg_udptx_t *tx, unsigned int i, unsigned int k)
+{
+	struct msghdr *mh = &tx->hdr[k].msg_hdr;
+	unsigned int n = 1, len = b->txlen[i], total = len;
+#ifdef UDP_SEGMENT
+	struct cmsghdr *cm;
+#endif
+
+	memset(mh, 0, sizeof(*mh));
+	mh->msg_name = &b->txaddr[i];
+	mh->msg_namelen = sizeof(b->txaddr[i]);
+	mh->msg_iov = &tx->iov[k];
+	mh->msg_iovlen = 1;
+	tx->iov[k].iov_base = b->txbuf + b->txoffs[i];
+
+#ifdef UDP_SEGMENT
+	/* Segments are consecutive in the buffer, only the last one can be shorter */
+	while (b->gso && (len <= MSG_UDPGSOSEG) && (i + n < b->txn) && (n < MSG_UDPGSOSEGS) && (b->txlen[i + n - 1] == len) &&
+			(b->txlen[i + n] <= len) && (total + b->txlen[i + n] <= MSG_UDPGSOMAX) &&
+			(b->txaddr[i + n].sin_addr.s_addr == b->txaddr[i].sin_addr.s_addr) && (b->txaddr[i + n].sin_port == b->txaddr[i].sin_port)) {
+		total += b->txlen[i + n];
+		n++;
+	}
+
+	if (n > 1) {
+		mh->msg_control = tx->cmsg[k];
+		mh->msg_controllen = CMSG_SPACE(sizeof(u16));
+		cm = CMSG_FIRSTHDR(mh);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(u16));
+		*(u16 *)CMSG_DATA(cm) = len;
+	}
+#endif
+
+	tx->iov[k].iov_len = total;
+	tx->cnt[k] = n;
+
+	return n;
+}
+
+
+int msg_udp_flush(int fd, msg_udpbatch_t *b)
+{
+	msg_udptx_t tx;
+	unsigned int i, k, n, j, first;
+	int r;
+
+	for (i = 0, n = 0; i < b->txn; n++)
+		i += msg_udp_group(b, &tx, i, n);
+
+	for (k = 0, first = 0; k < n;) {
+		if ((r = sendmmsg(fd, &tx.hdr[k], n - k, 0)) > 0) {
+			for (; r > 0; r--)
+				first += tx.cnt[k++];
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		/* Datagram is lost, target sends the request again. GSO isn't supported on the path (e.g. lower MTU) */
+		if (tx.cnt[k] > 1) {
+			for (j = first; j < first + tx.cnt[k]; j++)
+				msg_udp_sendone(fd, b->txbuf + b->txoffs[j], b->txlen[j], &b->txaddr[j]);
+		}
+		first += tx.cnt[k++];
+	}
+
+	b->txn = 0;
+	b->txused = 0;
+
+	return 0;
+}
+
+
+static int msg_udp_fill(int fd, msg_udpbatch_t *b)
+{
+	struct mmsghdr hdr[MSG_UDPBATCH];
+	struct iovec iov[MSG_UDPBATCH];
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < b->size; i++) {
+		iov[i].iov_base = b->rxbuf + i * MSG_LARGESZ;
+		iov[i].iov_len = MSG_LARGESZ;
+		memset(&hdr[i].msg_hdr, 0, sizeof(hdr[i].msg_hdr));
+		hdr[i].msg_hdr.msg_name = &b->rxaddr[i];
+		hdr[i].msg_hdr.msg_namelen = sizeof(b->rxaddr[i]);
+		hdr[i].msg_hdr.msg_iov = &iov[i];
+		hdr[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((r = recvmmsg(fd, hdr, b->size, MSG_DONTWAIT, NULL)) < 0)
+		return r;
+
+	for (i = 0; i < r; i++)
+		b->rxlen[i] = (hdr[i].msg_hdr.msg_flags & MSG_TRUNC) ? MSG_LARGESZ + 1 : hdr[i].msg_len;
+
+	return r;
+}
+
+#else
+
+int msg_udp_flush(int fd, msg_udpbatch_t *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->txn; i++)
+		msg_udp_sendone(fd, b->txbuf + b->txoffs[i], b->txlen[i], &b->txaddr[i]);
+
+	b->txn = 0;
+	b->txused = 0;
+
+	return 0;
+}
+
+
+static int msg_udp_fill(int fd, msg_udpbatch_t *b)
+{
+	socklen_t addrlen = sizeof(b->rxaddr[0]);
+	ssize_t r;
+
+	if ((r = recvfrom(fd, b->rxbuf, MSG_LARGESZ, MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&b->rxaddr[0], &addrlen)) < 0)
+		return -1;
+
+	b->rxlen[0] = r;
+	return 1;
+}
+
+#endif
+
+
+int msg_udp_queue(int fd, msg_udpbatch_t *b, msg_t *msg, u16 seq, const u8 *data, size_t len, const struct sockaddr_in *peer)
+{
+	size_t i;
+
+	if ((msg_getlen(msg) > MSG_LARGELEN) || (len > msg_getlen(msg)))
 		return ERR_MSG_ARG;
 
+	msg_setseq(msg, seq);
+	msg_setcsum(msg, msg_csumv(msg, data, len));
+
 	i = MSG_HDRSZ + msg_getlen(msg);
-	memcpy(buff, msg, i);
-	k = i;
+
+	if ((b->txn == b->size) || (b->txused + i > MSG_UDPTXBUFSZ))
+		msg_udp_flush(fd, b);
+
+	/* Data may be mapped file, it's copied first, so failed access doesn't leave half queued datagram */
+	if (len != 0)
+		memcpy(b->txbuf + b->txused + i - len, data, len);
+	memcpy(b->txbuf + b->txused, msg, i - len);
 
 #ifdef HEXDUMP
-	hex_dump(buff, i);
+	hex_dump(b->txbuf + b->txused, i);
 #endif
-	if ((len = sendto(fd, buff, i, 0, (struct sockaddr *)&addr, addrlen)) < 0)
-		return ERR_MSG_IO;
 
-	if (len < i)
-		return ERR_MSG_IO;
+	b->txoffs[b->txn] = b->txused;
+	b->txlen[b->txn] = i;
+	b->txaddr[b->txn++] = *peer;
+	b->txused += i;
 
-	return k;
+	return i;
 }
 
 
-int msg_udp_recv(int fd, msg_t *msg, int *state)
+static int msg_udp_send(msg_link_t *l, msg_t *msg, u16 seq)
 {
-	u8 buff[2 * sizeof(msg_t)];
-	ssize_t bufflen;
+	return msg_udp_queue(l->fd_out, l->batch, msg, seq, NULL, 0, &l->peer);
+}
+
+
+static int msg_udp_sendv(msg_link_t *l, msg_t *msg, u16 seq, const u8 *data, size_t len, void *ref)
+{
+	return msg_udp_queue(l->fd_out, l->batch, msg, seq, data, len, &l->peer);
+}
+
+
+static int msg_udp_linkflush(msg_link_t *l)
+{
+	return msg_udp_flush(l->fd_out, l->batch);
+}
 
-	addrlen = sizeof(addr);
-	if ((bufflen = recvfrom(fd, buff, sizeof(buff), 0, (struct sockaddr *)&addr, &addrlen)) < 0) {
-		*state = MSGRECV_DESYN;
-		return ERR_MSG_IO;
-	}
 
+const msg_ops_t msg_udp_ops = { msg_udp_send, msg_udp_sendv, NULL, msg_udp_linkflush };
 
-	memcpy(msg, buff, bufflen);
-	return bufflen;
+
+int msg_udp_recv(msg_link_t *l, msg_t **msg, struct sockaddr_in *peer)
+{
+	msg_udpbatch_t *b = l->batch;
+	msg_rx_t *rx = &l->rx;
+	int fd = l->fd;
+	unsigned int len;
+	int r;
+
+	for (;;) {
+		if (b->rxi == b->rxn) {
+			/* Replies to the received batch are sent before waiting for the next one */
+			msg_udp_flush(fd, b);
+
+			b->rxi = 0;
+			b->rxn = 0;
+			if ((r = msg_udp_fill(fd, b)) < 0) {
+				rx->state = MSGRECV_DESYN;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+					return 0;
+				return ERR_MSG_IO;
+			}
+			b->rxn = r;
+			continue;
+		}
+
+		*msg = (msg_t *)(b->rxbuf + b->rxi * MSG_LARGESZ);
+		*peer = b->rxaddr[b->rxi];
+		len = b->rxlen[b->rxi++];
+
+		/* Drop datagrams which can't be a message or are corrupted */
+		if ((len < MSG_HDRSZ) || (len > MSG_HDRSZ + rx->maxlen) || (len < MSG_HDRSZ + msg_getlen(*msg)) ||
+				(msg_getcsum(*msg) != (u16)msg_csum(*msg))) {
+			rx->errors++;
+			continue;
+		}
+
+		return len;
+	}
 }
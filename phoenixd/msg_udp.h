@@ -16,13 +16,104 @@
 #ifndef _MSG_UDP_H_
 #define _MSG_UDP_H_
 
+#include <netinet/in.h>
 #include <hostutils-common/types.h>
 #include "msg.h"
 
 #define PHFS_UDPPORT 11520
 
+/* Maximal number of datagrams received by one system call (default, PHOENIXD_UDPBATCH sets less) */
+#define MSG_UDPBATCH 32
+
+/* Datagrams queued for sending by one system call */
+#define MSG_UDPTXBUFSZ (1024 * 1024)
+
+/* Limits of datagrams sent as one GSO buffer, segments have to fit Ethernet MTU (1500 - IP and UDP headers) */
+#define MSG_UDPGSOSEGS 64
+#define MSG_UDPGSOMAX  65000
+#define MSG_UDPGSOSEG  1472
+
+
+/* Datagrams received and sent in batches */
+typedef struct _msg_udpbatch_t {
+	unsigned int size;
+	int gso;
+
+	u8 *rxbuf; /* received datagrams, MSG_LARGESZ bytes each */
+	struct sockaddr_in rxaddr[MSG_UDPBATCH];
+	unsigned int rxlen[MSG_UDPBATCH];
+	unsigned int rxn;
+	unsigned int rxi;
+
+	/* Queued datagrams are copied one after another into txbuf */
+	u8 *txbuf;
+	size_t txused;
+	unsigned int txn;
+	size_t txoffs[MSG_UDPBATCH];
+	unsigned int txlen[MSG_UDPBATCH];
+	struct sockaddr_in txaddr[MSG_UDPBATCH];
+} msg_udpbatch_t;
+
+
+/* Server announcements: MSG_UDPANNBURST announcements every MSG_UDPANNFAST ms, then backing off to MSG_UDPANNMAX ms */
+#define MSG_UDPANNFAST  100
+#define MSG_UDPANNBURST 10
+#define MSG_UDPANNMAX   3000
+
+
+/* Number of host interface addresses recognized as sources of own datagrams */
+#define MSG_UDPLOCALMAX 16
+
+
+/* Discovery of the server by targets */
+typedef struct {
+	int fd;                   /* socket receiving probes broadcast by targets, -1 if there is no broadcast address */
+	struct sockaddr_in addr;  /* announced server address */
+	in_addr_t local[MSG_UDPLOCALMAX]; /* addresses of host interfaces */
+	unsigned int nlocal;
+	struct sockaddr_in bcast; /* destination of announcements */
+	struct sockaddr_in probe; /* destination of probes */
+	unsigned int n;
+	unsigned long long next;  /* time of the next announcement (ms) */
+} msg_udpannounce_t;
+
+
 extern int udp_open(char *node, uint port);
-extern int msg_udp_send(int fd, msg_t *msg, u16 seq);
-extern int msg_udp_recv(int fd, msg_t *msg, int *state);
+
+/* Function prepares announcements of the server bound to fd and opens socket receiving probes */
+extern int msg_udp_announceinit(msg_udpannounce_t *a, int fd);
+
+extern void msg_udp_announcedone(msg_udpannounce_t *a);
+
+/* Function broadcasts announcement if it's due at now (ms), returns time to the next announcement (ms) */
+extern unsigned int msg_udp_announce(msg_udpannounce_t *a, int fd, unsigned long long now);
+
+/*
+ * Function answers MSG_HELLO probes of targets immediately, returns number of answered probes. Announcements
+ * (of this or other server) and datagrams of the server socket itself aren't answered.
+ */
+extern int msg_udp_probe(msg_udpannounce_t *a, int fd);
+
+/* Function returns nonzero if datagram comes from the server socket or other socket bound to its port on the host */
+extern int msg_udp_own(const msg_udpannounce_t *a, const struct sockaddr_in *from);
+
+extern int msg_udp_batchinit(msg_udpbatch_t *b);
+
+extern void msg_udp_batchdone(msg_udpbatch_t *b);
+
+/* Function queues message with last len bytes of data taken from data, queue is sent by msg_udp_flush() */
+extern int msg_udp_queue(int fd, msg_udpbatch_t *b, msg_t *msg, u16 seq, const u8 *data, size_t len, const struct sockaddr_in *peer);
+
+/* Function sends queued datagrams, datagrams of equal length sent to the same peer are segmented by GSO */
+extern int msg_udp_flush(int fd, msg_udpbatch_t *b);
+
+/*
+ * Function returns next datagram received by the server link from any peer in msg and its address in peer.
+ * Datagrams are received in batches, queued datagrams are sent before receiving the next batch.
+ */
+extern int msg_udp_recv(msg_link_t *l, msg_t **msg, struct sockaddr_in *peer);
+
+/* Transport of UDP peers, datagrams are queued in the batch of the server link */
+extern const msg_ops_t msg_udp_ops;
 
 #endif
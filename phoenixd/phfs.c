@@ -17,21 +17,190 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/resource.h>
 
 #include <hostutils-common/errors.h>
 #include "dispatch.h"
 #include "msg.h"
 #include "phfs.h"
+#include "cache.h"
+#include "lzcache.h"
+#include "hashcache.h"
+#include "log.h"
 
 
-int phfs_open(int fd, msg_t *msg, char *sysdir)
+/* Function stores opened file in the session handle table, returns handle or 0 */
+static u32 phfs_hadd(session_t *s, int ofd, cache_entry_t *entry)
+{
+	unsigned int h, n;
+	phfs_handle_t *handles;
+
+	for (h = 0; h < s->nhandles; h++) {
+		if ((s->handles[h].fd < 0) && (s->handles[h].entry == NULL))
+			break;
+	}
+
+	if (h == s->nhandles) {
+		n = (s->nhandles != 0) ? 2 * s->nhandles : 16;
+		if ((handles = realloc(s->handles, n * sizeof(phfs_handle_t))) == NULL)
+			return 0;
+
+		for (h = s->nhandles; h < n; h++) {
+			handles[h].fd = -1;
+			handles[h].entry = NULL;
+		}
+
+		h = s->nhandles;
+		s->handles = handles;
+		s->nhandles = n;
+	}
+
+	s->handles[h].fd = ofd;
+	s->handles[h].entry = entry;
+	return h + 1;
+}
+
+
+/* Function returns opened file of the handle or NULL if handle is invalid */
+static phfs_handle_t *phfs_hget(session_t *s, u32 h)
+{
+	if ((h == 0) || (h > s->nhandles))
+		return NULL;
+
+	if ((s->handles[h - 1].fd < 0) && (s->handles[h - 1].entry == NULL))
+		return NULL;
+
+	return &s->handles[h - 1];
+}
+
+
+static void phfs_hfree(phfs_handle_t *hd)
+{
+	if (hd->entry != NULL)
+		cache_put(hd->entry);
+	else
+		close(hd->fd);
+
+	hd->fd = -1;
+	hd->entry = NULL;
+}
+
+
+static ssize_t phfs_pread(phfs_handle_t *hd, void *buff, size_t len, off_t pos)
+{
+	if (hd == NULL)
+		return -1;
+
+	if (hd->entry != NULL)
+		return cache_read(hd->entry, buff, len, pos);
+
+	return pread(hd->fd, buff, len, pos);
+}
+
+
+/*
+ * Function reads l bytes of file at pos for MSG_READ or MSG_STREAM reply, *dlen is set to length of the reply
+ * data, which is shorter than io->len if data have been compressed. Returns mapped or compressed data if reply
+ * can be sent by session_sendv() directly from the content cache, NULL if data have been read into io->buff.
+ */
+static const u8 *phfs_iodata(session_t *s, phfs_handle_t *hd, msg_phfsio_t *io, u32 pos, u32 l, u32 *dlen)
+{
+	const lzcache_block_t *b;
+	const u8 *data;
+	size_t n = l;
+
+	if ((hd != NULL) && (hd->entry != NULL)) {
+		data = cache_map(hd->entry, pos, &n);
+
+		if (s->lz && (n >= PHFS_LZMIN) && ((b = lzcache_get(hd->entry, pos, n, n - 1)) != NULL)) {
+			io->len = n;
+			*dlen = b->clen;
+			if (session_zerocopy(s))
+				return b->data;
+
+			memcpy(io->buff, b->data, b->clen);
+			return NULL;
+		}
+
+		if (session_zerocopy(s)) {
+			io->len = n;
+			*dlen = n;
+			return data;
+		}
+	}
+
+	io->len = phfs_pread(hd, io->buff, l, pos);
+	*dlen = (io->len > 0) ? io->len : 0;
+	return NULL;
+}
+
+
+typedef struct {
+	session_t *s;
+	msg_t *msg;
+	u16 seq;
+	const u8 *data;
+	size_t len;
+	cache_entry_t *entry;
+} phfs_sendarg_t;
+
+
+static int phfs_sendmapped(void *arg)
+{
+	phfs_sendarg_t *a = arg;
+
+	return session_sendv(a->s, a->msg, a->seq, a->data, a->len, a->entry);
+}
+
+
+/* Function sends reply prepared by phfs_iodata() */
+static int phfs_iosend(session_t *s, msg_t *msg, u16 seq, phfs_handle_t *hd, const u8 *data, u32 pos)
+{
+	msg_phfsio_t *io = (msg_phfsio_t *)msg->data;
+	phfs_sendarg_t a = { s, msg, seq, data, msg_getlen(msg) - (u32)((u8 *)io->buff - (u8 *)io), hd->entry };
+
+	if (data == NULL)
+		return session_send(s, msg, seq);
+
+	if (cache_guard(hd->entry, phfs_sendmapped, &a) >= 0)
+		return 0;
+
+	if (errno != EFAULT)
+		return ERR_PHFS_IO;
+
+	/* File has been truncated on the host, reply as to failed read */
+	io->pos = pos;
+	io->len = -1;
+	msg_setlen(msg, (u32)((u8 *)io->buff - (u8 *)io));
+
+	return session_send(s, msg, seq);
+}
+
+
+void phfs_release(session_t *s)
+{
+	unsigned int h;
+
+	for (h = 0; h < s->nhandles; h++) {
+		if ((s->handles[h].fd >= 0) || (s->handles[h].entry != NULL))
+			phfs_hfree(&s->handles[h]);
+	}
+
+	free(s->handles);
+	s->handles = NULL;
+	s->nhandles = 0;
+	s->stream.handle = 0;
+}
+
+
+int phfs_open(session_t *s, msg_t *msg, char *sysdir)
 {
 	char *path = (char *)&msg->data[sizeof(u32)], *realpath;
-	int flags = *(u32 *)msg->data, f = 0, ofd;
+	int flags = *(u32 *)msg->data, f = 0, ofd = -1;
+	cache_entry_t *entry = NULL;
 	u16 seq = msg_getseq(msg);
 
 	msg->data[MSG_MAXLEN - 1] = 0;
@@ -47,70 +216,84 @@ int phfs_open(int fd, msg_t *msg, char *sysdir)
 	else {
 		sprintf(realpath, "%s/%s", sysdir, path);
 
-		if (flags == PHFS_RDONLY)
-			ofd = open(realpath, f);
+		/* Read-only regular files are served from the content cache shared by all sessions */
+		if (flags == PHFS_RDONLY) {
+			if ((entry = cache_get(realpath)) == NULL)
+				ofd = open(realpath, f);
+		}
 		else
 			ofd = open(realpath, f, S_IRUSR | S_IWUSR);
 
-		printf("[%d] phfs: %s path='%s', realpath='%s', ofd=%d\n", getpid(), ((f & O_CREAT) == O_CREAT) ? "MSG_CREATE" : "MSG_OPEN", path, realpath, ofd);
-		*(u32 *)msg->data = ofd > 0 ? ofd : 0;
+		log_debug(LOG_PHFS, "%s path='%s', realpath='%s', ofd=%d%s", ((f & O_CREAT) == O_CREAT) ? "MSG_CREATE" : "MSG_OPEN", path, realpath, ofd, (entry != NULL) ? " (cached)" : "");
+		*(u32 *)msg->data = 0;
+		if ((ofd >= 0) || (entry != NULL)) {
+			if ((*(u32 *)msg->data = phfs_hadd(s, ofd, entry)) == 0) {
+				if (entry != NULL)
+					cache_put(entry);
+				else
+					close(ofd);
+			}
+		}
 		free(realpath);
 	}
 
-	if (msg_send(fd, msg, seq) < 0)
+	if (session_send(s, msg, seq) < 0)
 		return ERR_PHFS_IO;
 	return 1;
 }
 
 
-int phfs_read(int fd, msg_t *msg, char *sysdir)
+int phfs_read(session_t *s, msg_t *msg, char *sysdir)
 {
 	msg_phfsio_t *io = (msg_phfsio_t *)msg->data;
 	u16 seq = msg_getseq(msg);
 	u32 hdrsz;
-	u32 l, pos, len;
+	u32 l, pos, len, dlen;
+	phfs_handle_t *hd = phfs_hget(s, io->handle);
+	const u8 *data;
 
 	hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
-	if (io->len > MSG_MAXLEN - hdrsz)
-		io->len = MSG_MAXLEN - hdrsz;
+	if (io->len > s->link.rx.maxlen - hdrsz)
+		io->len = s->link.rx.maxlen - hdrsz;
 
 	len = io->len;
 	pos = io->pos;
-	lseek(io->handle, io->pos, SEEK_SET);
-	io->len = read(io->handle, io->buff, io->len);
+	data = phfs_iodata(s, hd, io, pos, len, &dlen);
 
 	l = (io->len > 0) ? io->len : 0;
 	io->pos += l;
 
-	printf("[%d] phfs: MSG_READ ofd=%d, pos=%d, len=%d, ret=%d\n",
-		getpid(), io->handle, pos, len, io->len);
+	log_debug(LOG_PHFS, "MSG_READ ofd=%d, pos=%d, len=%d, ret=%d%s",
+		io->handle, pos, len, io->len, (dlen < l) ? " (compressed)" : "");
 
 	msg_settype(msg, MSG_READ);
-	msg_setlen(msg, l + hdrsz);
+	msg_setlen(msg, dlen + hdrsz);
 
-	if (msg_send(fd, msg, seq) < 0)
+	if (phfs_iosend(s, msg, seq, hd, data, pos) < 0)
 		return ERR_PHFS_IO;
 
 	return 1;
 }
 
 
-int phfs_write(int fd, msg_t *msg, char *sysdir)
+int phfs_write(session_t *s, msg_t *msg, char *sysdir)
 {
 	msg_phfsio_t *io = (msg_phfsio_t *)msg->data;
 	u32 hdrsz, l;
 	u16 seq = msg_getseq(msg);
+	phfs_handle_t *hd = phfs_hget(s, io->handle);
+	int ofd = (hd != NULL) ? hd->fd : -1;
 
 	hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
 
-	if (io->len > MSG_MAXLEN - hdrsz)
-		io->len = MSG_MAXLEN - hdrsz;
+	if (io->len > s->link.rx.maxlen - hdrsz)
+		io->len = s->link.rx.maxlen - hdrsz;
 
-	lseek(io->handle, io->pos, SEEK_SET);
-	io->len = write(io->handle, io->buff, io->len);
+	lseek(ofd, io->pos, SEEK_SET);
+	io->len = write(ofd, io->buff, io->len);
 
-	printf("[%d] phfs: MSG_WRITE fd=%d, pos=%d, ret=%d\n",
-		getpid(), io->handle, io->pos, io->len);
+	log_debug(LOG_PHFS, "MSG_WRITE fd=%d, pos=%d, ret=%d",
+		io->handle, io->pos, io->len);
 
 	l = (io->len > 0) ? io->len : 0;
 	io->pos += l;
@@ -118,65 +301,70 @@ int phfs_write(int fd, msg_t *msg, char *sysdir)
 	msg_settype(msg, MSG_WRITE);
 	msg_setlen(msg, l + hdrsz);
 
-	if (msg_send(fd, msg, seq) < 0)
+	if (session_send(s, msg, seq) < 0)
 		return ERR_PHFS_IO;
 
 	return 1;
 }
 
 
-int phfs_close(int fd, msg_t *msg, char *sysdir)
+int phfs_close(session_t *s, msg_t *msg, char *sysdir)
 {
-	int ofd = *(int *)msg->data;
+	u32 h = *(u32 *)msg->data;
+	phfs_handle_t *hd = phfs_hget(s, h);
 	u16 seq = msg_getseq(msg);
 
-	printf("[%d] phfs: MSG_CLOSE ofd=%d\n", getpid(), ofd);
-	close(ofd);
+	log_debug(LOG_PHFS, "MSG_CLOSE ofd=%d", (hd != NULL) ? hd->fd : -1);
+	if (hd != NULL) {
+		phfs_hfree(hd);
+		if (s->stream.handle == h)
+			s->stream.handle = 0;
+	}
 	msg_settype(msg, MSG_CLOSE);
 	msg_setlen(msg, sizeof(int));
 
-	if (msg_send(fd, msg, seq) < 0)
+	if (session_send(s, msg, seq) < 0)
 		return ERR_PHFS_IO;
 	return 1;
 }
 
 
-int phfs_reset(int fd, msg_t *msg, char *sysdir)
+int phfs_reset(session_t *s, msg_t *msg, char *sysdir)
 {
-	int i;
-	struct rlimit rlim;
 	u16 seq = msg_getseq(msg);
 
-	printf("[%d] phfs: MSG_RESET\n", getpid());
-	getrlimit(RLIMIT_NOFILE, &rlim);
-	for (i = 3; i < rlim.rlim_cur; i++) {
-		if (i != fd)
-			close(i);
-	}
+	log_debug(LOG_PHFS, "MSG_RESET");
+	phfs_release(s);
 
 	msg_settype(msg, MSG_RESET);
 	msg_setlen(msg, 0);
 
-	if (msg_send(fd, msg, seq) < 0)
+	if (session_send(s, msg, seq) < 0)
 		return ERR_PHFS_IO;
 	return 1;
 }
 
 
-int phfs_stat(int fd, msg_t *msg, char *sysdir)
+int phfs_stat(session_t *s, msg_t *msg, char *sysdir)
 {
 	msg_phfsio_t *io = (msg_phfsio_t *)msg->data;
 	u16 seq = msg_getseq(msg);
 	u32 hdrsz;
 	u32 l;
 	hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
-	if (io->len > MSG_MAXLEN - hdrsz)
-		io->len = MSG_MAXLEN - hdrsz;
+	if (io->len > s->link.rx.maxlen - hdrsz)
+		io->len = s->link.rx.maxlen - hdrsz;
 
 	struct pho_stat stat_send, test;
 	struct stat st;
+	phfs_handle_t *hd = phfs_hget(s, io->handle);
 
-	fstat(io->handle, &st);
+	if (hd == NULL)
+		memset(&st, 0, sizeof(st));
+	else if (hd->entry != NULL)
+		st = hd->entry->st;
+	else if (fstat(hd->fd, &st) < 0)
+		memset(&st, 0, sizeof(st));
 
 	stat_send.st_dev = st.st_dev;
 	stat_send.st_ino = st.st_ino;
@@ -202,10 +390,266 @@ int phfs_stat(int fd, msg_t *msg, char *sysdir)
 	msg_settype(msg, MSG_FSTAT);
 	msg_setlen(msg, l + hdrsz);
 
-	printf("[%d] phfs: MSG_STAT id:%d  \n", getpid(), io->handle);
+	log_debug(LOG_PHFS, "MSG_STAT id:%d", io->handle);
+
+	if (session_send(s, msg, seq) < 0)
+		return ERR_PHFS_IO;
+	return 1;
+}
+
+/* Function sends k-th chunk of the stream */
+static int phfs_streamsend(session_t *s, msg_t *msg, u32 k)
+{
+	phfs_stream_t *st = &s->stream;
+	msg_phfsio_t *io = (msg_phfsio_t *)msg->data;
+	u32 hdrsz = (u32)((u8 *)io->buff - (u8 *)io);
+	u32 pos = st->pos + k * st->chunk, l, dlen;
+	phfs_handle_t *hd = phfs_hget(s, st->handle);
+	const u8 *data;
+
+	l = (st->end - pos < st->chunk) ? st->end - pos : st->chunk;
+
+	io->handle = st->handle;
+	io->pos = pos;
+	data = phfs_iodata(s, hd, io, pos, l, &dlen);
+
+	l = (io->len > 0) ? io->len : 0;
+
+	/* Short chunk ends the stream */
+	if ((l < st->chunk) && (k + 1 < st->nchunks))
+		st->nchunks = k + 1;
+
+	msg_settype(msg, MSG_STREAM);
+	msg_setlen(msg, dlen + hdrsz);
+
+	return phfs_iosend(s, msg, st->seq + 1 + k, hd, data, pos);
+}
+
+
+/* Function sends chunks fitting in the window */
+static int phfs_streampush(session_t *s, msg_t *msg)
+{
+	phfs_stream_t *st = &s->stream;
+
+	while ((st->sent < st->nchunks) && (st->sent < st->acked + st->window)) {
+		if (phfs_streamsend(s, msg, st->sent) < 0)
+			return ERR_PHFS_IO;
+		st->sent++;
+	}
+
+	return 1;
+}
+
+
+int phfs_stream(session_t *s, msg_t *msg, char *sysdir)
+{
+	msg_phfsstream_t *rq = (msg_phfsstream_t *)msg->data;
+	phfs_stream_t *st = &s->stream;
+	u32 hdrsz = (u32)((u8 *)((msg_phfsio_t *)msg->data)->buff - msg->data);
+
+	st->handle = rq->handle;
+	st->pos = rq->pos;
+	st->end = (rq->len > ~rq->pos) ? ~0u : rq->pos + rq->len;
+	st->chunk = s->link.rx.maxlen - hdrsz;
+	st->nchunks = (st->end - st->pos + st->chunk - 1) / st->chunk;
+	st->window = rq->window;
+	st->acked = 0;
+	st->sent = 0;
+	st->seq = msg_getseq(msg);
+
+	/* Empty range is ended by the single empty chunk */
+	if (st->nchunks == 0)
+		st->nchunks = 1;
+
+	if (st->window == 0)
+		st->window = 1;
+	else if (st->window > PHFS_STREAMWND)
+		st->window = PHFS_STREAMWND;
+
+	log_debug(LOG_PHFS, "MSG_STREAM ofd=%d, pos=%u, len=%u, window=%u",
+		st->handle, st->pos, st->end - st->pos, st->window);
+
+	return phfs_streampush(s, msg);
+}
+
+
+int phfs_sack(session_t *s, msg_t *msg, char *sysdir)
+{
+	msg_phfssack_t *ack = (msg_phfssack_t *)msg->data;
+	phfs_stream_t *st = &s->stream;
+	u16 retr[PHFS_STREAMWND];
+	unsigned int i, n;
+	u32 k;
+
+	/* Ignore acknowledgments of finished or replaced streams */
+	if ((st->handle == 0) || (ack->handle != st->handle) || (msg_getlen(msg) < sizeof(*ack)))
+		return 1;
+
+	n = ack->nretr;
+	if (n > (msg_getlen(msg) - sizeof(*ack)) / sizeof(u16))
+		n = (msg_getlen(msg) - sizeof(*ack)) / sizeof(u16);
+	if (n > PHFS_STREAMWND)
+		n = PHFS_STREAMWND;
+	memcpy(retr, ack->retr, n * sizeof(u16));
+
+	k = (u16)(ack->ack - st->seq);
+	if ((k <= st->sent) && (k > st->acked))
+		st->acked = k;
+
+	/* Resend chunks lost in transit */
+	for (i = 0; i < n; i++) {
+		k = (u16)(retr[i] - st->seq - 1);
+		if ((k >= st->acked) && (k < st->sent) && (phfs_streamsend(s, msg, k) < 0))
+			return ERR_PHFS_IO;
+	}
+
+	if (st->acked == st->nchunks) {
+		st->handle = 0;
+		return 1;
+	}
+
+	return phfs_streampush(s, msg);
+}
+
+
+/* Function hashes blocks of the file opened for writing, they aren't kept as the file may change */
+static int phfs_hashfd(int fd, size_t blksz, size_t first, size_t n, u8 (*dst)[SHA256_LEN])
+{
+	u8 buff[4096];
+	struct stat st;
+	sha256_t c;
+	size_t k, nblocks, l;
+	off_t pos, end;
+	ssize_t r;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	nblocks = (st.st_size + blksz - 1) / blksz;
+	if (first >= nblocks)
+		return 0;
+	if (n > nblocks - first)
+		n = nblocks - first;
+
+	for (k = 0; k < n; k++) {
+		pos = (first + k) * blksz;
+		end = (st.st_size - pos < blksz) ? st.st_size : pos + blksz;
+
+		sha256_init(&c);
+		while (pos < end) {
+			l = (end - pos < sizeof(buff)) ? end - pos : sizeof(buff);
+			if ((r = pread(fd, buff, l, pos)) <= 0)
+				return -1;
+			sha256_update(&c, buff, r);
+			pos += r;
+		}
+		sha256_final(&c, dst[k]);
+	}
+
+	return n;
+}
 
-	if (msg_send(fd, msg, seq) < 0)
+
+int phfs_hash(session_t *s, msg_t *msg, char *sysdir)
+{
+	msg_phfshash_t *h = (msg_phfshash_t *)msg->data;
+	u16 seq = msg_getseq(msg);
+	phfs_handle_t *hd = phfs_hget(s, h->handle);
+	u32 hdrsz = sizeof(*h), blksz = h->blksz, first = 0, n = 0;
+	int res = -1;
+
+	if ((hd != NULL) && (blksz >= PHFS_HASHMINBLK) && (blksz <= PHFS_HASHMAXBLK)) {
+		first = h->pos / blksz;
+		if (h->len != 0)
+			n = ((unsigned long long)h->pos + h->len - 1) / blksz + 1 - first;
+		if (n > (s->link.rx.maxlen - hdrsz) / SHA256_LEN)
+			n = (s->link.rx.maxlen - hdrsz) / SHA256_LEN;
+
+		if (hd->entry != NULL)
+			res = hashcache_get(hd->entry, blksz, first, n, h->hash);
+		else
+			res = phfs_hashfd(hd->fd, blksz, first, n, h->hash);
+	}
+
+	log_debug(LOG_PHFS, "MSG_HASH ofd=%d, pos=%u, len=%u, blksz=%u, ret=%d", h->handle, h->pos, h->len, blksz, res);
+
+	h->pos = first * blksz;
+	h->len = (res > 0) ? res * blksz : 0;
+	h->n = res;
+	msg_settype(msg, MSG_HASH);
+	msg_setlen(msg, hdrsz + ((res > 0) ? res * SHA256_LEN : 0));
+
+	if (session_send(s, msg, seq) < 0)
+		return ERR_PHFS_IO;
+	return 1;
+}
+
+
+/* Function negotiates maximal message length and features, targets not sending MSG_HELLO use MSG_MAXLEN */
+int phfs_hello(session_t *s, msg_t *msg, char *sysdir)
+{
+	u16 seq = msg_getseq(msg);
+	u32 maxlen = MSG_MAXLEN, flags = 0;
+	int flagsfl = (msg_getlen(msg) >= 2 * sizeof(u32));
+
+	/* Large messages are supported only on datagram and TCP transports */
+	if ((msg_getlen(msg) >= sizeof(u32)) && ((s->mode == UDP) || (s->mode == TCP))) {
+		maxlen = *(u32 *)msg->data;
+		if (maxlen > MSG_LARGELEN)
+			maxlen = MSG_LARGELEN;
+		if (maxlen < MSG_MAXLEN)
+			maxlen = MSG_MAXLEN;
+	}
+
+	/* Older targets send maximal length only and get it only */
+	if (flagsfl)
+		flags = ((u32 *)msg->data)[1] & PHFS_HELLO_LZ;
+
+	/* Session stays with short messages if buffers can't be allocated */
+	if (session_setmaxlen(s, maxlen) < 0)
+		maxlen = MSG_MAXLEN;
+
+	log_debug(LOG_PHFS, "MSG_HELLO maxlen=%u, flags=%#x", maxlen, flags);
+
+	((u32 *)msg->data)[0] = maxlen;
+	((u32 *)msg->data)[1] = flags;
+	msg_settype(msg, MSG_HELLO);
+	msg_setlen(msg, (flagsfl ? 2 : 1) * sizeof(u32));
+
+	if (session_send(s, msg, seq) < 0)
+		return ERR_PHFS_IO;
+
+	s->lz = ((flags & PHFS_HELLO_LZ) != 0);
+	return 1;
+}
+
+/* Function negotiates rate of the serial line */
+int phfs_baud(session_t *s, msg_t *msg, char *sysdir)
+{
+	u16 seq = msg_getseq(msg);
+	u32 rate, baudrate = s->baudrate;
+	unsigned int i, n = msg_getlen(msg) / sizeof(u32);
+
+	if (s->mode == SERIAL) {
+		for (i = 0; i < n; i++) {
+			rate = ((u32 *)msg->data)[i];
+			if ((rate > baudrate) && (rate <= (u32)s->serial.maxbaud))
+				baudrate = rate;
+		}
+	}
+
+	log_debug(LOG_PHFS, "MSG_BAUD %u rates, baudrate=%u", n, baudrate);
+
+	*(u32 *)msg->data = baudrate;
+	msg_settype(msg, MSG_BAUD);
+	msg_setlen(msg, sizeof(u32));
+
+	if (session_send(s, msg, seq) < 0)
 		return ERR_PHFS_IO;
+
+	if ((baudrate != (u32)s->baudrate) && (session_setbaudrate(s, baudrate) < 0))
+		log_error(LOG_PHFS, "Can't set baudrate %u on %s", baudrate, s->name);
+
 	return 1;
 }
 
@@ -261,32 +705,47 @@ if (entry->type != vnodeDir)
 #endif
 
 
-int phfs_handlemsg(int fd, msg_t *msg, char *sysdir)
+int phfs_handlemsg(session_t *s, msg_t *msg, char *sysdir)
 {
 	int res = 0;
 
 	switch (msg_gettype(msg)) {
 		case MSG_OPEN:
-			res = phfs_open(fd, msg, sysdir);
+			res = phfs_open(s, msg, sysdir);
 			break;
 		case MSG_READ:
-			res = phfs_read(fd, msg, sysdir);
+			res = phfs_read(s, msg, sysdir);
 			break;
 		case MSG_WRITE:
-			res = phfs_write(fd, msg, sysdir);
+			res = phfs_write(s, msg, sysdir);
 			break;
 		case MSG_CLOSE:
-			res = phfs_close(fd, msg, sysdir);
+			res = phfs_close(s, msg, sysdir);
 			break;
 		case MSG_RESET:
-			res = phfs_reset(fd, msg, sysdir);
+			res = phfs_reset(s, msg, sysdir);
 			break;
 		case MSG_FSTAT:
-			res = phfs_stat(fd, msg, sysdir);
+			res = phfs_stat(s, msg, sysdir);
+			break;
+		case MSG_HELLO:
+			res = phfs_hello(s, msg, sysdir);
+			break;
+		case MSG_STREAM:
+			res = phfs_stream(s, msg, sysdir);
+			break;
+		case MSG_SACK:
+			res = phfs_sack(s, msg, sysdir);
+			break;
+		case MSG_BAUD:
+			res = phfs_baud(s, msg, sysdir);
+			break;
+		case MSG_HASH:
+			res = phfs_hash(s, msg, sysdir);
 			break;
 	}
 	if (res < 0)
-		printf("[%d] phfs: msg error %d \n", getpid(), res);
+		log_error(LOG_PHFS, "msg error %d", res);
 
 	return res;
 }
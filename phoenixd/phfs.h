@@ -16,6 +16,9 @@
 #ifndef _PHFS_H_
 #define _PHFS_H_
 
+#include <hostutils-common/sha256.h>
+#include "msg.h"
+
 
 #define MSG_OPEN   1
 #define MSG_READ   2
@@ -24,6 +27,23 @@
 #define MSG_RESET  5
 #define MSG_FSTAT   6
 #define MSG_HELLO	7
+#define MSG_STREAM  8
+#define MSG_SACK    9
+#define MSG_BAUD    10
+#define MSG_HASH    11
+
+/* MSG_HELLO flags - features requested by the target and accepted by the host */
+#define PHFS_HELLO_LZ  0x1 /* MSG_READ and MSG_STREAM data compressed in LZ4 block format */
+
+/* Shorter data are sent uncompressed */
+#define PHFS_LZMIN  64
+
+/* Block sizes of MSG_HASH */
+#define PHFS_HASHMINBLK  512
+#define PHFS_HASHMAXBLK  (1024 * 1024)
+
+/* Maximal number of not acknowledged stream chunks */
+#define PHFS_STREAMWND  64
 
 /* Opening flags */
 #define PHFS_RDONLY  0
@@ -31,15 +51,93 @@
 #define PHFS_CREATE  2
 
 
+/*
+ * MSG_READ and MSG_STREAM reply carries len bytes of the file, data shorter than len are compressed
+ * (PHFS_HELLO_LZ) into LZ4 block decompressing to len bytes
+ */
 typedef struct _msg_phfsio_t {
 	u32 handle;
 	u32 pos;
 	s32 len;
-	u8  buff[MSG_MAXLEN - (2u * sizeof(u32)) - sizeof(s32)];
+	u8  buff[MSG_LARGELEN - (2u * sizeof(u32)) - sizeof(s32)];
 } msg_phfsio_t;
 
 
-extern int phfs_handlemsg(int fd, msg_t *msg, char *sysdir);
+/*
+ * MSG_STREAM request - file range is pushed back as MSG_STREAM messages carrying msg_phfsio_t, chunk k
+ * has sequence number of the request + 1 + k. Chunk of len shorter than the negotiated length ends the stream.
+ */
+typedef struct _msg_phfsstream_t {
+	u32 handle;
+	u32 pos;
+	u32 len;
+	u32 window; /* number of not acknowledged chunks in flight */
+} msg_phfsstream_t;
+
+
+/* MSG_SACK request - acknowledges chunks received in order up to ack and requests listed chunks again */
+typedef struct _msg_phfssack_t {
+	u32 handle;
+	u16 ack;
+	u16 nretr;
+	u16 retr[];
+} msg_phfssack_t;
+
+
+/*
+ * MSG_BAUD request - serial line rates (u32) supported by the target, reply carries the highest of them
+ * allowed by the host or the current rate (0 on other transports). Host switches after sending the reply and
+ * the target after receiving it, host returns to the initial rate if no frame arrives at the new one.
+ */
+
+
+/*
+ * MSG_HASH request - SHA-256 hashes of the file range split into blocks, block k spans k * blksz bytes up to
+ * (k + 1) * blksz or the end of the file. Reply carries hashes of consecutive blocks starting with the one
+ * holding pos and ending with the one holding pos + len - 1, the last one of the file or the last one fitting
+ * in the message. Reply pos and len are set to n whole blocks, n is -1 on error. Target reads only blocks
+ * differing from its copy, hashes of read-only files are computed once per file version.
+ */
+typedef struct _msg_phfshash_t {
+	u32 handle;
+	u32 pos;
+	u32 len;
+	u32 blksz;
+	s32 n;
+	u8  hash[][SHA256_LEN];
+} msg_phfshash_t;
+
+
+/* Read-ahead stream state */
+typedef struct _phfs_stream_t {
+	u32 handle; /* 0 - stream is not active */
+	u32 pos;
+	u32 end;
+	u32 chunk;
+	u32 nchunks;
+	u32 window;
+	u32 acked;
+	u32 sent;
+	u16 seq;
+} phfs_stream_t;
+
+
+/* Host file opened by the target, slot is free if fd < 0 and entry is NULL */
+typedef struct _phfs_handle_t {
+	int fd;
+	struct _cache_entry_t *entry; /* read-only file served from the content cache */
+} phfs_handle_t;
+
+
+struct _session_t;
+
+
+extern int phfs_handlemsg(struct _session_t *s, msg_t *msg, char *sysdir);
+
+
+/* Function closes all files opened in the session */
+extern void phfs_release(struct _session_t *s);
+
 
 struct	pho_stat
 {
@@ -30,6 +30,7 @@
 #include "msg_udp.h"
 #include "msg_tcp.h"
 #include "dispatch.h"
+#include "log.h"
 
 
 extern char *optarg;
@@ -37,22 +38,88 @@ extern char *optarg;
 #define VERSION "1.5"
 
 
-int phoenixd_session(char *tty, char *kernel, char *sysdir, speed_t baudrate)
+static char **ttys;
+static dmode_t *mode;
+static int ntty;
+
+
+static int add_tty(char *dev, dmode_t m)
 {
-	u8 t;
-	int fd, count, err;
-	u8 buff[BSP_MSGSZ];
+	char **t;
+	dmode_t *md;
+
+	if ((t = realloc(ttys, (ntty + 1) * sizeof(*ttys))) == NULL)
+		return ERR_MEM;
+	ttys = t;
+
+	if ((md = realloc(mode, (ntty + 1) * sizeof(*mode))) == NULL)
+		return ERR_MEM;
+	mode = md;
+
+	ttys[ntty] = dev;
+	mode[ntty++] = m;
+
+	return 0;
+}
 
-	fprintf(stderr, "[%d] Starting phoenixd-child on %s\n", getpid(), tty);
 
-	if ((fd = serial_open(tty, baudrate)) < 0) {
-		fprintf(stderr, "[%d] Can't open %s [%d]!\n", getpid(), tty, fd);
-		return ERR_PHOENIXD_TTY;
+/* Function splits port off addr:port, returns defport if it's missing or invalid */
+static unsigned int phoenixd_port(char *addr, unsigned int defport)
+{
+	char *port;
+	unsigned int p = 0;
+
+	if ((port = strchr(addr, ':')) != NULL) {
+		*port++ = '\0';
+		sscanf(port, "%u", &p);
 	}
 
+	return ((p == 0) || (p > 0xffff)) ? defport : p;
+}
+
+
+int phoenixd_session(char *tty, dmode_t m, void *data, char *kernel, char *sysdir)
+{
+	u8 t;
+	int fd, fd_out, count, err, opened = 0;
+	unsigned int backoff = DISPATCH_BACKOFFMIN;
+	u8 buff[BSP_MSGSZ];
+	bsp_link_t l;
+
+	log_info(LOG_BSP, "Starting phoenixd-child on %s", tty);
+
+	l.fd = -1;
 	for (;;) {
-		if ((count = bsp_recv(fd, &t, (char*)buff, BSP_MSGSZ, 0)) < 0) {
-			bsp_send(fd, BSP_TYPE_RETR, NULL, 0);
+		if (l.fd < 0) {
+			if (dispatch_open(tty, m, data, &fd, &fd_out) < 0) {
+				/* Emulator or TCP serial server may be (re)started after the server */
+				if (!opened && (m != PIPE) && (m != TCP)) {
+					log_error(LOG_BSP, "Can't open %s!", tty);
+					return ERR_PHOENIXD_TTY;
+				}
+				log_debug(LOG_BSP, "Waiting for %s", tty);
+				usleep(backoff * 1000);
+				backoff = (2 * backoff < DISPATCH_BACKOFFMAX) ? 2 * backoff : DISPATCH_BACKOFFMAX;
+				continue;
+			}
+
+			if (opened)
+				log_info(LOG_BSP, "Reconnected to %s", tty);
+			opened = 1;
+			backoff = DISPATCH_BACKOFFMIN;
+			bsp_link(&l, fd, fd_out, m == UDP);
+		}
+
+		if ((count = bsp_recv(&l, &t, (char*)buff, BSP_MSGSZ, 0)) < 0) {
+			if ((count == ERR_SERIAL_CLOSED) || (count == ERR_SERIAL_IO)) {
+				log_info(LOG_BSP, "Connection to %s lost", tty);
+				if (l.fd_out != l.fd)
+					close(l.fd_out);
+				close(l.fd);
+				l.fd = -1;
+				continue;
+			}
+			bsp_send(&l, BSP_TYPE_RETR, NULL, 0);
 			continue;
 		}
 
@@ -60,23 +127,24 @@ int phoenixd_session(char *tty, char *kernel, char *sysdir, speed_t baudrate)
 
 		/* Handle kernel request */
 		case BSP_TYPE_KDATA:
-			if (*(u8 *)buff != 0) {
-				fprintf(stderr, "[%d] Bad kernel request on %s\n", getpid(), tty);
+			if ((*(u8 *)buff & ~BSP_KREQ_LZ) != 0) {
+				log_warn(LOG_BSP, "Bad kernel request on %s", tty);
 				break;
 			}
-			fprintf(stderr, "[%d] Sending kernel to %s\n", getpid(), tty);
+			log_info(LOG_BSP, "Sending kernel to %s%s", tty, (*(u8 *)buff & BSP_KREQ_LZ) ? " (compressed)" : "");
 
-			if ((err = bsp_sendkernel(fd, kernel)) < 0) {
-				fprintf(stderr, "[%d] Sending kernel error [%d]!\n", getpid(), err);
+			if ((err = bsp_sendkernel(&l, kernel, *(u8 *)buff & BSP_KREQ_LZ)) < 0) {
+				log_error(LOG_BSP, "Sending kernel error [%d]!", err);
 				break;
 			}
 			break;
 
 		/* Handle program request */
 		case BSP_TYPE_PDATA:
-			fprintf(stderr, "[%d] Load program request on %s, program=%s\n", getpid(), tty, &buff[2]);
-			if ((err = bsp_sendprogram(fd, (char*)&buff[2], sysdir)) < 0)
-				fprintf(stderr, "[%d] Sending program error [%d]!\n", getpid(), err);
+		case BSP_TYPE_LZREQ:
+			log_info(LOG_BSP, "Load program request on %s, program=%s%s", tty, &buff[2], (t == BSP_TYPE_LZREQ) ? " (compressed)" : "");
+			if ((err = bsp_sendprogram(&l, (char*)&buff[2], sysdir, t == BSP_TYPE_LZREQ)) < 0)
+				log_error(LOG_BSP, "Sending program error [%d]!", err);
 			break;
 		}
 	}
@@ -86,11 +154,12 @@ int phoenixd_session(char *tty, char *kernel, char *sysdir, speed_t baudrate)
 
 void print_help(void)
 {
-	fprintf(stderr, "usage: phoenixd [-1] [-k kernel] [-s bindir]\n"
-			"\t\t-p serial_device [ [-p serial_device] ... ]\n"
-			"\t\t-m pipe_file [ [-m pipe_file] ... ]\n"
+	fprintf(stderr, "usage: phoenixd [-1] [-v] [-l [category=]level] [-M metrics_socket] [-k kernel] [-s bindir]\n"
+			"\t\t[-b baudrate] [-B max_baudrate] -p serial_device [ [-p serial_device] ... ]\n"
+			"\t\t-m pipe_file|unix:qemu_chardev_socket [ [-m pipe_file] ... ]\n"
 			"\t\t-i udp_ip_addr:port [ [-i udp_ip_addr:port] ... ]\n"
 			"\t\t-t tcp_ip_addr:port [ [-t tcp_ip_addr:port] ... ]\n"
+			"\t\t-T tcp_listen_addr:port [ [-T tcp_listen_addr:port] ... ]\n"
 			"\t\t-u load_addr[:jump_addr]\n");
 
 	fprintf(stderr, "\n"
@@ -119,7 +188,23 @@ void print_help(void)
 		"\t\t  in sdp and upload modes) example:\n"
 		"\t\t  --append Xpath1=arg1,arg2 Fpath2=arg1,arg2\n"
 		"-o, --output\t- output file path. By default image is uploaded.\n"
-		"-h, --help\t- prints this message\n");
+		"-h, --help\t- prints this message\n"
+		"\n"
+		"Serial:\n"
+		"-b, --baudrate\t- serial line rate (460800 by default), on Linux any rate\n"
+		"\t\t  supported by the UART can be used\n"
+		"-B, --maxbaudrate\t- highest rate targets may step up to with MSG_BAUD,\n"
+		"\t\t  lines return to -b rate when target stops responding\n"
+		"\n"
+		"Logging:\n"
+		"-v\t\t- increases verbosity (debug - per request, trace - per frame records)\n"
+		"-l\t\t- sets level (error, warn, info, debug, trace) of all or one category\n"
+		"\t\t  (phoenixd, dispatch, phfs, bsp), e.g. -l phfs=debug\n"
+		"\n"
+		"Metrics:\n"
+		"-M\t\t- serves session metrics in Prometheus format on UNIX socket,\n"
+		"\t\t  e.g. curl --unix-socket <path> http://phoenixd/metrics,\n"
+		"\t\t  SIGUSR1 writes them to stderr\n");
 }
 
 
@@ -137,13 +222,13 @@ int main(int argc, char *argv[])
 	char *console = NULL;
 	char *append = NULL;
 	char *output = NULL;
+	char *metrics = NULL;
 
-	speed_t speed;
+	dispatch_serial_t serial = { .baudrate = 460800, .maxbaud = 0 };
 	char *sysdir = "../sys";
-	char *ttys[8];
-	mode_t mode[8] = {SERIAL};
-	int k, i = 0;
-	int res, st;
+	unsigned int port;
+	int k, nchild = 0, nsession = 0;
+	int res, st, verbose = LOGLVL_DEFAULT;
 
 	struct option long_opts[] = {
 		{"sdp", no_argument, &sdp, 1},
@@ -156,6 +241,7 @@ int main(int argc, char *argv[])
 		{"execute", required_argument, 0, 'x'},
 		{"help", no_argument, 0, 'h'},
 		{"baudrate", required_argument, 0, 'b'},
+		{"maxbaudrate", required_argument, 0, 'B'},
 		{"output", required_argument, 0, 'o'},
 		{0, 0, 0, 0}};
 
@@ -164,13 +250,8 @@ int main(int argc, char *argv[])
 		"(c) 2000, 2005 Pawel Pisarczyk\n"
 		"\n");
 
-	if (serial_int2speed(460800, &speed) < 0) {
-		fprintf(stderr, "Wrong baudrate's value!\n");
-		return ERR_ARG;
-	}
-
 	while (1) {
-		c = getopt_long(argc, argv, "h1k:p:s:m:i:u:a:x:c:I:o:b:t:", long_opts, &opt_idx);
+		c = getopt_long(argc, argv, "h1k:p:s:m:i:u:a:x:c:I:o:b:B:t:T:vl:M:", long_opts, &opt_idx);
 		if (c < 0)
 			break;
 
@@ -185,48 +266,31 @@ int main(int argc, char *argv[])
 			bspfl = 1;
 			break;
 		case 'b' :
-			if (serial_int2speed(atoi(optarg), &speed) < 0) {
+			if ((serial.baudrate = atoi(optarg)) <= 0) {
 				fprintf(stderr, "Wrong baudrate's value!\n");
 				return ERR_ARG;
 			}
 			break;
-		case 'm':
-			if (i < 8) {
-				mode[i] = PIPE;
-			}
-		case 'p':
-			if (i == 8) {
-				fprintf(stderr, "Too many ttys for open!\n");
+		case 'B':
+			if ((serial.maxbaud = atoi(optarg)) <= 0) {
+				fprintf(stderr, "Wrong baudrate's value!\n");
 				return ERR_ARG;
 			}
-
-			ttys[i++] = optarg;
 			break;
-
+		case 'm':
+		case 'p':
 		case 'i':
-			if (i >= 8) {
-				fprintf(stderr, "Too many instances (-i %s)\n", optarg);
-				break;
-			}
-			mode[i] = UDP;
-			ttys[i++] = optarg;
-			break;
 		case 't':
-			if (i >= 8) {
-				fprintf(stderr, "Too many instances (-t %s)\n", optarg);
-				break;
-			}
-			mode[i] = TCP;
-			ttys[i++] = optarg;
-			break;
+		case 'T':
 		case 'u':
-			if (i >= 8) {
-				fprintf(stderr, "Too many instances (-u %s)\n", optarg);
-				break;
+			/* For USB_VYBRID optarg is a load address */
+			res = add_tty(optarg, (c == 'm') ? PIPE : (c == 'i') ? UDP : (c == 't') ? TCP : (c == 'T') ? TCP_LISTEN : (c == 'u') ? USB_VYBRID : SERIAL);
+			if (res < 0) {
+				fprintf(stderr, "Can't add %s\n", optarg);
+				return ERR_MEM;
 			}
-			mode[i] = USB_VYBRID;
-			ttys[i++] = optarg; /* Load address */
 			break;
+
 		case 'a':
 		case 'x':
 			ind = optind - 1;
@@ -242,6 +306,18 @@ int main(int argc, char *argv[])
 				ind++;
 			}
 			break;
+		case 'v':
+			log_setlevel(-1, ++verbose);
+			break;
+		case 'l':
+			if (log_parse(optarg) < 0) {
+				fprintf(stderr, "Wrong log level '%s'!\n", optarg);
+				return ERR_ARG;
+			}
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
 		case 'I':
 			initrd = optarg;
 			break;
@@ -280,67 +356,78 @@ int main(int argc, char *argv[])
 		return res;
 	}
 
-	if (i == 0) {
+	if (ntty == 0) {
 		fprintf(stderr, "You have to specify at least one serial device, pipe or IP address\n\n");
 		print_help();
 		return -1;
 	}
 
 	free(append);
-	for (k = 0; k < i; k++) {
+
+	/* Without -B lines stay at -b rate */
+	if (serial.maxbaud < serial.baudrate)
+		serial.maxbaud = serial.baudrate;
+
+	/* Legacy BSP and USB loaders block on their devices, run them in separate processes */
+	for (k = 0; k < ntty; k++) {
+		if (!bspfl && (mode[k] != USB_VYBRID))
+			continue;
+
 		res = fork();
 		if(res < 0) {
 			fprintf(stderr, "Fork error for %d child!\n", k);
 			continue;
 		} else if(res == 0) {
-			if (bspfl)
-				res = phoenixd_session(ttys[k], kernel, sysdir, speed);
-			else if(mode[k] == USB_VYBRID) {
+			if (bspfl) {
+				port = (mode[k] == UDP) ? PHFS_UDPPORT : PHFS_TCPPORT;
+				if ((mode[k] == UDP) || (mode[k] == TCP) || (mode[k] == TCP_LISTEN))
+					port = phoenixd_port(ttys[k], port);
+
+				res = phoenixd_session(ttys[k], mode[k], (mode[k] == SERIAL) ? (void *)&serial : (void *)&port, kernel, sysdir);
+			}
+			else {
 				char *jumAddr = NULL;
 				if ((jumAddr = strchr(ttys[k], ':')) != NULL)
 					*jumAddr++ = '\0';
 
 				res = usb_vybrid_dispatch(kernel,ttys[k], jumAddr, NULL, 0);
-			} else {
-				char *port;
-				unsigned speed_port = 0;
-
-				if (mode[k] == UDP) {
-					port = strchr(ttys[k], ':');
-					if (port != NULL) {
-						*port++ = '\0';
-						sscanf(port, "%u", &speed_port);
-					}
-
-					if ((speed_port == 0) || (speed_port > 0xffff)) {
-						speed_port = PHFS_UDPPORT;
-					}
-
-					res = dispatch(ttys[k], mode[k], sysdir, (void *)&speed_port);
-				}
-				else if (mode[k] == TCP) {
-					port = strchr(ttys[k], ':');
-					if (port != NULL) {
-						*port++ = '\0';
-						sscanf(port, "%u", &speed_port);
-					}
-
-					if ((speed_port == 0) || (speed_port > 0xffff)) {
-						speed_port = PHFS_TCPPORT;
-					}
-
-					res = dispatch(ttys[k], mode[k], sysdir, (void *)&speed_port);
-				}
-				else {
-					res = dispatch(ttys[k], mode[k], sysdir, (void *)&speed);
-				}
 			}
 			return res;
-		} //else
-			//free(ttys[k]);
+		}
+		nchild++;
+	}
+
+	/* BSP2 sessions are served by the single dispatcher */
+	for (k = 0; k < ntty; k++) {
+		if (bspfl || (mode[k] == USB_VYBRID))
+			continue;
+
+		if (mode[k] == UDP) {
+			port = phoenixd_port(ttys[k], PHFS_UDPPORT);
+			res = dispatch_add(ttys[k], mode[k], (void *)&port);
+		}
+		else if ((mode[k] == TCP) || (mode[k] == TCP_LISTEN)) {
+			port = phoenixd_port(ttys[k], PHFS_TCPPORT);
+			res = dispatch_add(ttys[k], mode[k], (void *)&port);
+		}
+		else {
+			res = dispatch_add(ttys[k], mode[k], (void *)&serial);
+		}
+
+		if (res == 0)
+			nsession++;
 	}
 
-	for (k = 0; k < i; k++)
+	if ((nsession != 0) && (metrics != NULL))
+		dispatch_metrics(metrics);
+
+	if (nsession != 0)
+		dispatch(sysdir);
+
+	for (k = 0; k < nchild; k++)
 		wait(&st);
+
+	free(ttys);
+	free(mode);
 	return 0;
 }
@@ -0,0 +1,219 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Descriptor readiness notification (epoll with poll fallback)
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <hostutils-common/errors.h>
+#include "poller.h"
+
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+
+
+static int epfd = -1;
+
+
+static unsigned int poller_toepoll(unsigned int events)
+{
+	return ((events & POLLER_IN) ? EPOLLIN : 0) | ((events & POLLER_OUT) ? EPOLLOUT : 0);
+}
+
+
+int poller_init(void)
+{
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return ERR_DISPATCH_IO;
+
+	return 0;
+}
+
+
+int poller_add(int fd, unsigned int events, void *data)
+{
+	struct epoll_event ev;
+
+	ev.events = poller_toepoll(events);
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return ERR_DISPATCH_IO;
+
+	return 0;
+}
+
+
+int poller_mod(int fd, unsigned int events, void *data)
+{
+	struct epoll_event ev;
+
+	ev.events = poller_toepoll(events);
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return ERR_DISPATCH_IO;
+
+	return 0;
+}
+
+
+int poller_del(int fd)
+{
+	struct epoll_event ev;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev) < 0)
+		return ERR_DISPATCH_IO;
+
+	return 0;
+}
+
+
+int poller_wait(poller_event_t *ev, int n, int timeout)
+{
+	struct epoll_event eev[64];
+	int i, res;
+
+	if (n > sizeof(eev) / sizeof(eev[0]))
+		n = sizeof(eev) / sizeof(eev[0]);
+
+	if ((res = epoll_wait(epfd, eev, n, timeout)) < 0)
+		return (errno == EINTR) ? 0 : ERR_DISPATCH_IO;
+
+	for (i = 0; i < res; i++) {
+		ev[i].data = eev[i].data.ptr;
+		ev[i].events = ((eev[i].events & EPOLLIN) ? POLLER_IN : 0) |
+			((eev[i].events & EPOLLOUT) ? POLLER_OUT : 0) |
+			((eev[i].events & (EPOLLERR | EPOLLHUP)) ? POLLER_ERR : 0);
+	}
+
+	return res;
+}
+
+#else
+
+#include <poll.h>
+
+
+static struct {
+	struct pollfd *fds;
+	void **data;
+	unsigned int n, sz;
+} poller;
+
+
+static unsigned int poller_topoll(unsigned int events)
+{
+	return ((events & POLLER_IN) ? POLLIN : 0) | ((events & POLLER_OUT) ? POLLOUT : 0);
+}
+
+
+static int poller_find(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < poller.n; i++) {
+		if (poller.fds[i].fd == fd)
+			return i;
+	}
+
+	return -1;
+}
+
+
+int poller_init(void)
+{
+	poller.n = 0;
+	return 0;
+}
+
+
+int poller_add(int fd, unsigned int events, void *data)
+{
+	struct pollfd *fds;
+	void **d;
+	unsigned int sz;
+
+	if (poller.n == poller.sz) {
+		sz = poller.sz ? 2 * poller.sz : 16;
+		if ((fds = realloc(poller.fds, sz * sizeof(*fds))) == NULL)
+			return ERR_MEM;
+		poller.fds = fds;
+		if ((d = realloc(poller.data, sz * sizeof(*d))) == NULL)
+			return ERR_MEM;
+		poller.data = d;
+		poller.sz = sz;
+	}
+
+	poller.fds[poller.n].fd = fd;
+	poller.fds[poller.n].events = poller_topoll(events);
+	poller.data[poller.n++] = data;
+
+	return 0;
+}
+
+
+int poller_mod(int fd, unsigned int events, void *data)
+{
+	int i;
+
+	if ((i = poller_find(fd)) < 0)
+		return ERR_DISPATCH_IO;
+
+	poller.fds[i].events = poller_topoll(events);
+	poller.data[i] = data;
+
+	return 0;
+}
+
+
+int poller_del(int fd)
+{
+	int i;
+
+	if ((i = poller_find(fd)) < 0)
+		return ERR_DISPATCH_IO;
+
+	poller.fds[i] = poller.fds[--poller.n];
+	poller.data[i] = poller.data[poller.n];
+
+	return 0;
+}
+
+
+int poller_wait(poller_event_t *ev, int n, int timeout)
+{
+	unsigned int i;
+	int res, k;
+
+	if ((res = poll(poller.fds, poller.n, timeout)) < 0)
+		return (errno == EINTR) ? 0 : ERR_DISPATCH_IO;
+
+	for (i = 0, k = 0; (i < poller.n) && (k < res) && (k < n); i++) {
+		if (poller.fds[i].revents == 0)
+			continue;
+
+		ev[k].data = poller.data[i];
+		ev[k].events = ((poller.fds[i].revents & POLLIN) ? POLLER_IN : 0) |
+			((poller.fds[i].revents & POLLOUT) ? POLLER_OUT : 0) |
+			((poller.fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ? POLLER_ERR : 0);
+		k++;
+	}
+
+	return k;
+}
+
+#endif
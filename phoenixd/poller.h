@@ -0,0 +1,47 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Phoenix server
+ *
+ * Descriptor readiness notification (epoll with poll fallback)
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _POLLER_H_
+#define _POLLER_H_
+
+
+/* Event flags */
+#define POLLER_IN   1
+#define POLLER_OUT  2
+#define POLLER_ERR  4
+
+
+typedef struct _poller_event_t {
+	unsigned int events;
+	void *data;
+} poller_event_t;
+
+
+extern int poller_init(void);
+
+
+extern int poller_add(int fd, unsigned int events, void *data);
+
+
+extern int poller_mod(int fd, unsigned int events, void *data);
+
+
+extern int poller_del(int fd);
+
+
+/* Function waits for events, timeout in ms (-1 - infinite), returns number of events */
+extern int poller_wait(poller_event_t *ev, int n, int timeout);
+
+
+#endif